@@ -0,0 +1,878 @@
+// Benchmarks for the JSON front ends and the content writer. Every scenario prints one
+// line per measurement as "scenario key=value ...", so runs can be diffed or collected.
+// Every PDF written is parsed back with PDFParser and reported as valid=0|1; failed checks
+// are printed on stderr and make the exit status 1.
+//
+//   BriskyPdfBench [--scenario document|streaming|memory|template|batch|compression|operators|
+//                              text|file|cells|sample|scaling|workers|logo|all]
+//                  [--rows N] [--cols N] [--spans N] [--pages N] [--text N] [--shapes N]
+//                  [--images N] [--image path] [--font path] [--iterations N]
+//                  [--threads N] [--jobs N] [--ops N] [--seed N] [--stats 0|1]
+//                  [--trace 0|1] [--out dir] [--sample path] [--max-rows N]
+//                  [--workers N] [--logo-pages N]
+//
+//   text     table text in one text object with relative Td moves, and in one BT..ET with
+//            an absolute Tm per line as before; streams are not compressed, so bytes is
+//            mostly content stream
+//   file     the job read from disk by processFromFile (mapped, parsed in place) and by the
+//            copy into a std::string plus Parse it replaced, each in its own process so
+//            peak_rss_mib is its own; parse_s includes reading the file for the copy
+//   cells    bytes per cell of TableModel for the generated table
+//   sample   --sample (examples/Sample.json) with its table repeated to 10k rows
+//   scaling  streamed table of 1k, 10k, ... rows up to --max-rows, with time per row
+//   workers  output of --workers layout threads must be byte-identical to 0 threads
+//   logo     --logo-pages pages repeating --image (image.jpg by default); the image must be
+//            embedded once
+
+#include "BriskyPdfJson.h"
+#include "BriskyPdfBatch.h"
+#include "BriskyPdfContent.h"
+#include "JobGenerator.h"
+#include "PDFWriter/InputFile.h"
+#include "PDFWriter/InputByteArrayStream.h"
+#include "PDFWriter/PDFParser.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct Options {
+    std::string scenario = "document";
+    JobSpec spec;
+    int iterations = 3;
+    size_t threads = 0;
+    int jobs = 32;
+    long ops = 200000;
+    bool stats = false;
+    bool trace = false;
+    std::string outDir = ".";
+    std::string samplePath = "Sample.json";
+    int maxRows = 1000000;
+    size_t workers = 0; // 0 for one per core
+    int logoPages = 1000;
+};
+
+// Rows of the table in Sample.json after scaling
+const int kSampleRows = 10000;
+
+// Failed checks so far; any makes the exit status 1
+int checkFailures = 0;
+
+bool check(bool ok, const char *scenario, const std::string &what)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "%s: %s\n", scenario, what.c_str());
+        ++checkFailures;
+    }
+    return ok;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Peak resident set size of the process so far, in MiB
+double peakRssMiB()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss / 1024.0; // KiB on Linux
+#endif
+    return 0;
+}
+
+long long fileBytes(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    return file ? static_cast<long long>(file.tellg()) : 0;
+}
+
+std::string outputPath(const Options &options, const std::string &name)
+{
+    return options.outDir + "/" + name;
+}
+
+// Page count of a PDF read back with PDFParser; -1 when it does not parse
+int parsedPages(IByteReaderWithPosition *input)
+{
+    PDFParser parser;
+    if (parser.StartPDFParsing(input) != PDFHummus::eSuccess)
+        return -1;
+    return static_cast<int>(parser.GetPagesCount());
+}
+
+int parsedPages(const std::string &path)
+{
+    InputFile file;
+    if (file.OpenFile(path) != PDFHummus::eSuccess)
+        return -1;
+    return parsedPages(file.GetInputStream());
+}
+
+int parsedPages(std::vector<uint8_t> &bytes)
+{
+    InputByteArrayStream input(bytes.data(), static_cast<IOBasicTypes::LongFilePositionType>(bytes.size()));
+    return parsedPages(&input);
+}
+
+bool checkParses(const char *scenario, const std::string &name, int parsed, int pages)
+{
+    return check(parsed == pages, scenario,
+                 name + " parses back with " + std::to_string(parsed) + " pages instead of " + std::to_string(pages));
+}
+
+void report(const char *scenario, const char *variant, int pages, long long bytes,
+            double generateSeconds, double parseSeconds, double totalSeconds, size_t fontBytes, bool valid)
+{
+    double pagesPerSecond = totalSeconds > 0 ? pages / totalSeconds : 0;
+    double mbPerSecond = totalSeconds > 0 ? bytes / totalSeconds / (1024.0 * 1024.0) : 0;
+    std::printf("%s variant=%s pages=%d bytes=%lld font_bytes=%zu generate_s=%.4f parse_s=%.4f render_s=%.4f "
+                "total_s=%.4f pages_per_s=%.1f mb_per_s=%.2f peak_rss_mib=%.1f valid=%d\n",
+                scenario, variant, pages, bytes, fontBytes, generateSeconds, parseSeconds,
+                totalSeconds - parseSeconds, totalSeconds, pagesPerSecond, mbPerSecond, peakRssMiB(), valid ? 1 : 0);
+    std::fflush(stdout);
+}
+
+void reportStats(const char *scenario, const char *variant, const RenderStats &stats)
+{
+    std::printf("%s-stats variant=%s", scenario, variant);
+    for (int phase = 0; phase < RenderStats::PHASE_COUNT; ++phase)
+    {
+        std::printf(" %s_s=%.4f", RenderStats::phaseName(static_cast<RenderStats::Phase>(phase)), stats.seconds[phase]);
+    }
+    std::printf(" operators=%llu glyph_measures=%llu glyph_hits=%llu glyph_misses=%llu image_hits=%llu "
+                "image_misses=%llu image_xobjects=%llu form_xobjects=%llu\n",
+                (unsigned long long)stats.operators, (unsigned long long)stats.glyphMeasures,
+                (unsigned long long)stats.glyphCacheHits, (unsigned long long)stats.glyphCacheMisses,
+                (unsigned long long)stats.imageCacheHits, (unsigned long long)stats.imageCacheMisses,
+                (unsigned long long)stats.imageXObjects, (unsigned long long)stats.formXObjects);
+    std::fflush(stdout);
+}
+
+struct JobResult {
+    bool ok = false;
+    int pages = 0;
+    long long bytes = 0;
+    double seconds = 0; // fastest run
+    RenderStats stats;
+};
+
+// json, which writes fileName, through processFromString or processFromStringStreaming, repeated;
+// reports the fastest run
+JobResult runJob(const Options &options, const char *scenario, const std::string &variant, const std::string &json,
+                 const std::string &fileName, double generateSeconds, bool streaming)
+{
+    JobResult result;
+    double best = 0, bestParse = 0;
+    int pages = 0;
+    size_t fontBytes = 0;
+    RenderStats bestStats;
+    std::shared_ptr<Tracer> tracer;
+    if (options.trace)
+    {
+        tracer = std::make_shared<Tracer>();
+        tracer->setEnabled(true);
+    }
+    for (int i = 0; i < options.iterations; ++i)
+    {
+        PDFJson job(nullptr);
+        job.setStatsEnabled(options.stats);
+        job.setTracer(tracer);
+        // Only the last run is kept in the trace
+        if (tracer)
+            tracer->clear();
+        auto start = Clock::now();
+        bool ok = streaming ? job.processFromStringStreaming(json) : job.processFromString(json);
+        double seconds = secondsSince(start);
+        if (!check(ok, scenario, variant + " job failed"))
+            return result;
+        if (i == 0 || seconds < best)
+        {
+            best = seconds;
+            bestParse = job.getParseSeconds();
+            bestStats = job.getStats();
+        }
+        pages = job.getPageCount();
+        if (i == options.iterations - 1)
+            fontBytes = job.getEmbeddedFontBytes();
+    }
+    bool valid = checkParses(scenario, fileName, parsedPages(fileName), pages);
+    result.ok = true;
+    result.pages = pages;
+    result.bytes = fileBytes(fileName);
+    result.seconds = best;
+    result.stats = bestStats;
+    report(scenario, variant.c_str(), pages, result.bytes, generateSeconds, bestParse, best, fontBytes, valid);
+    if (options.stats)
+        reportStats(scenario, variant.c_str(), bestStats);
+    if (tracer)
+    {
+        std::string tracePath = outputPath(options, std::string(scenario) + "-" + variant + ".trace.json");
+        if (!tracer->writeFile(tracePath))
+            std::fprintf(stderr, "%s: cannot write %s\n", scenario, tracePath.c_str());
+    }
+    return result;
+}
+
+// One generated job, see runJob
+JobResult runDocument(const Options &options, const char *scenario, const std::string &variant, JobSpec spec, bool streaming)
+{
+    spec.fileName = outputPath(options, std::string(scenario) + "-" + variant + ".pdf");
+    auto start = Clock::now();
+    std::string json = generateJob(spec);
+    return runJob(options, scenario, variant, json, spec.fileName, secondsSince(start), streaming);
+}
+
+// Same job as "document", rendered into a buffer instead of a file
+void runMemory(const Options &options)
+{
+    JobSpec spec = options.spec;
+    spec.fileName = outputPath(options, "memory-buffer.pdf");
+    auto start = Clock::now();
+    std::string json = generateJob(spec);
+    double generateSeconds = secondsSince(start);
+
+    double best = 0, bestParse = 0;
+    int pages = 0;
+    size_t fontBytes = 0;
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < options.iterations; ++i)
+    {
+        PDFJson job(nullptr);
+        start = Clock::now();
+        bool ok = job.processFromString(json, bytes);
+        double seconds = secondsSince(start);
+        if (!check(ok, "memory", "job failed"))
+            return;
+        if (i == 0 || seconds < best)
+        {
+            best = seconds;
+            bestParse = job.getParseSeconds();
+        }
+        pages = job.getPageCount();
+        fontBytes = job.getEmbeddedFontBytes();
+    }
+    bool valid = checkParses("memory", "buffer", parsedPages(bytes), pages);
+    report("memory", "buffer", pages, static_cast<long long>(bytes.size()), generateSeconds, bestParse, best, fontBytes, valid);
+}
+
+void runTemplate(const Options &options)
+{
+    JobSpec spec = options.spec;
+    spec.fileName = outputPath(options, "template.pdf");
+    std::string json = generateJob(spec);
+
+    PDFJson compiler(nullptr);
+    auto start = Clock::now();
+    auto tpl = compiler.compileTemplate(json);
+    double compileSeconds = secondsSince(start);
+    if (!check(tpl != nullptr, "template", "compile failed"))
+        return;
+
+    double best = 0;
+    int pages = 0;
+    for (int i = 0; i < options.iterations; ++i)
+    {
+        PDFJson job(nullptr);
+        start = Clock::now();
+        if (!check(job.processTemplate(*tpl, TemplateValues()), "template", "render failed"))
+            return;
+        double seconds = secondsSince(start);
+        if (i == 0 || seconds < best)
+            best = seconds;
+        pages = job.getPageCount();
+    }
+    bool valid = checkParses("template", spec.fileName, parsedPages(spec.fileName), pages);
+    report("template", "compiled", pages, fileBytes(spec.fileName), 0, compileSeconds, best + compileSeconds, 0, valid);
+}
+
+void runBatch(const Options &options)
+{
+    std::vector<std::string> jobs;
+    JobSpec spec = options.spec;
+    for (int i = 0; i < options.jobs; ++i)
+    {
+        spec.fileName = outputPath(options, "batch-" + std::to_string(i) + ".pdf");
+        spec.seed = options.spec.seed + i;
+        jobs.push_back(generateJob(spec));
+    }
+
+    PDFBatch batch(options.threads);
+    BatchReport result = batch.processStrings(jobs);
+    long long bytes = 0;
+    size_t invalid = 0;
+    for (int i = 0; i < options.jobs; ++i)
+    {
+        std::string path = outputPath(options, "batch-" + std::to_string(i) + ".pdf");
+        bytes += fileBytes(path);
+        if (parsedPages(path) <= 0)
+            invalid++;
+    }
+    check(result.failed == 0 && invalid == 0, "batch", "failed or unparsable jobs");
+    std::printf("batch threads=%zu jobs=%zu failed=%zu invalid=%zu seconds=%.4f jobs_per_s=%.1f mb_per_s=%.2f "
+                "peak_rss_mib=%.1f\n",
+                batch.getThreads(), result.jobs, result.failed, invalid, result.seconds, result.jobsPerSecond,
+                result.seconds > 0 ? bytes / result.seconds / (1024.0 * 1024.0) : 0, peakRssMiB());
+    std::fflush(stdout);
+}
+
+// Size/time trade-off of the output options on a 10k-row table
+void runCompression(const Options &options)
+{
+    JobSpec spec = options.spec;
+    spec.rows = 10000;
+    spec.pages = 1;
+    spec.textBlocks = spec.shapes = spec.images = 0;
+
+    struct Variant {
+        const char *name;
+        bool compress;
+        bool xrefStream;
+    };
+    const Variant variants[] = {{"flate", true, false}, {"plain", false, false}, {"flate-xref-stream", true, true}};
+    for (const auto &variant : variants)
+    {
+        spec.compress = variant.compress;
+        spec.xrefStream = variant.xrefStream;
+        runDocument(options, "compression", variant.name, spec, false);
+    }
+}
+
+void runText(const Options &options)
+{
+    JobSpec spec = options.spec;
+    spec.rows = 10000;
+    spec.pages = 1;
+    spec.textBlocks = spec.shapes = spec.images = 0;
+    spec.compress = false;
+
+    struct Variant {
+        const char *name;
+        bool coalesce;
+    };
+    const Variant variants[] = {{"coalesced", true}, {"uncoalesced", false}};
+    for (const auto &variant : variants)
+    {
+        spec.coalesceText = variant.coalesce;
+        runDocument(options, "text", variant.name, spec, false);
+    }
+}
+
+// Cost per operator of writing through AbstractContentContext directly and through ContentEmitter
+void runOperators(const Options &options)
+{
+    std::string path = outputPath(options, "operators.pdf");
+    PDFWriter writer;
+    if (writer.StartPDF(path, ePDFVersion13) != PDFHummus::eSuccess)
+    {
+        std::fprintf(stderr, "operators: cannot create %s\n", path.c_str());
+        return;
+    }
+    PDFPage *page = new PDFPage();
+    page->SetMediaBox(PDFRectangle(0, 0, 595, 842));
+    PageContentContext *context = writer.StartPageContentContext(page);
+
+    // Alternating colours keep the emitter from skipping the rg operators
+    auto start = Clock::now();
+    for (long i = 0; i < options.ops; ++i)
+    {
+        double x = (i % 50) * 11.25, y = (i / 50 % 70) * 11.5;
+        context->rg(i & 1 ? 0.9 : 0.8, 0.9, 0.95);
+        context->re(x, y, 11.25, 11.5);
+        context->f();
+    }
+    double directSeconds = secondsSince(start);
+
+    ContentEmitter emitter;
+    emitter.bind(context);
+    start = Clock::now();
+    for (long i = 0; i < options.ops; ++i)
+    {
+        double x = (i % 50) * 11.25, y = (i / 50 % 70) * 11.5;
+        emitter.fillRGB(i & 1 ? 0.9 : 0.8, 0.9, 0.95);
+        emitter.re(x, y, 11.25, 11.5);
+        emitter.f();
+    }
+    emitter.finish();
+    double emitterSeconds = secondsSince(start);
+
+    writer.EndPageContentContext(context);
+    writer.WritePageAndRelease(page);
+    writer.EndPDF();
+
+    ContentBuffer buffer;
+    start = Clock::now();
+    for (long i = 0; i < options.ops; ++i)
+    {
+        buffer.number(i * 0.0625 + 0.3);
+        if (buffer.size() > buffer.capacity())
+            buffer.clear();
+    }
+    double formatSeconds = secondsSince(start);
+
+    char text[64];
+    size_t sink = 0;
+    start = Clock::now();
+    for (long i = 0; i < options.ops; ++i)
+        sink += std::snprintf(text, sizeof(text), "%.4f ", i * 0.0625 + 0.3);
+    double snprintfSeconds = secondsSince(start);
+
+    double perOp = 1e9 / (options.ops * 3.0);
+    std::printf("operators ops=%ld direct_ns=%.1f emitter_ns=%.1f number_ns=%.1f snprintf_ns=%.1f (%zu)\n",
+                options.ops * 3, directSeconds * perOp, emitterSeconds * perOp,
+                formatSeconds * 1e9 / options.ops, snprintfSeconds * 1e9 / options.ops, sink);
+    std::fflush(stdout);
+}
+
+// One run of the "file" scenario; mapped picks processFromFile over the old copy and Parse
+bool runFileJob(const char *variant, const std::string &path, const std::string &pdfPath, bool mapped,
+                std::shared_ptr<Logger> logger)
+{
+    PDFJson job(nullptr);
+    job.setLogger(logger);
+    auto start = Clock::now();
+    double readSeconds = 0;
+    bool ok;
+    if (mapped)
+    {
+        ok = job.processFromFile(path);
+    }
+    else
+    {
+        // What processFromFile did before: file to stringstream to std::string, then Parse
+        std::ifstream file(path, std::ios::binary);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        std::string json = buffer.str();
+        readSeconds = secondsSince(start);
+        ok = job.processFromString(json);
+    }
+    double seconds = secondsSince(start);
+    if (!check(ok, "file", std::string(variant) + " job failed"))
+        return false;
+    int pages = job.getPageCount();
+    bool valid = checkParses("file", pdfPath, parsedPages(pdfPath), pages);
+    report("file", variant, pages, fileBytes(pdfPath), 0, readSeconds + job.getParseSeconds(), seconds,
+           job.getEmbeddedFontBytes(), valid);
+    return valid;
+}
+
+void runFile(const Options &options)
+{
+    JobSpec spec = options.spec;
+    spec.fileName = outputPath(options, "file.pdf");
+    std::string path = outputPath(options, "file-job.json");
+    {
+        std::string json = generateJob(spec);
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(json.data(), json.size());
+        if (!check(static_cast<bool>(file), "file", "cannot write " + path))
+            return;
+    }
+
+    struct Variant {
+        const char *name;
+        bool mapped;
+    };
+    const Variant variants[] = {{"mmap-insitu", true}, {"copy-parse", false}};
+    for (const auto &variant : variants)
+    {
+#ifndef _WIN32
+        std::fflush(stdout);
+        pid_t child = fork();
+        if (child > 0)
+        {
+            int status = 0;
+            waitpid(child, &status, 0);
+            check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "file", std::string(variant.name) + " run failed");
+            continue;
+        }
+        if (child == 0)
+        {
+            // The default logger's thread did not survive fork
+            auto logger = std::make_shared<Logger>(std::make_shared<StreamLogSink>(), LogLevel::WARNING);
+            bool ok = runFileJob(variant.name, path, spec.fileName, variant.mapped, logger);
+            logger->flush();
+            std::fflush(stdout);
+            _exit(ok ? 0 : 1);
+        }
+        check(false, "file", "cannot start a process");
+        return;
+#else
+        runFileJob(variant.name, path, spec.fileName, variant.mapped, Logger::getDefault());
+#endif
+    }
+}
+
+// Bytes per cell of the TableModel built from the generated table, next to an estimate for the
+// TableRow/TableCell front end it is converted from
+void runCells(const Options &options)
+{
+    JobSpec spec = options.spec;
+    spec.pages = 1;
+    spec.textBlocks = spec.shapes = spec.images = 0;
+    std::string json = generateJob(spec);
+    Document document;
+    document.Parse(json.c_str());
+    if (!check(!document.HasParseError(), "cells", "generated job does not parse"))
+        return;
+    const Value &rows = document["pages"][0u]["objects"][0u]["rows"];
+
+    TableModel model;
+    size_t frontEndBytes = 0;
+    auto start = Clock::now();
+    for (auto row = rows.Begin(); row != rows.End(); ++row)
+    {
+        TableRow tableRow;
+        tableRow.height = (*row)["height"].GetDouble();
+        tableRow.isHeader = row->HasMember("is_header") && (*row)["is_header"].GetBool();
+        const Value &cells = (*row)["cells"];
+        for (auto cell = cells.Begin(); cell != cells.End(); ++cell)
+        {
+            auto tableCell = std::make_shared<TableCell>();
+            tableCell->content = (*cell)["content"].GetString();
+            if (cell->HasMember("colspan"))
+                tableCell->colspan = (*cell)["colspan"].GetInt();
+            if (cell->HasMember("rowspan"))
+                tableCell->rowspan = (*cell)["rowspan"].GetInt();
+            tableCell->isHeader = tableRow.isHeader;
+            if (cell->HasMember("background_color"))
+            {
+                const Value &color = (*cell)["background_color"];
+                tableCell->backgroundColor = TableStyle::Color(color["r"].GetDouble(), color["g"].GetDouble(), color["b"].GetDouble());
+            }
+            // make_shared puts the cell after the use and weak counts and a vtable pointer
+            frontEndBytes += sizeof(TableCell) + 2 * sizeof(int) + sizeof(void *);
+            const char *text = tableCell->content.data();
+            const char *object = reinterpret_cast<const char *>(&tableCell->content);
+            if (text < object || text >= object + sizeof(std::string))
+                frontEndBytes += tableCell->content.capacity() + 1;
+            tableRow.cells.push_back(tableCell);
+        }
+        frontEndBytes += sizeof(TableRow) + tableRow.cells.capacity() * sizeof(std::shared_ptr<TableCell>);
+        model.addRow(tableRow);
+    }
+    double seconds = secondsSince(start);
+
+    double cellCount = model.cellCount() ? static_cast<double>(model.cellCount()) : 1;
+    std::printf("cells rows=%zu cells=%zu model_bytes=%zu bytes_per_cell=%.1f text_bytes_per_cell=%.1f "
+                "front_end_bytes_per_cell=%.1f convert_s=%.4f\n",
+                model.rowCount(), model.cellCount(), model.memoryBytes(), model.memoryBytes() / cellCount,
+                model.textBuffer.size() / cellCount, frontEndBytes / cellCount, seconds);
+    std::fflush(stdout);
+}
+
+// Copies value with fileName as "file_name" and the rows of every table repeated in whole
+// copies, so spans stay intact, until there are at least rows of them
+void writeScaled(const Value &value, Writer<StringBuffer> &writer, int rows, const std::string *fileName)
+{
+    if (value.IsObject())
+    {
+        bool isTable = value.HasMember("type") && value["type"].IsString() && std::string(value["type"].GetString()) == "table";
+        writer.StartObject();
+        for (auto member = value.MemberBegin(); member != value.MemberEnd(); ++member)
+        {
+            std::string name(member->name.GetString(), member->name.GetStringLength());
+            writer.Key(name.c_str(), static_cast<SizeType>(name.size()));
+            if (fileName && name == "file_name")
+            {
+                writer.String(fileName->c_str(), static_cast<SizeType>(fileName->size()));
+            }
+            else if (isTable && name == "rows" && member->value.IsArray() && member->value.Size() > 0)
+            {
+                writer.StartArray();
+                for (int written = 0; written < rows;)
+                {
+                    for (auto row = member->value.Begin(); row != member->value.End(); ++row, ++written)
+                        row->Accept(writer);
+                }
+                writer.EndArray();
+            }
+            else
+            {
+                writeScaled(member->value, writer, rows, nullptr);
+            }
+        }
+        writer.EndObject();
+    }
+    else if (value.IsArray())
+    {
+        writer.StartArray();
+        for (auto element = value.Begin(); element != value.End(); ++element)
+            writeScaled(*element, writer, rows, nullptr);
+        writer.EndArray();
+    }
+    else
+    {
+        value.Accept(writer);
+    }
+}
+
+// examples/Sample.json with its table scaled to kSampleRows rows
+void runSample(const Options &options)
+{
+    std::ifstream file(options.samplePath, std::ios::binary);
+    if (!check(static_cast<bool>(file), "sample", "cannot read " + options.samplePath))
+        return;
+    std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    Document document;
+    document.Parse(source.c_str());
+    if (!check(!document.HasParseError() && document.IsObject(), "sample", options.samplePath + " does not parse"))
+        return;
+
+    std::string fileName = outputPath(options, "sample-10k.pdf");
+    auto start = Clock::now();
+    StringBuffer buffer;
+    Writer<StringBuffer> writer(buffer);
+    writeScaled(document, writer, kSampleRows, &fileName);
+    std::string json(buffer.GetString(), buffer.GetSize());
+    runJob(options, "sample", "dom-10k", json, fileName, secondsSince(start), false);
+}
+
+// Streamed table from 1k rows up by factors of ten; time per row should stay flat
+void runScaling(const Options &options)
+{
+    JobSpec spec = options.spec;
+    spec.pages = 1;
+    spec.textBlocks = spec.shapes = spec.images = 0;
+    Options run = options;
+    double baseline = 0;
+    for (int rows = 1000; rows <= options.maxRows; rows *= 10)
+    {
+        spec.rows = rows;
+        // The large sizes run once; their noise is small next to their length
+        if (rows > 100000)
+            run.iterations = 1;
+        JobResult result = runDocument(run, "scaling", "sax-" + std::to_string(rows), spec, true);
+        if (!result.ok)
+            return;
+        double usPerRow = result.seconds * 1e6 / rows;
+        if (baseline == 0)
+            baseline = usPerRow;
+        std::printf("scaling-rows rows=%d us_per_row=%.3f vs_1k=%.2f\n", rows, usPerRow, usPerRow / baseline);
+        std::fflush(stdout);
+        if (rows > options.maxRows / 10)
+            break;
+    }
+}
+
+// The trailer ID hashes the time of writing, so it differs between any two runs
+void blankDocumentIds(std::vector<uint8_t> &bytes)
+{
+    static const char key[] = "/ID";
+    auto at = bytes.begin();
+    while ((at = std::search(at, bytes.end(), key, key + 3)) != bytes.end())
+    {
+        at += 3;
+        auto end = std::find(at, bytes.end(), ']');
+        std::fill(at, end, ' ');
+        at = end;
+    }
+}
+
+// Output with layout workers must be byte-identical to the sequential one
+void runWorkers(const Options &options)
+{
+    JobSpec spec = options.spec;
+    spec.fileName = outputPath(options, "workers.pdf");
+    std::string json = generateJob(spec);
+    size_t threads = options.workers ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<uint8_t> bytes[2];
+    double best[2] = {0, 0};
+    int pages = 0;
+    for (int variant = 0; variant < 2; ++variant)
+    {
+        for (int i = 0; i < options.iterations; ++i)
+        {
+            PDFJson job(nullptr);
+            job.setWorkerThreads(variant ? threads : 0);
+            auto start = Clock::now();
+            bool ok = job.processFromString(json, bytes[variant]);
+            double seconds = secondsSince(start);
+            if (!check(ok, "workers", "job failed"))
+                return;
+            if (i == 0 || seconds < best[variant])
+                best[variant] = seconds;
+            pages = job.getPageCount();
+        }
+        checkParses("workers", variant ? "parallel" : "sequential", parsedPages(bytes[variant]), pages);
+        blankDocumentIds(bytes[variant]);
+    }
+    bool identical = check(bytes[0] == bytes[1], "workers", "output with " + std::to_string(threads) +
+                                                               " workers differs from the sequential one");
+    std::printf("workers threads=%zu pages=%d bytes=%zu identical=%d sequential_s=%.4f parallel_s=%.4f speedup=%.2f\n",
+                threads, pages, bytes[0].size(), identical ? 1 : 0, best[0], best[1],
+                best[1] > 0 ? best[0] / best[1] : 0);
+    std::fflush(stdout);
+}
+
+// A logo on every page and in the header: each extra page must cost far less than the image,
+// i.e. the image is embedded once and later pages only refer to it
+void runLogo(const Options &options)
+{
+    JobSpec spec = options.spec;
+    // The example logo, copied next to the bench, unless --image gives another
+    if (spec.imagePath.empty())
+        spec.imagePath = "image.jpg";
+    spec.rows = 0;
+    spec.textBlocks = spec.shapes = 0;
+    spec.images = 1;
+    Options run = options;
+    run.stats = true;
+
+    spec.pages = 1;
+    JobResult single = runDocument(run, "logo", "1", spec, false);
+    spec.pages = std::max(2, options.logoPages);
+    JobResult many = runDocument(run, "logo", std::to_string(spec.pages), spec, false);
+    if (!single.ok || !many.ok)
+        return;
+
+    double bytesPerPage = static_cast<double>(many.bytes - single.bytes) / (many.pages - single.pages);
+    long long imageBytes = fileBytes(spec.imagePath);
+    bool embeddedOnce = check(many.stats.imageXObjects == single.stats.imageXObjects, "logo",
+                              "image XObjects grow with the page count");
+    bool small = check(bytesPerPage < imageBytes, "logo", "each page costs as much as the image");
+    std::printf("logo pages=%d bytes=%lld image_bytes=%lld bytes_per_page=%.1f ms_per_page=%.3f image_xobjects=%llu ok=%d\n",
+                many.pages, many.bytes, imageBytes, bytesPerPage, many.seconds * 1e3 / many.pages,
+                (unsigned long long)many.stats.imageXObjects, embeddedOnce && small ? 1 : 0);
+    std::fflush(stdout);
+}
+
+bool parseArguments(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string name = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::fprintf(stderr, "missing value for %s\n", name.c_str());
+            return false;
+        }
+        const char *value = argv[++i];
+        if (name == "--scenario")
+            options.scenario = value;
+        else if (name == "--rows")
+            options.spec.rows = std::atoi(value);
+        else if (name == "--cols")
+            options.spec.columns = std::atoi(value);
+        else if (name == "--spans")
+            options.spec.spanEvery = std::atoi(value);
+        else if (name == "--pages")
+            options.spec.pages = std::atoi(value);
+        else if (name == "--text")
+            options.spec.textBlocks = std::atoi(value);
+        else if (name == "--shapes")
+            options.spec.shapes = std::atoi(value);
+        else if (name == "--images")
+            options.spec.images = std::atoi(value);
+        else if (name == "--image")
+            options.spec.imagePath = value;
+        else if (name == "--font")
+            options.spec.fontPath = value;
+        else if (name == "--seed")
+            options.spec.seed = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+        else if (name == "--iterations")
+            options.iterations = std::max(1, std::atoi(value));
+        else if (name == "--threads")
+            options.threads = static_cast<size_t>(std::atoi(value));
+        else if (name == "--jobs")
+            options.jobs = std::max(1, std::atoi(value));
+        else if (name == "--ops")
+            options.ops = std::max(1L, std::atol(value));
+        else if (name == "--trace")
+            options.trace = std::atoi(value) != 0;
+        else if (name == "--stats")
+            options.stats = std::atoi(value) != 0;
+        else if (name == "--out")
+            options.outDir = value;
+        else if (name == "--sample")
+            options.samplePath = value;
+        else if (name == "--max-rows")
+            options.maxRows = std::max(1000, std::atoi(value));
+        else if (name == "--workers")
+            options.workers = static_cast<size_t>(std::atoi(value));
+        else if (name == "--logo-pages")
+            options.logoPages = std::max(2, std::atoi(value));
+        else
+        {
+            std::fprintf(stderr, "unknown option %s\n", name.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    options.spec.spanEvery = 25;
+    options.spec.pages = 3;
+    options.spec.textBlocks = 4;
+    options.spec.shapes = 20;
+    options.spec.images = 4;
+    if (!parseArguments(argc, argv, options))
+        return 2;
+    if (options.spec.imagePath.empty())
+        options.spec.images = 0;
+
+    // Results go to stdout; the library only reports warnings and errors, on stderr
+    Logger::getDefault()->setLevel(LogLevel::WARNING);
+
+    const std::string &scenario = options.scenario;
+    bool all = scenario == "all";
+    if (all || scenario == "document")
+        runDocument(options, "document", "dom", options.spec, false);
+    if (all || scenario == "streaming")
+        runDocument(options, "streaming", "sax", options.spec, true);
+    if (all || scenario == "memory")
+        runMemory(options);
+    if (all || scenario == "template")
+        runTemplate(options);
+    if (all || scenario == "batch")
+        runBatch(options);
+    if (all || scenario == "compression")
+        runCompression(options);
+    if (all || scenario == "operators")
+        runOperators(options);
+    if (all || scenario == "text")
+        runText(options);
+    if (all || scenario == "file")
+        runFile(options);
+    if (all || scenario == "cells")
+        runCells(options);
+    if (all || scenario == "sample")
+        runSample(options);
+    if (all || scenario == "workers")
+        runWorkers(options);
+    if (all || scenario == "logo")
+        runLogo(options);
+    // Last, as its million rows set the peak RSS for the rest of the process
+    if (all || scenario == "scaling")
+        runScaling(options);
+    return checkFailures ? 1 : 0;
+}
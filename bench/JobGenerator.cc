@@ -0,0 +1,210 @@
+#include "JobGenerator.h"
+#include <sstream>
+
+namespace {
+
+// Small LCG so the generated text does not depend on the standard library
+class Random {
+public:
+    explicit Random(uint32_t seed) : state(seed) {}
+    uint32_t next()
+    {
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    }
+    int range(int low, int high) { return low + static_cast<int>(next() % static_cast<uint32_t>(high - low + 1)); }
+
+private:
+    uint32_t state;
+};
+
+const char *const kWords[] = {"revenue", "cost", "margin", "total", "account", "balance", "period", "invoice",
+                              "customer", "supplier", "quarter", "budget", "forecast", "net", "gross", "tax"};
+const int kWordCount = sizeof(kWords) / sizeof(kWords[0]);
+
+std::string words(Random &random, int count)
+{
+    std::string text;
+    for (int i = 0; i < count; ++i)
+    {
+        if (i > 0)
+            text += ' ';
+        text += kWords[random.next() % kWordCount];
+    }
+    return text;
+}
+
+void color(std::ostringstream &out, const char *name, double r, double g, double b)
+{
+    out << "\"" << name << "\":{\"r\":" << r << ",\"g\":" << g << ",\"b\":" << b << "}";
+}
+
+void textObject(std::ostringstream &out, const std::string &content, double x, double y, double size,
+                const char *align, double maxWidth)
+{
+    out << "{\"type\":\"text\",\"content\":\"" << content << "\",\"x\":" << x << ",\"y\":" << y
+        << ",\"font_size\":" << size << ",\"h_alignment\":\"" << align << "\"";
+    if (maxWidth > 0)
+        out << ",\"max_width\":" << maxWidth;
+    out << ",";
+    color(out, "color", 0, 0, 0);
+    out << "}";
+}
+
+void imageObject(std::ostringstream &out, const JobSpec &spec, double x, double y, double width, double height)
+{
+    out << "{\"type\":\"photo\",\"path\":\"" << spec.imagePath << "\",\"x\":" << x << ",\"y\":" << y
+        << ",\"width\":" << width << ",\"height\":" << height << "}";
+}
+
+void table(std::ostringstream &out, const JobSpec &spec, Random &random)
+{
+    out << "{\"type\":\"table\",\"border_width\":0.5,\"cell_padding\":4,\"font_size\":8,"
+        << "\"font_path\":\"" << spec.fontPath << "\",\"table_width\":535,\"start_x\":30,\"start_y\":640,\"rows\":[";
+
+    out << "{\"height\":20,\"is_header\":true,\"cells\":[";
+    for (int c = 0; c < spec.columns; ++c)
+    {
+        out << (c ? "," : "") << "{\"content\":\"Column " << c + 1 << "\",\"h_alignment\":\"center\","
+            << "\"v_alignment\":\"center\",\"is_header\":true}";
+    }
+    out << "]}";
+
+    // Columns still covered by a rowspan from the previous row
+    int coveredFrom = -1;
+    for (int r = 0; r < spec.rows; ++r)
+    {
+        bool spanRow = spec.spanEvery > 0 && r % spec.spanEvery == 0 && spec.columns >= 3 && r + 1 < spec.rows;
+        out << ",{\"height\":16,\"cells\":[";
+        bool first = true;
+        for (int c = 0; c < spec.columns; ++c)
+        {
+            if (c == coveredFrom)
+                continue;
+            out << (first ? "" : ",");
+            first = false;
+            out << "{\"content\":\"";
+            if (c == 0)
+                out << "Row " << r + 1;
+            else if (c % 3 == 1)
+                out << words(random, random.range(1, 6));
+            else
+                out << random.range(0, 999999) / 100.0;
+            out << "\",\"h_alignment\":\"" << (c % 3 == 2 ? "right" : "left") << "\",\"v_alignment\":\"center\"";
+            if (spanRow && c == 1)
+            {
+                out << ",\"colspan\":2";
+                c++;
+            }
+            if (spanRow && c == spec.columns - 1)
+                out << ",\"rowspan\":2";
+            if (r % 2 == 1)
+            {
+                out << ",";
+                color(out, "background_color", 0.95, 0.95, 0.97);
+            }
+            out << "}";
+        }
+        out << "]}";
+        coveredFrom = spanRow ? spec.columns - 1 : -1;
+    }
+    out << "]}";
+}
+
+void pageObjects(std::ostringstream &out, const JobSpec &spec, Random &random, bool withTable)
+{
+    bool first = true;
+    auto separator = [&]() {
+        out << (first ? "" : ",");
+        first = false;
+    };
+
+    double y = 690;
+    for (int i = 0; i < spec.textBlocks; ++i)
+    {
+        separator();
+        textObject(out, words(random, random.range(20, 60)), 30, y, 9, "left", 535);
+        y -= 40;
+    }
+    for (int i = 0; i < spec.shapes; ++i)
+    {
+        separator();
+        double x = 30 + (i % 10) * 52;
+        double sy = 120 + (i / 10 % 5) * 40;
+        switch (i % 4)
+        {
+        case 0:
+            out << "{\"type\":\"line\",\"x\":" << x << ",\"y\":" << sy << ",\"x2\":" << x + 40 << ",\"y2\":" << sy + 30
+                << ",\"line_width\":0.5}";
+            break;
+        case 1:
+            out << "{\"type\":\"rectangle\",\"x\":" << x << ",\"y\":" << sy << ",\"width\":40,\"height\":30,";
+            color(out, "fill_color", 0.8, 0.9, 1);
+            out << "}";
+            break;
+        case 2:
+            out << "{\"type\":\"circle\",\"x\":" << x + 20 << ",\"y\":" << sy + 15 << ",\"radius\":14}";
+            break;
+        default:
+            out << "{\"type\":\"triangle\",\"x\":" << x << ",\"y\":" << sy << ",\"x2\":" << x + 40 << ",\"y2\":" << sy
+                << ",\"x3\":" << x + 20 << ",\"y3\":" << sy + 30 << "}";
+            break;
+        }
+    }
+    if (!spec.imagePath.empty())
+    {
+        for (int i = 0; i < spec.images; ++i)
+        {
+            separator();
+            imageObject(out, spec, 30 + (i % 8) * 66, 60 + (i / 8 % 3) * 50, 60, 45);
+        }
+    }
+    if (withTable && spec.rows > 0 && spec.columns > 0)
+    {
+        separator();
+        table(out, spec, random);
+    }
+}
+
+} // namespace
+
+std::string generateJob(const JobSpec &spec)
+{
+    Random random(spec.seed);
+    std::ostringstream out;
+    out << "{\"file_name\":\"" << spec.fileName << "\",\"height\":842,\"width\":595,\"font_size\":10,"
+        << "\"font_path\":\"" << spec.fontPath << "\",\"margin\":20,\"header_height\":80,\"footer_height\":30,"
+        << "\"compress\":" << (spec.compress ? "true" : "false")
+        << ",\"xref_stream\":" << (spec.xrefStream ? "true" : "false");
+    if (!spec.coalesceText)
+        out << ",\"coalesce_text\":false";
+    if (!spec.pdfVersion.empty())
+        out << ",\"pdf_version\":\"" << spec.pdfVersion << "\"";
+
+    if (spec.headerFooter)
+    {
+        out << ",\"header\":{\"objects\":[";
+        textObject(out, "Synthetic benchmark report", 0, 50, 14, "center", 555);
+        out << ",";
+        textObject(out, "Generated from seed " + std::to_string(spec.seed), 0, 30, 9, "center", 555);
+        if (!spec.imagePath.empty())
+        {
+            out << ",";
+            imageObject(out, spec, 5, 5, 80, 60);
+        }
+        out << "]},\"footer\":{\"objects\":[";
+        out << "{\"type\":\"line\",\"x\":5,\"y\":25,\"x2\":550,\"y2\":25,\"line_width\":0.5},";
+        textObject(out, "Page ${PAGE_NUMBER} of ${PAGE_COUNT}", 0, 15, 8, "center", 555);
+        out << "]}";
+    }
+
+    out << ",\"pages\":[";
+    for (int p = 0; p < spec.pages; ++p)
+    {
+        out << (p ? "," : "") << "{\"objects\":[";
+        pageObjects(out, spec, random, p == 0);
+        out << "]}";
+    }
+    out << "]}";
+    return out.str();
+}
@@ -0,0 +1,32 @@
+#ifndef BRISKYPDF_JOBGENERATOR_H
+#define BRISKYPDF_JOBGENERATOR_H
+
+#include <string>
+#include <cstdint>
+
+// Shape of a synthetic JSON job. The same spec always produces the same document.
+struct JobSpec {
+    std::string fileName = "bench.pdf";
+    std::string fontPath = "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf";
+    std::string imagePath;      // repeated image; no images when empty
+
+    int rows = 1000;            // one table of rows x columns, flowing over as many pages as it needs
+    int columns = 8;
+    int spanEvery = 0;          // every n-th row starts a colspan 2 and a rowspan 2 cell; 0 for none
+    int pages = 1;              // JSON pages; the table is on the first one
+    int textBlocks = 0;         // wrapped paragraphs per page
+    int shapes = 0;             // lines, rectangles, circles and triangles per page
+    int images = 0;             // uses of imagePath per page
+    bool headerFooter = true;   // header with text and image, footer with ${PAGE_NUMBER} / ${PAGE_COUNT}
+
+    std::string pdfVersion;     // output options, see OutputOptions
+    bool compress = true;
+    bool xrefStream = false;
+    bool coalesceText = true;
+
+    uint32_t seed = 1;
+};
+
+std::string generateJob(const JobSpec& spec);
+
+#endif
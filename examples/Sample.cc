@@ -7,6 +7,7 @@ int main()
     PDFJson parser(pdf);
     if (parser.processFromFile("Sample.json")) {
         std::cout << "JSON processed successfully!" << std::endl;
+        std::cout << "Embedded font bytes: " << parser.getEmbeddedFontBytes() << std::endl;
     }
     return 0;
 }
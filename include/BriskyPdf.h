@@ -11,6 +11,10 @@
 #include <algorithm>
 #include <functional>
 #include <iostream>
+#include <mutex>
+#include <unordered_map>
+#include <string_view>
+#include <cstdint>
 #include "PDFWriter/PDFWriter.h"
 #include "PDFWriter/PDFPage.h"
 #include "PDFWriter/PageContentContext.h"
@@ -19,6 +23,12 @@
 #include "PDFWriter/XObjectContentContext.h"
 #include "PDFWriter/PDFFormXObject.h"
 #include "PDFWriter/PDFUsedFont.h"
+#include "BriskyPdfThreadPool.h"
+#include "BriskyPdfContent.h"
+#include "BriskyPdfStats.h"
+#include "BriskyPdfTrace.h"
+#include "BriskyPdfLog.h"
+#include "BriskyPdfOutput.h"
 
 
 
@@ -32,6 +42,33 @@ struct Dimension {
     double width=0;
     double height=0;
     bool ok=false;
+    int page=0; // page a table ended on
+};
+
+// How fonts are written to the document. PDFHummus embeds TrueType/OpenType programs as
+// subsets holding only the glyphs that were drawn, and one subset per font file is shared
+// by every page and form XObject of the document.
+enum class FontEmbedding
+{
+    SUBSET,
+    NONE // fonts are referenced by name only and must be installed where the PDF is viewed
+};
+
+// Settings passed to PDFHummus when the document is started.
+// PDFHummus deflates streams at zlib's default level and has no object stream writer, so
+// the choices are compressed or plain streams, and a classic xref table or an xref stream
+// (which needs PDF 1.5; the version is raised when it is lower).
+struct OutputOptions
+{
+    EPDFVersion version = ePDFVersion13;
+    bool compressStreams = true;
+    bool xrefStream = false;
+    FontEmbedding fonts = FontEmbedding::SUBSET;
+    // One text object per run of text lines; see ContentEmitter::setCoalesceText
+    bool coalesceText = true;
+
+    EPDFVersion effectiveVersion() const;
+    PDFCreationSettings creationSettings() const;
 };
 
 enum class HAlignment { LEFT, CENTER, RIGHT };
@@ -60,6 +97,16 @@ struct TableStyle {
 
 };
 
+// Result of wrapping a block of text: computed once while measuring and
+// handed unchanged to the emitter.
+struct TextLayout {
+    double totalHeight = 0;
+    std::vector<std::string> lines;
+    std::vector<double> lineWidths;
+    double lineHeight = 0;
+    double lineSpace = 0;
+};
+
 struct TableCell {
     std::string content;
     int colspan = 1;
@@ -95,12 +142,220 @@ struct TableRow {
     bool pageBreakBefore = false;
 };
 
+// FNV-1a, continued from hash
+const uint64_t kFnvOffsetBasis = 1469598103934665603ULL;
+uint64_t hashBytes(const char* data, size_t size, uint64_t hash = kFnvOffsetBasis);
+
+// Style fields of a cell. TableModel stores every distinct style once and
+// cells refer to it by index.
+struct CellStyle {
+    HAlignment hAlignment = HAlignment::LEFT;
+    VAlignment vAlignment = VAlignment::CENTER;
+    TableStyle::Color backgroundColor;
+    TableStyle::Color textColor;
+    double fontSize = -1;
+    double borderWidth = -1;
+    double topBorderWidth = -1;
+    double leftBorderWidth = -1;
+    double rightBorderWidth = -1;
+    double bottomBorderWidth = -1;
+    bool isHeader = false;
+    std::shared_ptr<PDFUsedFont> font;
+
+    bool operator==(const CellStyle& other) const;
+};
+
+struct CellStyleHash {
+    size_t operator()(const CellStyle& style) const;
+};
+
+// Flat table storage used by layout and drawing. Cells live in parallel
+// arrays, their text in a single buffer and their styles interned, so a cell
+// costs about twenty bytes plus its text and never allocates on its own.
+// TableRow/TableCell stay the public front end and are converted by addRow.
+class TableModel {
+public:
+    enum RowFlags : uint8_t { ROW_HEADER = 1, ROW_PAGE_BREAK_BEFORE = 2 };
+
+    void addRow(const TableRow& row);
+    // Row by row without TableRow/TableCell: beginRow, then addCell with a style from addStyle
+    uint32_t addStyle(const CellStyle& style);
+    void beginRow(double height, bool isHeader = false, bool pageBreakBefore = false);
+    void addCell(std::string_view text, uint32_t style, int colspan = 1, int rowspan = 1, double width = 0);
+    void reserve(size_t rows, size_t cells);
+    // Drops all rows but keeps the allocated storage (and the interned styles)
+    void clear();
+
+    size_t rowCount() const { return rowHeight.size(); }
+    size_t cellCount() const { return cellStyle.size(); }
+    uint32_t rowBegin(size_t row) const { return rowFirstCell[row]; }
+    uint32_t rowEnd(size_t row) const { return row + 1 < rowFirstCell.size() ? rowFirstCell[row + 1] : static_cast<uint32_t>(cellCount()); }
+    bool isHeaderRow(size_t row) const { return rowFlags[row] & ROW_HEADER; }
+    bool hasPageBreakBefore(size_t row) const { return rowFlags[row] & ROW_PAGE_BREAK_BEFORE; }
+
+    std::string_view text(uint32_t cell) const { return std::string_view(textBuffer).substr(textOffset[cell], textLength[cell]); }
+    const CellStyle& style(uint32_t cell) const { return styles[cellStyle[cell]]; }
+
+    // Bytes held by the model, including spare capacity
+    size_t memoryBytes() const;
+
+    // Per row
+    std::vector<uint32_t> rowFirstCell;
+    std::vector<double> rowHeight;
+    std::vector<uint8_t> rowFlags;
+
+    // Per cell
+    std::vector<uint32_t> textOffset;
+    std::vector<uint32_t> textLength;
+    std::vector<uint32_t> cellStyle;
+    std::vector<uint16_t> colspan;
+    std::vector<uint16_t> rowspan;
+    std::vector<float> width;
+
+    std::string textBuffer;
+    std::vector<CellStyle> styles;
+
+private:
+    uint32_t internStyle(const CellStyle& style);
+    std::unordered_map<CellStyle, uint32_t, CellStyleHash> styleIndex;
+};
+
+// Placement of a TableModel's cells once spans are resolved: the column of
+// every cell (-1 when it did not fit) and a bitmap of occupied grid slots.
+struct CellGrid {
+    int rows = 0;
+    int cols = 0;
+    std::vector<int32_t> cellCol;
+    std::vector<uint64_t> occupied;
+
+    bool isOccupied(int row, int col) const {
+        size_t bit = static_cast<size_t>(row) * cols + col;
+        return (occupied[bit >> 6] >> (bit & 63)) & 1;
+    }
+    void setOccupied(int row, int col) {
+        size_t bit = static_cast<size_t>(row) * cols + col;
+        occupied[bit >> 6] |= uint64_t(1) << (bit & 63);
+    }
+};
+
 struct CellPosition {
         int row, col;
         double x, y, width, height;
-        std::shared_ptr<TableCell> cell;
+        uint32_t cell;
     };
 
+// Cell positions stored row-major; the cells of row r are
+// positions[rowOffsets[r]] .. positions[rowOffsets[r + 1] - 1]. x and y are
+// offsets from the table origin, text[i] is the wrapped content of positions[i].
+struct CellLayout {
+    std::vector<CellPosition> positions;
+    std::vector<TextLayout> text;
+    std::vector<size_t> rowOffsets;
+    std::vector<double> rowHeights;
+    std::vector<int> headerRows;
+    double headerHeight = 0;
+
+    int rowCount() const { return rowOffsets.empty() ? 0 : static_cast<int>(rowOffsets.size()) - 1; }
+    const CellPosition* rowBegin(int row) const { return positions.data() + rowOffsets[row]; }
+    const CellPosition* rowEnd(int row) const { return positions.data() + rowOffsets[row + 1]; }
+};
+
+
+// Glyph advances and kerning for one (font, size) pair. Entries are filled from
+// the font the first time a codepoint (or pair) is seen, so measuring a word
+// afterwards is just a sum over the tables.
+class GlyphMetrics {
+public:
+    // fontMutex, when given, is held around every call into the font
+    explicit GlyphMetrics(double fontSize, std::mutex* fontMutex = nullptr) : mFontSize(fontSize), mFontMutex(fontMutex) {}
+
+    double measure(PDFUsedFont* font, const std::string& text);
+    double lineHeight(PDFUsedFont* font);
+    void warmUp(PDFUsedFont* font, const std::string& charset);
+
+    void setFontMutex(std::mutex* fontMutex) { mFontMutex = fontMutex; }
+    // Counters to update, or null to skip counting
+    void setCounters(TextMetricsCounters* counters) { mCounters = counters; }
+    // Adds the entries of other that this one has not measured yet
+    void merge(const GlyphMetrics& other);
+
+private:
+    double measureText(PDFUsedFont* font, const std::string& text);
+    double advance(PDFUsedFont* font, const std::string& text, size_t pos, size_t len, uint32_t codepoint);
+    double kerning(PDFUsedFont* font, const std::string& text, size_t first, size_t len, uint32_t left, uint32_t right);
+
+    double mFontSize;
+    std::mutex* mFontMutex;
+    TextMetricsCounters* mCounters = nullptr;
+    double mLineHeight = -1;
+    std::unordered_map<uint32_t, double> mAdvances;
+    std::unordered_map<uint64_t, double> mKerning;
+};
+
+// Per-document store of GlyphMetrics keyed by (font, size). A cache is used
+// by one thread at a time; worker threads each get their own.
+class ResourcePool;
+
+class TextMetricsCache {
+public:
+    void setFontMutex(std::mutex* fontMutex) { mFontMutex = fontMutex; }
+    // New entries are seeded from pool for fonts found in fontPaths; publish() hands them back
+    void setResourcePool(ResourcePool* pool, const std::unordered_map<PDFUsedFont*, std::string>* fontPaths)
+    {
+        mPool = pool;
+        mFontPaths = fontPaths;
+    }
+    void publish() const;
+    // Counts measures and cache hits of every font and size in counters()
+    void setCounting(bool enabled);
+    const TextMetricsCounters* counters() const { return mCounters.get(); }
+    GlyphMetrics& get(PDFUsedFont* font, double fontSize);
+    double measure(PDFUsedFont* font, double fontSize, const std::string& text) { return get(font, fontSize).measure(font, text); }
+    double lineHeight(PDFUsedFont* font, double fontSize) { return get(font, fontSize).lineHeight(font); }
+    void clear();
+
+private:
+    std::map<std::pair<PDFUsedFont*, double>, std::unique_ptr<GlyphMetrics>> mMetrics;
+    std::pair<PDFUsedFont*, double> mLastKey{nullptr, 0};
+    GlyphMetrics* mLast = nullptr;
+    std::mutex* mFontMutex = nullptr;
+    ResourcePool* mPool = nullptr;
+    const std::unordered_map<PDFUsedFont*, std::string>* mFontPaths = nullptr;
+    // On the heap so that moving the cache keeps the metrics' pointers valid
+    std::unique_ptr<TextMetricsCounters> mCounters;
+};
+
+// Process-wide store of what can be shared between documents: glyph metrics keyed
+// by font file and size, and image dimensions keyed by path. Font programs and image
+// XObjects belong to one PDFWriter, so they stay per document.
+class ResourcePool {
+public:
+    // Copy of the pooled metrics for fontPath/fontSize, or null when nothing is pooled yet
+    std::unique_ptr<GlyphMetrics> seedMetrics(const std::string& fontPath, double fontSize) const;
+    void publishMetrics(const std::string& fontPath, double fontSize, const GlyphMetrics& metrics);
+
+    bool getImageDimensions(const std::string& imagePath, double& width, double& height) const;
+    void putImageDimensions(const std::string& imagePath, double width, double height);
+
+    size_t metricsCount() const;
+    size_t imageCount() const;
+
+private:
+    mutable std::mutex mMutex;
+    std::map<std::pair<std::string, double>, GlyphMetrics> mMetrics;
+    std::unordered_map<std::string, std::pair<double, double>> mImages;
+};
+
+// One block of text for PDFCreator::layoutTexts; the result is written to *result.
+struct TextLayoutJob {
+    std::string_view text;
+    std::shared_ptr<PDFUsedFont> font;
+    double fontSize = 0;
+    double maxWidth = 0;
+    double lineSpace = 10;
+    TextLayout* result = nullptr;
+};
+
 
 class AdvancedTextWrapper {
 private:
@@ -108,10 +363,13 @@ private:
     double mFontSize;
     double mLineHeight;
     double mLineSpace;
-    PDFUsedFont::TextMeasures mTextMeasure;
+    double mSpaceWidth;
+    std::unique_ptr<GlyphMetrics> mOwnMetrics;
+    GlyphMetrics* mMetrics;
 
 public:
-    AdvancedTextWrapper(std::shared_ptr<PDFUsedFont> font, double fontSize,double lineSpace);
+    // When no cache is given the wrapper keeps its own metrics for its lifetime.
+    AdvancedTextWrapper(std::shared_ptr<PDFUsedFont> font, double fontSize,double lineSpace, TextMetricsCache* cache=nullptr);
        
 
     struct WrappingOptions {
@@ -122,18 +380,16 @@ public:
 
     
 
-    struct WrappedTextResult {
-        double totalHeight;
-        std::vector<std::string> lines;
-        std::vector<double> lineWidths;
-        double lineHeight;
-        double lineSpace;
-    };
+    typedef TextLayout WrappedTextResult;
 
-    WrappedTextResult wrapText(const std::string &text, const WrappingOptions &options);
+    WrappedTextResult wrapText(std::string_view text, const WrappingOptions &options);
+
+    bool matches(const PDFUsedFont* font, double fontSize, double lineSpace) const {
+        return mFont.get() == font && mFontSize == fontSize && mLineSpace == lineSpace;
+    }
 
 private:
-    std::vector<std::string> splitWords(const std::string& text);
+    std::vector<std::string> splitWords(std::string_view text);
     
     std::pair<std::string, std::string> breakWord(const std::string& word, double maxWidth);
        
@@ -146,70 +402,161 @@ class PDFTable{
         TableStyle mStyle;
         double mCurrentY;
         double margin;
+        // Fills and borders of the rows being drawn, written once per call to DrawRows
+        PathBatch mGrid;
        // int mCurrentPage;
     public:
     PDFTable(PDFCreator* pdf_ =nullptr,double pageMargin=50):pdf(pdf_),margin(pageMargin){}
      void SetStyle(const TableStyle& style) { mStyle = style; }
      friend class PDFCreator;
+     friend class TableStream;
     
     
     
 private:
-    std::vector<std::vector<std::shared_ptr<TableCell>>> BuildCellGrid(const std::vector<TableRow>& rows);
+    // columns > 0 fixes the grid width instead of deriving it from the widest row
+    CellGrid BuildCellGrid(const TableModel& model, int columns = 0);
+
+    std::vector<double> CalculateColumnWidths(const TableModel& model, const CellGrid& grid, double tableWidth);
     
-    std::vector<CellPosition> CalculateCellPositions(
-        const std::vector<std::vector<std::shared_ptr<TableCell>>>& grid,
-        double tableWidth);
+    CellLayout CalculateCellPositions(const TableModel& model, const CellGrid& grid, double tableWidth);
+
+    CellLayout CalculateCellPositions(const TableModel& model, const CellGrid& grid,
+                                      const std::vector<double>& colWidths);
+
+    void IndexHeaderRows(const TableModel& model, CellLayout& layout);
     
     
-    int DrawRowsOnPage(PDFFormXObject *FormXObject,PageContentContext* context,
-                      const std::vector<TableRow>& rows,
-                      const std::vector<CellPosition>& cellPositions,
-                      double startX, double startY, double tableWidth,
+    int DrawRowsOnPage(PDFFormXObject *FormXObject,
+                      const TableModel& model,
+                      const CellLayout& cellLayout,
+                      double startX, double startY,
                       int startRow);
     
-    void DrawRowCells(PDFFormXObject *FormXObject,PageContentContext* context,
-                     const std::vector<CellPosition>& cellPositions,
-                     int rowIdx, double startX, double rowY, double tableWidth);
-
-    void DrawCell(PDFFormXObject *FormXObject,PageContentContext* context, const TableCell& cell,
-                  double x, double y, double width, double height);
+    // Backgrounds of all given rows, then their text, then their borders
+    void DrawRows(PDFFormXObject *FormXObject,
+                  const TableModel& model,
+                  const CellLayout& cellLayout,
+                  const std::vector<int>& rows, double startX, double startY);
     
-    void DrawCellBackground(PDFFormXObject *FormXObject,PageContentContext* context, const TableCell& cell,
-                           double x, double y, double width, double height);
+    void DrawCellBackground(const CellStyle& style, double x, double y, double width, double height);
     
-    void DrawCellBorder(PDFFormXObject *FormXObject,PageContentContext* context,
-                       double x, double y, double width, double height,double borderWidth,
+    void DrawCellBorder(double x, double y, double width, double height,double borderWidth,
                      double topBorderWidth=-1,double bottomBorderWidth=-1,double leftBorderWidth=-1,double rightBorderWidth=-1);
     
-    void DrawCellContent(PDFFormXObject *FormXObject,PageContentContext* context, const TableCell& cell,
-                        double x, double y, double width, double height);
-    
-    
-    double GetHeaderHeight(const std::vector<TableRow>& rows);
+    void DrawCellContent(PDFFormXObject *FormXObject, const CellStyle& style,
+                        const TextLayout& text, double x, double y, double width, double height);
     
-    void DrawTableHeader(PDFFormXObject *FormXObject,PageContentContext* context,
-                        const std::vector<TableRow>& rows,
-                        const std::vector<CellPosition>& cellPositions,
-                        double startX, double startY, double tableWidth);
+    void DrawTableHeader(PDFFormXObject *FormXObject,
+                        const TableModel& model,
+                        const CellLayout& cellLayout,
+                        double startX, double startY);
 
 
     
 };
 
 
+// Draws a table while its rows are still being produced. Rows are buffered
+// only until every rowspan started in them is closed (and a small window is
+// full), then that band is laid out, drawn and released, so memory depends
+// on the page size rather than on the number of rows. Rowspans that keep
+// chaining are cut at kMaxBandRows. Column widths are fixed by the first
+// band: later content that is wider is wrapped (or clipped) to them, so give
+// the cells explicit widths when the first rows are not representative.
+// Header rows are kept and repeated on every new page.
+class TableStream {
+public:
+    // Returns false once the table could not be continued (a row did not fit on an empty page)
+    bool addRow(const TableRow& row);
+    Dimension finish();
+
+    static const size_t kWindowRows = 64;
+    // A band is flushed here even when a rowspan reaches past it
+    static const size_t kMaxBandRows = 4096;
+
+private:
+    friend class PDFCreator;
+    TableStream(PDFCreator* pdf, PDFFormXObject* formXObject, std::shared_ptr<PDFTable> table,
+                double startX, double startY, double tableWidth);
+
+    void flushBand();
+    void cutSpans();
+    void startNewPage();
+
+    PDFCreator* pdf;
+    PDFFormXObject* formXObject;
+    std::shared_ptr<PDFTable> table;
+    double startX;
+    double tableWidth;
+    double currentY;
+    bool rowsOnPage = false;
+    bool failed = false;
+
+    TableModel band;
+    int bandSpanEnd = 0;
+    int columns = 0;
+    std::vector<double> colWidths;
+
+    TableModel headerRows;
+    CellLayout headerLayout;
+    bool headerLaidOut = false;
+
+    Dimension result;
+};
+
+
 class PDFCreator {
+    friend class TableStream;
 protected:
     PDFWriter pdfWriter;
     std::string currentFilename;
+    // Set while the document goes to a stream instead of currentFilename
+    OutputTarget* output = nullptr;
+    OutputOptions outputOptions;
+    bool documentSaved = false;
+    // Points at statsData while instrumentation is on
+    RenderStats* stats = nullptr;
+    RenderStats statsData;
+    std::shared_ptr<Tracer> tracer;
+    std::shared_ptr<Logger> logger;
+    // Start of the document and page spans; default-constructed when not traced
+    Tracer::Clock::time_point documentStart;
+    Tracer::Clock::time_point pageStart;
+    long long embeddedFontBytes = -1;
     PDFPage* currentPage;
     PageContentContext* currentContext;
+    // State trackers of the page stream and of the form XObjects being written
+    ContentEmitter pageEmitter;
+    std::unordered_map<PDFFormXObject*, ContentEmitter> formEmitters;
     std::shared_ptr<PDFUsedFont> font;
     double pageWidth;
     double pageHeight;
-    std::map<std::string, PDFImageXObject*> imageCache;
+    // Embedded images by (content hash, image index); an id of 0 marks an image that
+    // failed to embed. JPEGs become image XObjects, PNGs and TIFFs (the index picks the
+    // TIFF page) the form XObjects PDFHummus wraps them in. imageHashes maps a path to
+    // its content hash and format; unknown formats go through DrawImage.
+    enum class ImageFormat { OTHER, JPEG, PNG, TIFF };
+    struct CachedImage {
+        ObjectIDType id = 0;
+        double width = 0;
+        double height = 0;
+        bool isForm = false; // drawn in its own width x height space, not the unit square
+    };
+    std::map<std::pair<uint64_t, int>, CachedImage> imageCache;
+    std::unordered_map<std::string, std::pair<uint64_t, ImageFormat>> imageHashes;
     std::map<std::string, std::shared_ptr<PDFUsedFont>> fontCache;
+    std::unordered_map<PDFUsedFont*, std::string> fontPaths;
+    std::shared_ptr<ResourcePool> resources;
+    TextMetricsCache textMetrics;
+    std::unique_ptr<AdvancedTextWrapper> textWrapper;
+    std::mutex fontMutex;
+    std::unique_ptr<ThreadPool> workers;
+    std::vector<TextMetricsCache> workerMetrics;
     std::vector<std::shared_ptr<PDFTable>> tables;
+    std::vector<std::pair<ObjectIDType, std::function<void(PDFFormXObject*)>>> deferredForms;
+    std::map<std::string, std::string> documentValues;
+    std::map<std::string, double> documentTotals;
     
  
     struct {
@@ -228,6 +575,12 @@ public:
     
     // Document operations
     bool createDocument(const std::string& filename);
+    // Writes to output instead of a file; output is flushed after every page and must outlive
+    // the document. name only labels log records.
+    bool createDocument(OutputTarget* output, const std::string& name = std::string());
+    // Forgets the output target before it is destroyed; save or close the document first.
+    // A saved MemoryOutput is measured for getEmbeddedFontBytes first; other streams report 0.
+    void releaseOutput();
     bool openDocument(const std::string& filename);
     bool saveDocument();
     void closeDocument();
@@ -242,11 +595,69 @@ public:
     ObjectIDType closeXObject(PDFFormXObject* formXObject);
     void addHeader(ObjectIDType FormXObjectId);
     void addFooter(ObjectIDType FormXObjectId);
+    // Per-phase timings and counters of the document. Off by default; while off the hot
+    // paths only test a null pointer. Enable before createDocument to cover the whole run.
+    void setStatsEnabled(bool enabled);
+    bool isStatsEnabled() const { return stats != nullptr; }
+    // Null while disabled
+    RenderStats* getStatsSink() { return stats; }
+    // Snapshot with the text metrics and content emitter counters folded in
+    RenderStats getStats() const;
+
+    // Timeline of document, page, initPageFunc and table phase spans; may be shared between
+    // documents. Null or disabled tracers cost one test per span.
+    void setTracer(std::shared_ptr<Tracer> tracer_) { tracer = tracer_; }
+    Tracer* getTracer() const { return tracer.get(); }
+
+    // Where progress and errors go; Logger::getDefault() unless set. Per-page events are DEBUG.
+    void setLogger(std::shared_ptr<Logger> logger_) { logger = logger_; }
+    std::shared_ptr<Logger> getLogger() const { return logger; }
+    // Logs with the document name and current page filled in
+    void log(LogLevel level, const std::string& message, int object = -1) const;
+
+    // Emitter of the page stream, or of FormXObject when given; all drawing goes through it
+    ContentEmitter& emitterFor(PDFFormXObject *FormXObject);
+
+    // Draws a form XObject at the origin of the page, or of FormXObject when given
+    void placeForm(PDFFormXObject *FormXObject, ObjectIDType formId);
+
+    // Form XObjects whose content is only known at the end of the document. The returned id
+    // can be placed right away; render runs in saveDocument after the last page is drawn,
+    // when PAGE_COUNT and the other document values are final.
+    ObjectIDType addDeferredForm(std::function<void(PDFFormXObject*)> render);
+    void setDocumentValue(const std::string& name, const std::string& value) { documentValues[name] = value; }
+    // Running sum published as a document value when the document is saved
+    void addToDocumentValue(const std::string& name, double amount) { documentTotals[name] += amount; }
+    const std::map<std::string, std::string>& getDocumentValues() const { return documentValues; }
     
      Dimension addText(PDFFormXObject *FormXObject,double x, double y, const std::string& text, std::shared_ptr<PDFUsedFont> textFont,double fontSize = 12, 
                  double r = 0, double g = 0, double b = 0,HAlignment hAlignment=HAlignment::LEFT,
                  VAlignment vAlignment=VAlignment::TOP,
                  double maxWidth=0,double maxheight=0,double lineSpace=10,bool isHidden=false);
+
+    // Wraps text once; the result can be drawn with drawTextLayout without re-measuring
+    TextLayout layoutText(std::string_view text, std::shared_ptr<PDFUsedFont> textFont, double fontSize,
+                          double maxWidth = 0, double lineSpace = 10);
+    Dimension drawTextLayout(PDFFormXObject *FormXObject, double x, double y, const TextLayout& layout,
+                             std::shared_ptr<PDFUsedFont> textFont, double fontSize,
+                             double r = 0, double g = 0, double b = 0, HAlignment hAlignment = HAlignment::LEFT,
+                             VAlignment vAlignment = VAlignment::TOP,
+                             double maxWidth = 0, double maxheight = 0, bool isHidden = false);
+
+    // Wrapper for the given font/size, reused across calls while they do not change
+    AdvancedTextWrapper& getTextWrapper(std::shared_ptr<PDFUsedFont> textFont, double fontSize, double lineSpace);
+
+    // Wraps independent blocks of text, spread over the worker threads when they are enabled.
+    // Results do not depend on the thread count, so the emitted document is identical.
+    void layoutTexts(std::vector<TextLayoutJob>& jobs);
+
+    // Number of worker threads used for text layout; 0 keeps everything on the calling thread.
+    // Content emission and object writing always stay on the calling thread, in page order.
+    void setWorkerThreads(size_t threads);
+    size_t getWorkerThreads() const { return workers ? workers->size() : 0; }
+
+    // Below this many blocks layoutTexts does not hand work to the pool
+    static const size_t kParallelLayoutThreshold = 256;
     
 
     Dimension addHorizontalLine(PDFFormXObject *FormXObject,double y, double lineWidth = 1);
@@ -255,9 +666,27 @@ public:
                  double lineWidth = 1, double r = 0, double g = 0, double b = 0);
 
     void setFont(const std::string& fontPath="/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf");
+    // Apply to documents created after the call
+    void setOutputOptions(const OutputOptions& options) { outputOptions = options; }
+    const OutputOptions& getOutputOptions() const { return outputOptions; }
+    void setFontEmbedding(FontEmbedding embedding) { outputOptions.fonts = embedding; }
+    FontEmbedding getFontEmbedding() const { return outputOptions.fonts; }
+    // Compressed size of the font programs in the saved document, read back from the file or
+    // MemoryOutput on first call; 0 before the document is saved, when it cannot be parsed,
+    // or when it went to another stream
+    size_t getEmbeddedFontBytes();
         
     std::shared_ptr<PDFUsedFont> getFont()  {return font;};
     std::shared_ptr<PDFUsedFont> getFontByPath(const std::string& fontPath);
+
+    // Text measurement cache shared by every wrapper of this document
+    TextMetricsCache& getTextMetrics() { return textMetrics; }
+    // Metrics and image metadata shared with other documents; set before loading fonts.
+    // What this document measured is published back to the pool when it is saved.
+    void setResourcePool(std::shared_ptr<ResourcePool> pool);
+    std::shared_ptr<ResourcePool> getResourcePool() const { return resources; }
+    // Pre-fills glyph metrics of every loaded font for the given sizes (printable ASCII when charset is empty)
+    void warmUpTextMetrics(const std::vector<double>& fontSizes, const std::string& charset = "");
     
     // Shapes
     Dimension addRectangle(PDFFormXObject *FormXObject,double x, double y, double width, double height, 
@@ -285,6 +714,8 @@ public:
     
     // Utility functions
     void getImageDimensions(const std::string& imagePath, double& width, double& height);
+    // Embeds an image ahead of use, e.g. before a form XObject that draws it is started
+    bool preloadImage(const std::string& imagePath, int index = 0);
     void clearImageCache();
 
     //Table functions
@@ -292,16 +723,32 @@ public:
     Dimension DrawTableWithPageBreaks(PDFFormXObject *FormXObject,std::shared_ptr<PDFTable> table,const std::vector<TableRow>& rows, 
                                 double startX, double startY,
                                 double tableWidth); 
+
+    // Draws a table already held as a TableModel
+    Dimension DrawTableModel(PDFFormXObject *FormXObject, std::shared_ptr<PDFTable> table, const TableModel& model,
+                             double startX, double startY, double tableWidth);
+
+    // Streaming tables: rows are laid out and drawn in bounded bands as they are supplied
+    std::unique_ptr<TableStream> BeginTableStream(PDFFormXObject *FormXObject, std::shared_ptr<PDFTable> table,
+                                                  double startX, double startY, double tableWidth);
+    Dimension DrawTableStreaming(PDFFormXObject *FormXObject, std::shared_ptr<PDFTable> table,
+                                 const std::function<bool(TableRow&)>& nextRow,
+                                 double startX, double startY, double tableWidth);
     
 
 protected:
-    void drawCircle(PDFFormXObject *FormXObject,PageContentContext* context, double centerX, double centerY, double radius);
-    PDFImageXObject* getImageXObject(const std::string& imagePath);
+    void drawCircle(ContentEmitter& emitter, double centerX, double centerY, double radius);
+    void endPage();
+    ObjectIDType endForm(PDFFormXObject *formXObject);
+    void countOperators(const ContentEmitter& emitter);
+    // Cached XObject for the image, embedding it if allowed; null when the image must be drawn with DrawImage
+    const CachedImage* getCachedImage(const std::string& imagePath, int index, bool canEmbed);
+    static bool hashImageFile(const std::string& imagePath, uint64_t& hash, ImageFormat& format);
 
     Dimension DrawTableOnPages(PDFFormXObject *FormXObject,std::shared_ptr<PDFTable> table,
-                         const std::vector<TableRow>& rows,
-                         const std::vector<CellPosition>& cellPositions,
-                         double startX, double tableWidth);
+                         const TableModel& model,
+                         const CellLayout& cellLayout,
+                         double startX);
 
 };
 
@@ -0,0 +1,48 @@
+#ifndef PDFBatch_H
+#define PDFBatch_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include "BriskyPdfJson.h"
+#include "BriskyPdfThreadPool.h"
+
+struct BatchReport {
+    size_t jobs = 0;
+    size_t succeeded = 0;
+    size_t failed = 0;
+    double seconds = 0;
+    double jobsPerSecond = 0;
+    std::vector<bool> results; // per job, in input order
+};
+
+// Generates many documents concurrently, one PDFJson/PDFCreator per job.
+// All jobs share one ResourcePool, so a template's fonts are measured and its
+// images are probed once per process rather than once per document.
+class PDFBatch {
+private:
+    ThreadPool workers;
+    std::shared_ptr<ResourcePool> resources;
+    std::shared_ptr<Tracer> tracer;
+    std::shared_ptr<Logger> logger;
+
+    BatchReport run(size_t count, const std::function<bool(PDFJson&, size_t)>& job);
+
+public:
+    // threads is the number of documents in flight; 0 uses every hardware thread
+    explicit PDFBatch(size_t threads = 0);
+    virtual ~PDFBatch() = default;
+
+    BatchReport processStrings(const std::vector<std::string>& jsonJobs);
+    BatchReport processFiles(const std::vector<std::string>& filenames);
+
+    std::shared_ptr<ResourcePool> getResourcePool() const { return resources; }
+    // Every job records into tracer; spans of concurrent jobs are told apart by thread id
+    void setTracer(std::shared_ptr<Tracer> tracer_) { tracer = tracer_; }
+    // Logger of the batch and of every job; Logger::getDefault() unless set
+    void setLogger(std::shared_ptr<Logger> logger_) { logger = logger_; }
+    size_t getThreads() const { return workers.size() + 1; }
+};
+
+#endif // PDFBatch_H
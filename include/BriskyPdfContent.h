@@ -0,0 +1,150 @@
+#ifndef BRISKYPDF_CONTENT_H
+#define BRISKYPDF_CONTENT_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <tuple>
+#include <utility>
+#include <cstdint>
+#include "PDFWriter/AbstractContentContext.h"
+#include "PDFWriter/PDFUsedFont.h"
+
+// Operators formatted straight into a reusable byte buffer and handed to a content stream
+// in one WriteFreeCode call. Numbers are written with at most kDecimals fraction digits
+// and no trailing zeros, without printf or the C locale.
+class ContentBuffer {
+public:
+    static const int kDecimals = 4;
+
+    explicit ContentBuffer(size_t capacity = 64 * 1024);
+
+    void number(double value);
+    void op(const char *op);
+    void flush(AbstractContentContext *context);
+    void clear() { mData.clear(); }
+
+    bool empty() const { return mData.empty(); }
+    size_t size() const { return mData.size(); }
+    size_t capacity() const { return mCapacity; }
+    const std::string &data() const { return mData; }
+
+private:
+    std::string mData;
+    size_t mCapacity;
+};
+
+// Writes to one page or form content stream and remembers the graphics state it has set,
+// so colour, line width and font operators are only written when the value changes.
+// Text stays inside one BT..ET across calls until a non-text operator is needed.
+// Path, colour and positioning operators collect in a ContentBuffer; Tf, Tj and q/Q go
+// through PDFHummus, which tracks the font used to encode text.
+// Code writing operators the emitter does not track must go through context(), which
+// writes out the buffer first; such operators must leave the tracked state as it was
+// (q..Q pairs, Do) or be followed by invalidate(). finish() must run before the stream is
+// ended or paused.
+class ContentEmitter {
+public:
+    // A new stream starts with an unknown state
+    void bind(AbstractContentContext *context);
+    bool isBound() const { return mContext != nullptr; }
+    AbstractContentContext *context();
+    // Closes an open text object and writes out the buffer
+    void finish();
+
+    void save();
+    void restore();
+    // Forget the tracked state, e.g. after operators written directly to the stream
+    void invalidate();
+    // Operators written since bind(); each use of context() or text() counts as one
+    uint64_t operatorCount() const { return mOperators; }
+
+    void fillRGB(double r, double g, double b);
+    void fillCMYK(double c, double m, double y, double k);
+    void strokeRGB(double r, double g, double b);
+    void lineWidth(double width);
+
+    // Path construction and painting, as the operators of the same name
+    void m(double x, double y);
+    void l(double x, double y);
+    void c(double x1, double y1, double x2, double y2, double x3, double y3);
+    void h();
+    void re(double x, double y, double width, double height);
+    void f();
+    void S();
+    void cm(double a, double b, double c, double d, double e, double f);
+    void J(int lineCap);
+
+    void beginText();
+    void endText();
+    // Stream for text showing operators (Tj); opens a text object when none is open
+    AbstractContentContext *text();
+    // Starts a text line at (x, y) with a Td relative to the previous line of the same
+    // text object. Offsets are rounded to 1/1000 pt and the rounded value is tracked, so
+    // long runs of cells do not drift.
+    void textPosition(double x, double y);
+    // When off, every textPosition() starts its own text object and places the line with an
+    // absolute Tm, as before text runs were merged; kept so the bench can compare the two
+    void setCoalesceText(bool coalesce) { mCoalesceText = coalesce; }
+    void font(PDFUsedFont *font, double size);
+
+private:
+    enum class ColorSpace { UNKNOWN, RGB, CMYK };
+    struct Color {
+        ColorSpace space = ColorSpace::UNKNOWN;
+        double value[4] = {0, 0, 0, 0};
+        bool set(ColorSpace newSpace, double a, double b, double c, double d);
+    };
+    struct State {
+        Color fill;
+        Color stroke;
+        double lineWidth = -1;
+        PDFUsedFont *font = nullptr;
+        double fontSize = -1;
+    };
+
+    // Writes the buffer out once it holds this much; below the buffer's 64 KB so the
+    // operator that crosses it still fits without growing the allocation
+    static const size_t kFlushBytes = 60 * 1024;
+
+    void path();
+    void op(const char *op);
+
+    AbstractContentContext *mContext = nullptr;
+    ContentBuffer mBuffer;
+    State mState;
+    std::vector<State> mSaved;
+    bool mInText = false;
+    bool mCoalesceText = true;
+    double mLineX = 0;
+    double mLineY = 0;
+    uint64_t mOperators = 0;
+};
+
+// Axis-aligned rectangles and line segments gathered from many small shapes, written as
+// one path per fill colour and one per stroke width and colour. Collinear segments that
+// touch or overlap are merged, so an edge shared by two cells is stroked once.
+class PathBatch {
+public:
+    void addFill(double r, double g, double b, double x, double y, double width, double height);
+    // Horizontal or vertical; other segments are ignored
+    void addSegment(double lineWidth, double r, double g, double b, double x1, double y1, double x2, double y2);
+    void addFrame(double lineWidth, double r, double g, double b, double x, double y, double width, double height);
+
+    bool empty() const { return fills.empty() && strokes.empty(); }
+    void clear();
+
+    // Each writes its groups and forgets them
+    void flushFills(ContentEmitter& emitter);
+    void flushStrokes(ContentEmitter& emitter);
+
+private:
+    typedef std::tuple<double, double, double> Rgb;
+    // (is horizontal, fixed coordinate) -> spans along the other axis
+    typedef std::map<std::pair<bool, double>, std::vector<std::pair<double, double>>> Lines;
+
+    std::map<Rgb, std::vector<double>> fills;
+    std::map<std::tuple<double, double, double, double>, Lines> strokes;
+};
+
+#endif
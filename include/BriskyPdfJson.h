@@ -3,9 +3,14 @@
 
 #include "rapidjson/document.h"
 #include "rapidjson/filereadstream.h"
+#include "rapidjson/reader.h"
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include "BriskyPdf.h"
 
 using namespace rapidjson;
@@ -104,16 +109,242 @@ struct DocumentConfig {
     double width = 595;
     double font_size = 10;
     std::string font_path;
+    OutputOptions output;
     double margin = 5;
     double header_height = 120;
     double footer_height = 40;
 };
 
+// Values bound to ${name} fields when a compiled template is rendered
+typedef std::unordered_map<std::string, std::string> TemplateValues;
+
+// Text split once into literal runs and ${name} fields
+class TemplateString {
+public:
+    TemplateString() = default;
+    explicit TemplateString(const std::string& source);
+
+    bool isConstant() const { return fields.empty(); }
+    bool uses(const std::string& field) const;
+    // PAGE_COUNT and doc.* fields are only known once the whole document is drawn
+    bool usesDocumentValues() const;
+    // Fields are looked up in record first, then values; PAGE_NUMBER is bound to
+    // pageNumber and fields without a value are left as written
+    std::string render(const TemplateValues& values, int pageNumber, const TemplateValues* record = nullptr) const;
+
+private:
+    std::vector<std::string> literals; // one more than fields
+    std::vector<std::string> fields;
+};
+
+// Records for a repeat directive, read one at a time so a data set is never held whole
+class TemplateDataSource {
+public:
+    virtual ~TemplateDataSource() = default;
+    // Replaces record with the next one; false once the source is exhausted
+    virtual bool next(TemplateValues& record) = 0;
+};
+
+class RecordListSource : public TemplateDataSource {
+public:
+    explicit RecordListSource(std::shared_ptr<const std::vector<TemplateValues>> records_) : records(records_) {}
+    bool next(TemplateValues& record) override;
+
+private:
+    std::shared_ptr<const std::vector<TemplateValues>> records;
+    size_t position = 0;
+};
+
+// One JSON object per line; top-level scalars become fields, numbers keep their source text
+class NdjsonDataSource : public TemplateDataSource {
+public:
+    explicit NdjsonDataSource(const std::string& filename);
+    bool isOpen() const { return file.is_open(); }
+    bool next(TemplateValues& record) override;
+
+private:
+    std::ifstream file;
+    std::string line;
+};
+
+// Comma separated values with a header row naming the fields; quoted fields may contain
+// separators, doubled quotes and line breaks
+class CsvDataSource : public TemplateDataSource {
+public:
+    explicit CsvDataSource(const std::string& filename, char separator = ',');
+    bool isOpen() const { return file.is_open(); }
+    bool next(TemplateValues& record) override;
+
+private:
+    bool readRow(std::vector<std::string>& row);
+
+    std::ifstream file;
+    char separator;
+    std::vector<std::string> header;
+    std::vector<std::string> row;
+};
+
+typedef std::function<std::unique_ptr<TemplateDataSource>()> DataSourceFactory;
+
+// "repeat": "name" draws a row or object once per record of the data source registered
+// under name; {"ndjson": path} or {"csv": path} reads a file instead. Repeated objects
+// are moved by (dx, dy) per record.
+//
+// Every repeat adds its record count to the document value doc.<source>.count, and each
+// field listed in "totals" is summed into doc.<source>.total.<field>.
+struct TemplateRepeat {
+    enum class Format { NAMED, NDJSON, CSV };
+    Format format = Format::NAMED;
+    std::string source;
+    double dx = 0, dy = 0;
+    std::vector<std::string> totals;
+
+    bool isSet() const { return !source.empty(); }
+};
+
+// "if": "field" keeps a row or object when the field is set and not "", "0" or "false";
+// "if": "!field" inverts the test
+struct TemplateCondition {
+    std::string field;
+    bool negate = false;
+
+    bool isSet() const { return !field.empty(); }
+    bool test(const TemplateValues& values, const TemplateValues* record) const;
+};
+
+// Pre-resolved forms of the page objects. Fonts are indexes into CompiledTemplate::fonts
+// (-1 is the document font) and are looked up once per document, not once per object.
+struct CompiledText {
+    TemplateString content;
+    double x = 0, y = 0;
+    double fontSize = 10;
+    double maxWidth = 0, maxHeight = 0;
+    double lineSpace = 10;
+    Color color;
+    HAlignment hAlignment = HAlignment::LEFT;
+    VAlignment vAlignment = VAlignment::TOP;
+    int font = -1;
+};
+
+struct CompiledShape {
+    enum class Kind { LINE, CIRCLE, RECTANGLE, TRIANGLE };
+    Kind kind = Kind::LINE;
+    double x = 0, y = 0, x2 = 0, y2 = 0, x3 = 0, y3 = 0;
+    double width = 0, height = 0, radius = 0;
+    double lineWidth = 0.5;
+    Color strokeColor;
+    Color fillColor;
+};
+
+struct CompiledPhoto {
+    std::string path;
+    double x = 0, y = 0, width = 0, height = 0, scale = 0, angle = 0;
+    int index = 0;
+};
+
+struct CompiledCell {
+    TemplateString content;
+    uint32_t style = 0; // into CompiledTable::cellStyles
+    int colspan = 1, rowspan = 1;
+    double width = 0;
+};
+
+struct CompiledRow {
+    std::vector<CompiledCell> cells;
+    double height = 20;
+    bool isHeader = false;
+    bool pageBreakBefore = false;
+    TemplateRepeat repeat;
+    TemplateCondition condition;
+};
+
+struct CompiledTable {
+    TableStyle style;
+    int font = -1;
+    double startX = 50, startY = 650, tableWidth = 500;
+    // Interned cell styles without fonts; cellFonts holds the font of each
+    std::vector<CellStyle> cellStyles;
+    std::vector<int> cellFonts;
+    std::vector<CompiledRow> rows;
+    // Set when a row repeats or is conditional; such tables are streamed row by row
+    bool hasDirectives = false;
+};
+
+struct CompiledOp {
+    enum class Kind { TEXT, TABLE, PHOTO, SHAPE };
+    Kind kind;
+    uint32_t index; // into the CompiledTemplate vector of that kind
+    bool pageDependent = false;
+    TemplateRepeat repeat;
+    TemplateCondition condition;
+};
+
+struct CompiledPage {
+    double margin = 0, headerHeight = 0, footerHeight = 0;
+    std::vector<CompiledOp> ops;
+};
+
+// A job layout with every object parsed, enums decoded and styles interned. Immutable
+// once compiled, so one instance can be rendered by several threads at once.
+struct CompiledTemplate {
+    uint64_t hash = 0;
+    std::string source; // compared on a cache hit, as FNV collisions are easy to make
+    DocumentConfig config;
+    TemplateString fileName;
+    std::vector<std::string> fonts;
+    std::vector<CompiledText> texts;
+    std::vector<CompiledTable> tables;
+    std::vector<CompiledPhoto> photos;
+    std::vector<CompiledShape> shapes;
+    std::vector<CompiledPage> pages;
+    bool hasHeader = false, hasFooter = false;
+    CompiledPage header, footer;
+};
+
+// Compiled templates keyed by the hash of their JSON source; a template whose hash
+// collides with a cached one's is compiled again and replaces it
+class TemplateCache {
+public:
+    // Template for json, compiled on first use; null when json is not a valid job
+    std::shared_ptr<const CompiledTemplate> get(const std::string& json);
+    size_t size() const;
+    void clear();
+
+private:
+    mutable std::mutex mMutex;
+    std::unordered_map<uint64_t, std::shared_ptr<const CompiledTemplate>> mTemplates;
+};
+
 class PDFJson {
+    friend class JsonPageStreamer;
 private:
+    // Which objects of a header/footer to draw: page-independent ones go into a
+    // form XObject written once, the ones using page tokens into a per-page overlay.
+    enum class HeaderFooterPart { ALL, STATIC, DYNAMIC };
+
+    struct HeaderFooterForms {
+        bool hasStatic = false;
+        bool hasDynamic = false;
+        ObjectIDType staticId = 0;
+    };
+
     std::shared_ptr<PDFCreator> pdf;
+    std::shared_ptr<ResourcePool> resources;
+    std::unordered_map<std::string, DataSourceFactory> dataSources;
     DocumentConfig config;
     bool processSuccess = false;
+    double parseSeconds = 0;
+    bool statsEnabled = false;
+    size_t workerThreads = 0;
+    std::shared_ptr<Tracer> tracer;
+    std::shared_ptr<Logger> logger;
+    OutputTarget* output = nullptr;
+    HeaderFooterForms headerForms;
+    HeaderFooterForms footerForms;
+    // Records of a page-dependent header/footer are counted on its first page only, as
+    // it is drawn again for every page
+    mutable bool countRecords = true;
+    mutable std::unordered_set<const CompiledPage*> countedParts;
 
     // Utility methods
     bool hasMember(const Value& obj, const char* name) const;
@@ -125,14 +356,69 @@ private:
     // Parsing methods
     Color processColor(const Value& colorObj) const;
     bool processTextObject(PDFFormXObject *xObject,const Value& textObj, int pageNumber=0) const;
+    void readCell(const Value& cellObj, TableCell& td, std::string& fontPath) const;
     std::shared_ptr<TableCell> processCell(PDFFormXObject *xObject,const Value& cellObj) const;
     std::shared_ptr<TableRow> processRow(PDFFormXObject *xObject,const Value& rowObj) const;
+    TableStyle readTableStyle(const Value& tableObj, double defaultFontSize, std::string& fontPath,
+                              double& startX, double& startY, double& tableWidth) const;
+    std::shared_ptr<PDFTable> processTableStyle(const Value& tableObj, double& startX, double& startY, double& tableWidth) const;
     bool processTable(PDFFormXObject *xObject,const Value& tableObj) const;
     bool processPhoto(PDFFormXObject *xObject,const Value& photoObj) const;
     bool processShape(PDFFormXObject *xObject,const Value& shapeObj) const;
-    bool processPageObject(PDFFormXObject *xObject,const Value& obj, int pageNumber=0) const;
+    bool processPageObject(PDFFormXObject *xObject,const Value& obj, int pageNumber=0, int objectIndex=-1) const;
+    void beginPage(double margin, double headerHeight, double footerHeight) const;
     bool processPage(const Value& pageObj) const;
-    bool processHeaderFooter(PDFFormXObject *xObject,const Value& hfObj, int pageNumber=0) const;
+    bool processDocument(Document& document);
+    DocumentConfig readConfig(const Value& document) const;
+    bool createPdf();
+    bool beginDocument(const Value& document);
+    bool endDocument();
+
+    // Compile and emit halves of the processXxx methods, shared with compiled templates
+    static int internFont(std::vector<std::string>& fonts, const std::string& fontPath);
+    std::vector<std::shared_ptr<PDFUsedFont>> resolveFonts(const std::vector<std::string>& fonts) const;
+    TemplateRepeat compileRepeat(const Value& obj) const;
+    TemplateCondition compileCondition(const Value& obj) const;
+    std::unique_ptr<TemplateDataSource> openDataSource(const TemplateRepeat& repeat) const;
+    CompiledText compileText(const Value& textObj, std::vector<std::string>& fonts) const;
+    bool compileShape(const Value& shapeObj, CompiledShape& shape) const;
+    CompiledPhoto compilePhoto(const Value& photoObj) const;
+    CompiledTable compileTable(const Value& tableObj, double defaultFontSize, std::vector<std::string>& fonts) const;
+    void compileObjects(const Value& container, CompiledTemplate& tpl, CompiledPage& page) const;
+    void emitText(PDFFormXObject *xObject, const CompiledText& text, const std::vector<std::shared_ptr<PDFUsedFont>>& fonts,
+                  const TemplateValues& values, int pageNumber, const TemplateValues* record = nullptr,
+                  double dx = 0, double dy = 0) const;
+    void drawText(PDFFormXObject *xObject, const CompiledText& text, const std::vector<std::shared_ptr<PDFUsedFont>>& fonts,
+                  const TemplateValues& values, int pageNumber, const TemplateValues* record,
+                  double dx, double dy) const;
+    void countRecord(const TemplateRepeat& repeat, const TemplateValues& record) const;
+    void emitShape(PDFFormXObject *xObject, const CompiledShape& shape, double dx = 0, double dy = 0) const;
+    void emitPhoto(PDFFormXObject *xObject, const CompiledPhoto& photo, double dx = 0, double dy = 0) const;
+    void emitTable(PDFFormXObject *xObject, const CompiledTable& table, const std::vector<std::shared_ptr<PDFUsedFont>>& fonts,
+                   const TemplateValues& values, int pageNumber, const TemplateValues* record = nullptr,
+                   double dx = 0, double dy = 0) const;
+    void streamTable(PDFFormXObject *xObject, const CompiledTable& table, std::shared_ptr<PDFTable> tableDrawer,
+                     const std::vector<std::shared_ptr<PDFUsedFont>>& fonts, const TemplateValues& values,
+                     int pageNumber, const TemplateValues* record, double startX, double startY) const;
+    void emitOp(PDFFormXObject *xObject, const CompiledTemplate& tpl, const CompiledOp& op,
+                const std::vector<std::shared_ptr<PDFUsedFont>>& fonts, const TemplateValues& values,
+                int pageNumber, const TemplateValues* record, double dx, double dy) const;
+    void emitOps(PDFFormXObject *xObject, const CompiledTemplate& tpl, const CompiledPage& page,
+                 const std::vector<std::shared_ptr<PDFUsedFont>>& fonts, const TemplateValues& values,
+                 int pageNumber, HeaderFooterPart part = HeaderFooterPart::ALL) const;
+    template <typename MakeStream>
+    bool processStreams(MakeStream makeInput);
+    bool processHeaderFooter(PDFFormXObject *xObject,const Value& hfObj, int pageNumber=0,
+                             HeaderFooterPart part=HeaderFooterPart::ALL) const;
+    // Text or table cells using ${PAGE_NUMBER}; such objects are drawn again on every page
+    bool hasPageTokens(const Value& obj) const;
+    HeaderFooterForms scanHeaderFooter(const Value& hfObj) const;
+    void preloadImages(const Value& hfObj) const;
+    // Writes the header and footer forms of a page, then places them. preload(isHeader) embeds
+    // a part's images, render draws its static or dynamic objects into a form.
+    void placeHeadersAndFooters(bool hasHeader, bool hasFooter, int pageNumber,
+                                const std::function<void(bool)>& preload,
+                                const std::function<bool(PDFFormXObject*, bool, HeaderFooterPart)>& render);
 
    std::string replaceStr(const std::string &source, const std::string &from, const std::string &to) const;
 
@@ -141,16 +427,60 @@ public:
     PDFJson(std::shared_ptr<PDFCreator> pdf_);
     virtual ~PDFJson() = default;
 
-    // Main parsing function
+    // Main parsing function. Files are parsed in place from a memory mapping;
+    // strings are parsed into a DOM that copies them.
     bool processFromFile(const std::string& filename);
     bool processFromString(const std::string& jsonString);
+    // Renders into pdfBytes (cleared first) without touching the filesystem; "file_name"
+    // only labels log records
+    bool processFromString(const std::string& jsonString, std::vector<uint8_t>& pdfBytes);
+
+    // Streaming variants: the input is read twice with a SAX reader and no DOM of the
+    // pages is built. Pass one keeps everything except "pages" (config, header, footer);
+    // pass two renders each page object as it completes and feeds table rows to a
+    // TableStream, so key order matters here although it does not in JSON: page settings
+    // (margin, header_height, footer_height) must precede "objects" and table settings must
+    // precede "rows". Later ones are ignored with a warning. A table whose "type" follows
+    // its rows cannot be recognised early and is buffered whole. A failing object is logged and skipped.
+    bool processFromFileStreaming(const std::string& filename);
+    bool processFromStringStreaming(const std::string& jsonString);
+
+    // Compiled templates: the layout is parsed and resolved once, then rendered any number
+    // of times with different values bound to its ${name} fields
+    std::shared_ptr<CompiledTemplate> compileTemplate(const std::string& json) const;
+    bool processTemplate(const CompiledTemplate& tpl, const TemplateValues& values);
+    // Data sources named by "repeat" directives; the factory is called for every repeat
+    void setDataSource(const std::string& name, DataSourceFactory factory) { dataSources[name] = factory; }
+    void setDataSource(const std::string& name, std::shared_ptr<const std::vector<TemplateValues>> records);
 
     // Accessors
     const DocumentConfig& getConfig() const { return config; }
     bool isParsedSuccessfully() const { return processSuccess; }
+    // Time spent building the DOM for the last job
+    double getParseSeconds() const { return parseSeconds; }
+    int getPageCount() const { return pdf ? pdf->pageNumber : 0; }
+    // Font program bytes in the generated file, see PDFCreator::getEmbeddedFontBytes
+    size_t getEmbeddedFontBytes() const { return pdf ? pdf->getEmbeddedFontBytes() : 0; }
+    // Collect RenderStats for the documents created from now on
+    void setStatsEnabled(bool enabled) { statsEnabled = enabled; }
+    // Stats of the last job, with the JSON parse time; all zero unless enabled
+    RenderStats getStats() const;
+    // Layout worker threads of the documents created from now on, see PDFCreator::setWorkerThreads
+    void setWorkerThreads(size_t threads) { workerThreads = threads; }
+    // Spans of the documents created from now on, including per-object and header/footer spans
+    void setTracer(std::shared_ptr<Tracer> tracer_) { tracer = tracer_; }
+    // Documents created from now on are written to output instead of "file_name", e.g. a
+    // FileDescriptorOutput or CallbackOutput streaming page by page; output must outlive them
+    void setOutput(OutputTarget* output_) { output = output_; }
+    // Logger of this parser and the documents it creates; Logger::getDefault() unless set
+    void setLogger(std::shared_ptr<Logger> logger_) { logger = logger_; }
+    // Logs with the output file and current page filled in; page 0 means the current one
+    void log(LogLevel level, const std::string& message, int object = -1, int page = 0) const;
     
     // Utility methods
     void clear();
+    // Documents created from now on share glyph metrics and image metadata through pool
+    void setResourcePool(std::shared_ptr<ResourcePool> pool) { resources = pool; }
 
     // Getters for specific elements
    // const std::vector<Page>& getPages() const { return config.pages; }
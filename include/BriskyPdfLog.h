@@ -0,0 +1,104 @@
+#ifndef BRISKYPDF_LOG_H
+#define BRISKYPDF_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum class LogLevel { DEBUG, INFO, WARNING, ERROR, OFF };
+
+struct LogRecord {
+    LogLevel level = LogLevel::INFO;
+    std::string message;
+    std::string document; // output file name, empty when not known
+    int page = 0;         // 1-based, 0 when not known
+    int object = -1;      // index in the page's "objects", -1 when not known
+    std::chrono::system_clock::time_point time;
+
+    static const char *levelName(LogLevel level);
+};
+
+// Receives the records of one Logger, always on its drain thread
+class LogSink {
+public:
+    virtual ~LogSink() = default;
+    virtual void write(const LogRecord &record) = 0;
+    // Called after each batch of records
+    virtual void flush() {}
+};
+
+// "LEVEL message [document=... page=... object=...]" lines
+class StreamLogSink : public LogSink {
+public:
+    explicit StreamLogSink(std::ostream &stream = std::cerr) : mStream(stream) {}
+    void write(const LogRecord &record) override;
+    void flush() override { mStream.flush(); }
+
+private:
+    std::ostream &mStream;
+};
+
+// Leveled logger for the library. Records are queued in a bounded lock-free ring and written
+// by a background thread started on the first record, so rendering threads never wait on the
+// sink; when the ring is full the record is dropped and counted. Test enabled() before
+// formatting anything costly.
+class Logger {
+public:
+    explicit Logger(std::shared_ptr<LogSink> sink, LogLevel level = LogLevel::WARNING, size_t capacity = 4096);
+    ~Logger();
+
+    bool enabled(LogLevel level) const { return level >= mLevel.load(std::memory_order_relaxed); }
+    void setLevel(LogLevel level) { mLevel.store(level, std::memory_order_relaxed); }
+    LogLevel getLevel() const { return mLevel.load(std::memory_order_relaxed); }
+
+    void log(LogRecord record);
+    void log(LogLevel level, std::string message, const std::string &document = std::string(), int page = 0, int object = -1);
+
+    // Blocks until every record queued so far has been written
+    void flush();
+    uint64_t dropped() const { return mDropped.load(std::memory_order_relaxed); }
+
+    // Used by documents that were not given a logger: warnings and errors to std::cerr
+    static std::shared_ptr<Logger> getDefault();
+    static void setDefault(std::shared_ptr<Logger> logger);
+
+    Logger(const Logger &) = delete;
+    Logger &operator=(const Logger &) = delete;
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        LogRecord record;
+    };
+
+    bool tryPush(LogRecord &record);
+    bool tryPop(LogRecord &record);
+    void drainLoop();
+
+    std::shared_ptr<LogSink> mSink;
+    std::atomic<LogLevel> mLevel;
+
+    std::unique_ptr<Cell[]> mCells;
+    size_t mMask;
+    std::atomic<size_t> mEnqueuePos{0};
+    size_t mDequeuePos = 0; // drain thread only
+
+    std::atomic<uint64_t> mQueued{0};
+    std::atomic<uint64_t> mWritten{0};
+    std::atomic<uint64_t> mDropped{0};
+
+    std::once_flag mStarted;
+    std::thread mDrainThread;
+    std::atomic<bool> mStopping{false};
+    std::atomic<bool> mSleeping{false}; // drain thread is waiting on mWake
+    std::mutex mWakeMutex;
+    std::condition_variable mWake;
+};
+
+#endif
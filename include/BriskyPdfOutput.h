@@ -0,0 +1,82 @@
+#ifndef BRISKYPDF_OUTPUT_H
+#define BRISKYPDF_OUTPUT_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "PDFWriter/IByteWriterWithPosition.h"
+
+// Destination of a document that is not written to a named file, see
+// PDFCreator::createDocument(OutputTarget*). PDFHummus writes many small pieces, so targets
+// other than memory stage them; PDFCreator flushes after every finished page and at the end,
+// which lets a reader start on the bytes before EndPDF.
+class OutputTarget : public IByteWriterWithPosition {
+public:
+    virtual ~OutputTarget() = default;
+
+    IOBasicTypes::LongBufferSizeType Write(const IOBasicTypes::Byte *inBuffer, IOBasicTypes::LongBufferSizeType inSize) override;
+    IOBasicTypes::LongFilePositionType GetCurrentPosition() override { return static_cast<IOBasicTypes::LongFilePositionType>(mPosition); }
+
+    // Passes the staged bytes on; false once the destination has failed
+    bool flush();
+    bool failed() const { return mFailed; }
+    // Bytes of the document so far, including staged ones
+    uint64_t size() const { return mPosition; }
+
+protected:
+    explicit OutputTarget(size_t stagingBytes) : mStagingBytes(stagingBytes) {}
+    // Receives the bytes in document order; false stops the output
+    virtual bool deliver(const uint8_t *data, size_t size) = 0;
+
+private:
+    std::vector<uint8_t> mStaging;
+    size_t mStagingBytes;
+    uint64_t mPosition = 0;
+    bool mFailed = false;
+};
+
+// Appends to a caller-owned buffer
+class MemoryOutput : public OutputTarget {
+public:
+    explicit MemoryOutput(std::vector<uint8_t> &buffer) : OutputTarget(0), mBuffer(buffer), mStart(buffer.size()) {}
+
+    // The document's bytes, without what the buffer held before
+    const uint8_t *data() const { return mBuffer.data() + mStart; }
+    uint8_t *data() { return mBuffer.data() + mStart; }
+
+protected:
+    bool deliver(const uint8_t *data, size_t size) override;
+
+private:
+    std::vector<uint8_t> &mBuffer;
+    size_t mStart;
+};
+
+// Writes to an open file descriptor, e.g. a pipe or socket; the descriptor is not closed
+class FileDescriptorOutput : public OutputTarget {
+public:
+    explicit FileDescriptorOutput(int fd, size_t stagingBytes = 64 * 1024) : OutputTarget(stagingBytes), mFd(fd) {}
+
+protected:
+    bool deliver(const uint8_t *data, size_t size) override;
+
+private:
+    int mFd;
+};
+
+// Hands the bytes to a callback, e.g. the body writer of a response
+class CallbackOutput : public OutputTarget {
+public:
+    typedef std::function<bool(const uint8_t *data, size_t size)> Callback;
+
+    explicit CallbackOutput(Callback callback, size_t stagingBytes = 64 * 1024)
+        : OutputTarget(stagingBytes), mCallback(callback) {}
+
+protected:
+    bool deliver(const uint8_t *data, size_t size) override { return mCallback && mCallback(data, size); }
+
+private:
+    Callback mCallback;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef BRISKYPDF_STATS_H
+#define BRISKYPDF_STATS_H
+
+#include <chrono>
+#include <cstdint>
+
+// Timings and counters of one document, collected while PDFCreator::setStatsEnabled(true).
+// Phases nest (drawing a table includes drawing its text); a phase that is already running
+// is not timed again, so each phase's time is wall time without double counting.
+struct RenderStats {
+    enum Phase {
+        PARSE,
+        TEXT_MEASURE,   // summed over the threads that measured
+        TEXT_WRAP,
+        TABLE_GRID,
+        CELL_POSITIONS,
+        CONTENT_EMIT,
+        IMAGE_EMBED,
+        END_PDF,
+        PHASE_COUNT
+    };
+
+    double seconds[PHASE_COUNT] = {};
+
+    uint64_t pages = 0;
+    uint64_t operators = 0;        // written through ContentEmitter
+    uint64_t glyphMeasures = 0;    // strings measured
+    uint64_t glyphCacheHits = 0;   // advances and kerning pairs found in the metrics cache
+    uint64_t glyphCacheMisses = 0; // ... and those asked from the font
+    uint64_t imageCacheHits = 0;
+    uint64_t imageCacheMisses = 0;
+    uint64_t imageXObjects = 0;
+    uint64_t formXObjects = 0;
+
+    // Phases being timed right now; used by PhaseTimer
+    bool running[PHASE_COUNT] = {};
+
+    static const char *phaseName(Phase phase)
+    {
+        static const char *const names[PHASE_COUNT] = {"parse", "text_measure", "text_wrap", "table_grid",
+                                                       "cell_positions", "content_emit", "image_embed", "end_pdf"};
+        return phase < PHASE_COUNT ? names[phase] : "";
+    }
+};
+
+// Measurement counters of one TextMetricsCache; every thread measures with its own cache
+struct TextMetricsCounters {
+    uint64_t measures = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    double measureSeconds = 0;
+};
+
+// Adds the time until the end of the scope to a phase; does nothing when stats is null
+class PhaseTimer {
+public:
+    PhaseTimer(RenderStats *stats, RenderStats::Phase phase) : mStats(stats), mPhase(phase)
+    {
+        if (!mStats || mStats->running[phase])
+        {
+            mStats = nullptr;
+            return;
+        }
+        mStats->running[phase] = true;
+        mStart = std::chrono::steady_clock::now();
+    }
+    ~PhaseTimer()
+    {
+        if (!mStats)
+            return;
+        mStats->seconds[mPhase] += std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count();
+        mStats->running[mPhase] = false;
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+    RenderStats *mStats;
+    RenderStats::Phase mPhase;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef BRISKYPDF_THREADPOOL_H
+#define BRISKYPDF_THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+// Fixed set of worker threads. parallelFor splits a range into chunks that the
+// workers and the calling thread pull from a shared counter; the caller takes
+// part itself, so a call never waits on work that has not started.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    std::future<void> submit(std::function<void()> task);
+
+    // fn(begin, end, participant) with participant in [0, size()]: pool threads
+    // use their own index and the calling thread uses size(), so callers can
+    // keep one scratch object per participant without locking.
+    void parallelFor(size_t count, size_t grain,
+                     const std::function<void(size_t, size_t, size_t)>& fn);
+
+    // Index of the current thread for parallelFor callbacks of this pool
+    size_t participantIndex() const;
+
+private:
+    void workerLoop(size_t index);
+
+    std::vector<std::thread> workers;
+    std::deque<std::packaged_task<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+#endif // BRISKYPDF_THREADPOOL_H
@@ -0,0 +1,83 @@
+#ifndef BRISKYPDF_TRACE_H
+#define BRISKYPDF_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline of render spans written as Chrome trace-event JSON, for chrome://tracing or
+// ui.perfetto.dev. A tracer can be shared by documents rendered on several threads; each
+// span carries the id of the thread that recorded it.
+class Tracer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Event {
+        const char *name;     // string literals, not copied
+        const char *category;
+        std::string detail;   // shown under args, may be empty
+        uint32_t tid;
+        int64_t startNanos;   // since the tracer was created
+        int64_t durationNanos;
+    };
+
+    Tracer() : mEpoch(Clock::now()) {}
+
+    // Off by default; spans started while off are not recorded
+    void setEnabled(bool enabled) { mEnabled.store(enabled, std::memory_order_relaxed); }
+    bool isEnabled() const { return mEnabled.load(std::memory_order_relaxed); }
+
+    void record(const char *name, const char *category, Clock::time_point start, Clock::time_point end,
+                std::string detail = std::string());
+
+    std::vector<Event> events() const;
+    void clear();
+    std::string toJson() const;
+    // False when the file cannot be written; the caller reports it
+    bool writeFile(const std::string &path) const;
+
+    // Small number naming the calling thread, stable for its lifetime
+    static uint32_t threadId();
+
+private:
+    std::atomic<bool> mEnabled{false};
+    Clock::time_point mEpoch;
+    mutable std::mutex mMutex;
+    std::vector<Event> mEvents;
+};
+
+// Records one span from construction to the end of the scope; does nothing when the
+// tracer is null or disabled
+class TraceSpan {
+public:
+    TraceSpan(Tracer *tracer, const char *name, const char *category)
+        : mTracer(tracer && tracer->isEnabled() ? tracer : nullptr), mName(name), mCategory(category)
+    {
+        if (mTracer)
+            mStart = Tracer::Clock::now();
+    }
+    ~TraceSpan()
+    {
+        if (mTracer)
+            mTracer->record(mName, mCategory, mStart, Tracer::Clock::now(), std::move(mDetail));
+    }
+
+    // Test before building a detail string so that disabled spans cost nothing
+    bool active() const { return mTracer != nullptr; }
+    void setDetail(std::string detail) { mDetail = std::move(detail); }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    Tracer *mTracer;
+    const char *mName;
+    const char *mCategory;
+    std::string mDetail;
+    Tracer::Clock::time_point mStart;
+};
+
+#endif
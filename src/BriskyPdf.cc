@@ -1,15 +1,291 @@
 #include "BriskyPdf.h"
 #include <iostream>
 #include <cmath>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include "PDFWriter/InputFile.h"
+#include "PDFWriter/InputByteArrayStream.h"
+#include "PDFWriter/PDFParser.h"
+#include "PDFWriter/PDFDictionary.h"
+#include "PDFWriter/PDFStreamInput.h"
+#include "PDFWriter/PDFInteger.h"
+#include "PDFWriter/RefCountPtr.h"
+#include "PDFWriter/TIFFUsageParameters.h"
+
+// Length of the UTF-8 sequence starting at text[pos], decoding it into codepoint
+static size_t decodeUtf8(const std::string &text, size_t pos, uint32_t &codepoint)
+{
+    unsigned char c = static_cast<unsigned char>(text[pos]);
+    size_t len = 1;
+    if (c >= 0xF0)
+    {
+        len = 4;
+        codepoint = c & 0x07;
+    }
+    else if (c >= 0xE0)
+    {
+        len = 3;
+        codepoint = c & 0x0F;
+    }
+    else if (c >= 0xC0)
+    {
+        len = 2;
+        codepoint = c & 0x1F;
+    }
+    else
+    {
+        codepoint = c;
+        return 1;
+    }
+    if (pos + len > text.size())
+    {
+        codepoint = c;
+        return 1;
+    }
+    for (size_t i = 1; i < len; ++i)
+    {
+        codepoint = (codepoint << 6) | (static_cast<unsigned char>(text[pos + i]) & 0x3F);
+    }
+    return len;
+}
+
+// Holds the font mutex, if any, while the font itself is queried
+static std::unique_lock<std::mutex> lockFont(std::mutex *fontMutex)
+{
+    return fontMutex ? std::unique_lock<std::mutex>(*fontMutex) : std::unique_lock<std::mutex>();
+}
+
+double GlyphMetrics::advance(PDFUsedFont *font, const std::string &text, size_t pos, size_t len, uint32_t codepoint)
+{
+    auto it = mAdvances.find(codepoint);
+    if (it != mAdvances.end())
+    {
+        if (mCounters)
+            mCounters->hits++;
+        return it->second;
+    }
+    if (mCounters)
+        mCounters->misses++;
+
+    auto lock = lockFont(mFontMutex);
+    double width = font->CalculateTextAdvance(text.substr(pos, len), mFontSize);
+    mAdvances.emplace(codepoint, width);
+    return width;
+}
+
+double GlyphMetrics::kerning(PDFUsedFont *font, const std::string &text, size_t first, size_t len,
+                             uint32_t left, uint32_t right)
+{
+    uint64_t key = (static_cast<uint64_t>(left) << 32) | right;
+    auto it = mKerning.find(key);
+    if (it != mKerning.end())
+    {
+        if (mCounters)
+            mCounters->hits++;
+        return it->second;
+    }
+    if (mCounters)
+        mCounters->misses++;
+
+    // Whatever the pair measures beyond its two advances is the kerning adjustment
+    auto lock = lockFont(mFontMutex);
+    double pairWidth = font->CalculateTextAdvance(text.substr(first, len), mFontSize);
+    double adjust = pairWidth - mAdvances[left] - mAdvances[right];
+    mKerning.emplace(key, adjust);
+    return adjust;
+}
+
+double GlyphMetrics::measure(PDFUsedFont *font, const std::string &text)
+{
+    if (!mCounters)
+        return measureText(font, text);
+
+    auto start = std::chrono::steady_clock::now();
+    double width = measureText(font, text);
+    mCounters->measures++;
+    mCounters->measureSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return width;
+}
+
+double GlyphMetrics::measureText(PDFUsedFont *font, const std::string &text)
+{
+    double width = 0;
+    uint32_t previous = 0;
+    size_t previousPos = 0;
+    for (size_t pos = 0; pos < text.size();)
+    {
+        uint32_t codepoint;
+        size_t len = decodeUtf8(text, pos, codepoint);
+        width += advance(font, text, pos, len, codepoint);
+        if (pos > 0)
+            width += kerning(font, text, previousPos, pos + len - previousPos, previous, codepoint);
+        previous = codepoint;
+        previousPos = pos;
+        pos += len;
+    }
+    return width;
+}
+
+double GlyphMetrics::lineHeight(PDFUsedFont *font)
+{
+    if (mLineHeight < 0)
+    {
+        auto lock = lockFont(mFontMutex);
+        mLineHeight = font->CalculateTextDimensions("X", mFontSize).height;
+    }
+    return mLineHeight;
+}
+
+void GlyphMetrics::warmUp(PDFUsedFont *font, const std::string &charset)
+{
+    lineHeight(font);
+    for (size_t pos = 0; pos < charset.size();)
+    {
+        uint32_t codepoint;
+        size_t len = decodeUtf8(charset, pos, codepoint);
+        advance(font, charset, pos, len, codepoint);
+        pos += len;
+    }
+}
+
+void GlyphMetrics::merge(const GlyphMetrics &other)
+{
+    if (mLineHeight < 0)
+        mLineHeight = other.mLineHeight;
+    mAdvances.insert(other.mAdvances.begin(), other.mAdvances.end());
+    mKerning.insert(other.mKerning.begin(), other.mKerning.end());
+}
+
+GlyphMetrics &TextMetricsCache::get(PDFUsedFont *font, double fontSize)
+{
+    std::pair<PDFUsedFont *, double> key(font, fontSize);
+    if (mLast && key == mLastKey)
+        return *mLast;
+
+    auto &metrics = mMetrics[key];
+    if (!metrics)
+    {
+        if (mPool && mFontPaths)
+        {
+            auto path = mFontPaths->find(font);
+            if (path != mFontPaths->end())
+                metrics = mPool->seedMetrics(path->second, fontSize);
+        }
+        if (metrics)
+            metrics->setFontMutex(mFontMutex);
+        else
+            metrics.reset(new GlyphMetrics(fontSize, mFontMutex));
+        metrics->setCounters(mCounters.get());
+    }
+    mLastKey = key;
+    mLast = metrics.get();
+    return *mLast;
+}
+
+void TextMetricsCache::setCounting(bool enabled)
+{
+    if (enabled && !mCounters)
+        mCounters.reset(new TextMetricsCounters());
+    else if (!enabled)
+        mCounters.reset();
+    for (auto &entry : mMetrics)
+    {
+        entry.second->setCounters(mCounters.get());
+    }
+}
+
+void TextMetricsCache::clear()
+{
+    mMetrics.clear();
+    mLast = nullptr;
+}
+
+void TextMetricsCache::publish() const
+{
+    if (!mPool || !mFontPaths)
+        return;
+
+    for (auto &entry : mMetrics)
+    {
+        auto path = mFontPaths->find(entry.first.first);
+        if (path != mFontPaths->end())
+            mPool->publishMetrics(path->second, entry.first.second, *entry.second);
+    }
+}
+
+std::unique_ptr<GlyphMetrics> ResourcePool::seedMetrics(const std::string &fontPath, double fontSize) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mMetrics.find(std::make_pair(fontPath, fontSize));
+    if (it == mMetrics.end())
+        return nullptr;
+    return std::unique_ptr<GlyphMetrics>(new GlyphMetrics(it->second));
+}
+
+void ResourcePool::publishMetrics(const std::string &fontPath, double fontSize, const GlyphMetrics &metrics)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mMetrics.find(std::make_pair(fontPath, fontSize));
+    if (it == mMetrics.end())
+    {
+        GlyphMetrics pooled(metrics);
+        pooled.setFontMutex(nullptr);
+        pooled.setCounters(nullptr);
+        mMetrics.emplace(std::make_pair(fontPath, fontSize), std::move(pooled));
+    }
+    else
+    {
+        it->second.merge(metrics);
+    }
+}
+
+bool ResourcePool::getImageDimensions(const std::string &imagePath, double &width, double &height) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mImages.find(imagePath);
+    if (it == mImages.end())
+        return false;
+    width = it->second.first;
+    height = it->second.second;
+    return true;
+}
+
+void ResourcePool::putImageDimensions(const std::string &imagePath, double width, double height)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mImages[imagePath] = std::make_pair(width, height);
+}
+
+size_t ResourcePool::metricsCount() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mMetrics.size();
+}
 
-AdvancedTextWrapper::AdvancedTextWrapper(std::shared_ptr<PDFUsedFont> font, double fontSize, double lineSpace)
+size_t ResourcePool::imageCount() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mImages.size();
+}
+
+AdvancedTextWrapper::AdvancedTextWrapper(std::shared_ptr<PDFUsedFont> font, double fontSize, double lineSpace, TextMetricsCache *cache)
     : mFont(font), mFontSize(fontSize), mLineSpace(lineSpace)
 {
-    auto dimensions = mFont->CalculateTextDimensions("X", mFontSize);
-    mLineHeight = dimensions.height;
+    if (cache)
+    {
+        mMetrics = &cache->get(mFont.get(), mFontSize);
+    }
+    else
+    {
+        mOwnMetrics.reset(new GlyphMetrics(mFontSize));
+        mMetrics = mOwnMetrics.get();
+    }
+    mLineHeight = mMetrics->lineHeight(mFont.get());
+    mSpaceWidth = mMetrics->measure(mFont.get(), " ");
 }
 
-AdvancedTextWrapper::WrappedTextResult AdvancedTextWrapper::wrapText(const std::string &text, const WrappingOptions &options)
+AdvancedTextWrapper::WrappedTextResult AdvancedTextWrapper::wrapText(std::string_view text, const WrappingOptions &options)
 {
     WrappedTextResult result;
     result.totalHeight = 0;
@@ -23,10 +299,8 @@ AdvancedTextWrapper::WrappedTextResult AdvancedTextWrapper::wrapText(const std::
     for (size_t i = 0; i < words.size(); ++i)
     {
         const std::string &word = words[i];
-        auto dimensions = mFont->CalculateTextDimensions(word, mFontSize);
-        auto spaceDimensions = mFont->CalculateTextDimensions(" ", mFontSize);
-        double wordWidth = dimensions.width;
-        double spaceWidth = currentLine.empty() ? 0 : spaceDimensions.width;
+        double wordWidth = mMetrics->measure(mFont.get(), word);
+        double spaceWidth = currentLine.empty() ? 0 : mSpaceWidth;
 
         if (currentLineWidth + spaceWidth + wordWidth <= options.maxWidth)
         {
@@ -46,9 +320,8 @@ AdvancedTextWrapper::WrappedTextResult AdvancedTextWrapper::wrapText(const std::
                 {
                     auto brokenWord = breakWord(word, options.maxWidth);
                     currentLine = brokenWord.first;
-                    auto dimensions = mFont->CalculateTextDimensions(currentLine + "-", mFontSize);
                     result.lines.push_back(currentLine + "-");
-                    result.lineWidths.push_back(dimensions.width);
+                    result.lineWidths.push_back(mMetrics->measure(mFont.get(), result.lines.back()));
                     result.totalHeight += mLineHeight + mLineSpace;
 
                     words.insert(words.begin() + i + 1, brokenWord.second);
@@ -84,15 +357,19 @@ AdvancedTextWrapper::WrappedTextResult AdvancedTextWrapper::wrapText(const std::
     return result;
 }
 
-std::vector<std::string> AdvancedTextWrapper::splitWords(const std::string &text)
+std::vector<std::string> AdvancedTextWrapper::splitWords(std::string_view text)
 {
     std::vector<std::string> words;
-    std::istringstream stream(text);
-    std::string word;
-
-    while (stream >> word)
+    size_t pos = 0;
+    while (pos < text.size())
     {
-        words.push_back(word);
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+            ++pos;
+        size_t start = pos;
+        while (pos < text.size() && !std::isspace(static_cast<unsigned char>(text[pos])))
+            ++pos;
+        if (pos > start)
+            words.emplace_back(text.substr(start, pos - start));
     }
 
     return words;
@@ -107,8 +384,7 @@ std::pair<std::string, std::string> AdvancedTextWrapper::breakWord(const std::st
     for (size_t i = breakPoint; i > 0; --i)
     {
         std::string part1 = word.substr(0, i);
-        auto dimensions = mFont->CalculateTextDimensions(part1, mFontSize);
-        if (dimensions.width <= targetWidth)
+        if (mMetrics->measure(mFont.get(), part1) <= targetWidth)
         {
             return {part1, word.substr(i)};
         }
@@ -120,30 +396,177 @@ std::pair<std::string, std::string> AdvancedTextWrapper::breakWord(const std::st
 
 ////////////////////////////////////////////////////////////
 
-std::vector<std::vector<std::shared_ptr<TableCell>>> PDFTable::BuildCellGrid(const std::vector<TableRow> &rows)
+bool CellStyle::operator==(const CellStyle &other) const
 {
-    int maxCols = 0;
-    for (const auto &row : rows)
+    return hAlignment == other.hAlignment && vAlignment == other.vAlignment &&
+           backgroundColor.r == other.backgroundColor.r && backgroundColor.g == other.backgroundColor.g &&
+           backgroundColor.b == other.backgroundColor.b &&
+           textColor.r == other.textColor.r && textColor.g == other.textColor.g && textColor.b == other.textColor.b &&
+           fontSize == other.fontSize && borderWidth == other.borderWidth &&
+           topBorderWidth == other.topBorderWidth && leftBorderWidth == other.leftBorderWidth &&
+           rightBorderWidth == other.rightBorderWidth && bottomBorderWidth == other.bottomBorderWidth &&
+           isHeader == other.isHeader && font == other.font;
+}
+
+size_t CellStyleHash::operator()(const CellStyle &style) const
+{
+    std::hash<double> hashDouble;
+    size_t seed = std::hash<PDFUsedFont *>()(style.font.get());
+    auto combine = [&seed](size_t value)
+    { seed ^= value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2); };
+    combine(static_cast<size_t>(style.hAlignment) | (static_cast<size_t>(style.vAlignment) << 2) | (style.isHeader << 4));
+    combine(hashDouble(style.backgroundColor.r));
+    combine(hashDouble(style.backgroundColor.g));
+    combine(hashDouble(style.backgroundColor.b));
+    combine(hashDouble(style.textColor.r));
+    combine(hashDouble(style.textColor.g));
+    combine(hashDouble(style.textColor.b));
+    combine(hashDouble(style.fontSize));
+    combine(hashDouble(style.borderWidth));
+    combine(hashDouble(style.topBorderWidth));
+    combine(hashDouble(style.leftBorderWidth));
+    combine(hashDouble(style.rightBorderWidth));
+    combine(hashDouble(style.bottomBorderWidth));
+    return seed;
+}
+
+uint32_t TableModel::internStyle(const CellStyle &style)
+{
+    auto it = styleIndex.find(style);
+    if (it != styleIndex.end())
+        return it->second;
+
+    uint32_t index = styles.size();
+    styles.push_back(style);
+    styleIndex.emplace(style, index);
+    return index;
+}
+
+uint64_t hashBytes(const char *data, size_t size, uint64_t hash)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint32_t TableModel::addStyle(const CellStyle &style)
+{
+    return internStyle(style);
+}
+
+void TableModel::beginRow(double height, bool isHeader, bool pageBreakBefore)
+{
+    rowFirstCell.push_back(cellCount());
+    rowHeight.push_back(height);
+    rowFlags.push_back((isHeader ? ROW_HEADER : 0) | (pageBreakBefore ? ROW_PAGE_BREAK_BEFORE : 0));
+}
+
+void TableModel::addCell(std::string_view text, uint32_t style, int cellColspan, int cellRowspan, double cellWidth)
+{
+    textOffset.push_back(textBuffer.size());
+    textLength.push_back(text.size());
+    textBuffer.append(text.data(), text.size());
+    cellStyle.push_back(style);
+    colspan.push_back(static_cast<uint16_t>(std::max(1, cellColspan)));
+    rowspan.push_back(static_cast<uint16_t>(std::max(1, cellRowspan)));
+    width.push_back(static_cast<float>(cellWidth));
+}
+
+void TableModel::addRow(const TableRow &row)
+{
+    beginRow(row.height, row.isHeader, row.pageBreakBefore);
+
+    for (const auto &cell : row.cells)
+    {
+        CellStyle style;
+        style.hAlignment = cell->hAlignment;
+        style.vAlignment = cell->vAlignment;
+        style.backgroundColor = cell->backgroundColor;
+        style.textColor = cell->textColor;
+        style.fontSize = cell->fontSize;
+        style.borderWidth = cell->borderWidth;
+        style.topBorderWidth = cell->topBorderWidth;
+        style.leftBorderWidth = cell->leftBorderWidth;
+        style.rightBorderWidth = cell->rightBorderWidth;
+        style.bottomBorderWidth = cell->bottomBorderWidth;
+        style.isHeader = cell->isHeader;
+        style.font = cell->font;
+
+        addCell(cell->content, internStyle(style), cell->colspan, cell->rowspan, cell->width);
+    }
+}
+
+void TableModel::reserve(size_t rows, size_t cells)
+{
+    rowFirstCell.reserve(rows);
+    rowHeight.reserve(rows);
+    rowFlags.reserve(rows);
+    textOffset.reserve(cells);
+    textLength.reserve(cells);
+    cellStyle.reserve(cells);
+    colspan.reserve(cells);
+    rowspan.reserve(cells);
+    width.reserve(cells);
+}
+
+void TableModel::clear()
+{
+    rowFirstCell.clear();
+    rowHeight.clear();
+    rowFlags.clear();
+    textOffset.clear();
+    textLength.clear();
+    cellStyle.clear();
+    colspan.clear();
+    rowspan.clear();
+    width.clear();
+    textBuffer.clear();
+}
+
+size_t TableModel::memoryBytes() const
+{
+    return rowFirstCell.capacity() * sizeof(uint32_t) + rowHeight.capacity() * sizeof(double) +
+           rowFlags.capacity() * sizeof(uint8_t) +
+           textOffset.capacity() * sizeof(uint32_t) + textLength.capacity() * sizeof(uint32_t) +
+           cellStyle.capacity() * sizeof(uint32_t) + colspan.capacity() * sizeof(uint16_t) +
+           rowspan.capacity() * sizeof(uint16_t) + width.capacity() * sizeof(float) +
+           textBuffer.capacity() + styles.capacity() * sizeof(CellStyle);
+}
+
+////////////////////////////////////////////////////////////
+
+CellGrid PDFTable::BuildCellGrid(const TableModel &model, int columns)
+{
+    TraceSpan span(pdf ? pdf->getTracer() : nullptr, "BuildCellGrid", "table");
+    PhaseTimer timer(pdf ? pdf->getStatsSink() : nullptr, RenderStats::TABLE_GRID);
+    CellGrid grid;
+    int numRows = model.rowCount();
+
+    int maxCols = columns;
+    for (int row = 0; row < numRows && columns <= 0; ++row)
     {
         int colCount = 0;
-        for (const auto &cell : row.cells)
+        for (uint32_t cell = model.rowBegin(row); cell < model.rowEnd(row); ++cell)
         {
-            colCount += cell->colspan;
+            colCount += model.colspan[cell];
         }
         maxCols = std::max(maxCols, colCount);
     }
 
-    std::vector<std::vector<std::shared_ptr<TableCell>>> grid(rows.size(),
-                                                              std::vector<std::shared_ptr<TableCell>>(maxCols, nullptr));
+    grid.rows = numRows;
+    grid.cols = maxCols;
+    grid.cellCol.assign(model.cellCount(), -1);
+    grid.occupied.assign((static_cast<size_t>(numRows) * maxCols + 63) / 64, 0);
 
-    for (size_t rowIdx = 0; rowIdx < rows.size(); ++rowIdx)
+    for (int row = 0; row < numRows; ++row)
     {
-        const auto &row = rows[rowIdx];
         int colIdx = 0;
-
-        for (const auto &cell : row.cells)
+        for (uint32_t cell = model.rowBegin(row); cell < model.rowEnd(row); ++cell)
         {
-            while (colIdx < maxCols && grid[rowIdx][colIdx] != nullptr)
+            while (colIdx < maxCols && grid.isOccupied(row, colIdx))
             {
                 colIdx++;
             }
@@ -151,70 +574,40 @@ std::vector<std::vector<std::shared_ptr<TableCell>>> PDFTable::BuildCellGrid(con
             if (colIdx >= maxCols)
                 break;
 
-            for (int r = 0; r < cell->rowspan && (rowIdx + r) < rows.size(); ++r)
+            grid.cellCol[cell] = colIdx;
+            for (int r = 0; r < model.rowspan[cell] && (row + r) < numRows; ++r)
             {
-                for (int c = 0; c < cell->colspan && (colIdx + c) < maxCols; ++c)
+                for (int c = 0; c < model.colspan[cell] && (colIdx + c) < maxCols; ++c)
                 {
-                    if (r == 0 && c == 0)
-                    {
-                        cell->height = row.height;
-                        cell->isRowHeader = row.isHeader;
-                        grid[rowIdx + r][colIdx + c] = cell;
-                    }
-                    else
-                    {
-                        std::shared_ptr<TableCell> spannedCell = std::make_shared<TableCell>();
-                        spannedCell->isSpanned = true;
-                        spannedCell->actualRow = rowIdx + r;
-                        spannedCell->actualCol = colIdx + c;
-                        spannedCell->height = rows[rowIdx + r].height;
-                        spannedCell->width = grid[rowIdx][colIdx]->width;
-                        spannedCell->isRowHeader = grid[rowIdx][colIdx]->isHeader;
-                        grid[rowIdx + r][colIdx + c] = spannedCell;
-                    }
+                    grid.setOccupied(row + r, colIdx + c);
                 }
             }
 
-            colIdx += cell->colspan;
+            colIdx += model.colspan[cell];
         }
     }
 
     return grid;
 }
 
-// Calculate precise cell positions and sizes
-std::vector<CellPosition> PDFTable::CalculateCellPositions(
-    const std::vector<std::vector<std::shared_ptr<TableCell>>> &grid,
-    double tableWidth)
+// Column widths: cells with an explicit width fix their column, the rest share what is left
+std::vector<double> PDFTable::CalculateColumnWidths(const TableModel &model, const CellGrid &grid, double tableWidth)
 {
+    PhaseTimer timer(pdf ? pdf->getStatsSink() : nullptr, RenderStats::CELL_POSITIONS);
+    if (grid.rows == 0 || grid.cols == 0)
+        return std::vector<double>();
 
-    std::vector<CellPosition> positions;
-
-    if (grid.empty())
-        return positions;
-
-    int numCols = grid[0].size();
-    int numRows = grid.size();
+    int numCols = grid.cols;
 
     // Calculate column widths (simple equal distribution for now)
     double fixWidth = tableWidth / numCols;
     std::vector<double> colWidths(numCols, fixWidth);
 
-    // Calculate row heights
-    std::vector<double> rowHeights(numRows, mStyle.fontSize + (2 * mStyle.cellPadding));
-
-
-    for (int row = 0; row < numRows; ++row)
+    for (uint32_t cell = 0; cell < model.cellCount(); ++cell)
     {
-        for (int col = 0; col < numCols;)
+        if (grid.cellCol[cell] >= 0 && model.width[cell] > 0)
         {
-            if(grid[row][col]==nullptr) {col++; continue;}
-            std::shared_ptr<TableCell> cell = grid[row][col];
-            if(cell->width > 0 ) 
-            {
-                colWidths[col] = cell->width;
-            }
-            col+=cell->colspan;
+            colWidths[grid.cellCol[cell]] = model.width[cell];
         }
     }
 
@@ -228,338 +621,305 @@ std::vector<CellPosition> PDFTable::CalculateCellPositions(
     for(auto &item:colWidths) {
         if(item==fixWidth) item+=diff;
     }
+    return colWidths;
+}
+
+// Calculate precise cell positions and sizes
+CellLayout PDFTable::CalculateCellPositions(const TableModel &model, const CellGrid &grid, double tableWidth)
+{
+    return CalculateCellPositions(model, grid, CalculateColumnWidths(model, grid, tableWidth));
+}
+
+CellLayout PDFTable::CalculateCellPositions(const TableModel &model, const CellGrid &grid,
+                                            const std::vector<double> &colWidths)
+{
+    TraceSpan span(pdf ? pdf->getTracer() : nullptr, "CalculateCellPositions", "table");
+    PhaseTimer timer(pdf ? pdf->getStatsSink() : nullptr, RenderStats::CELL_POSITIONS);
+
+    CellLayout layout;
+    int numRows = grid.rows;
+    int numCols = std::min<int>(colWidths.size(), grid.cols);
+
+    std::vector<double> colX(numCols + 1, 0);
+    for (int col = 0; col < numCols; ++col)
+    {
+        colX[col + 1] = colX[col] + colWidths[col];
+    }
+
+    layout.positions.reserve(model.cellCount());
+    layout.rowOffsets.reserve(numRows + 1);
+    layout.rowHeights.assign(model.rowHeight.begin(), model.rowHeight.end());
 
     for (int row = 0; row < numRows; ++row)
     {
-        for (int col = 0; col < numCols; ++col)
+        layout.rowOffsets.push_back(layout.positions.size());
+
+        bool hasCells = false;
+        for (int col = 0; col < numCols && !hasCells; ++col)
+        {
+            hasCells = grid.isOccupied(row, col);
+        }
+        if (hasCells)
+            layout.rowHeights[row] = std::max(layout.rowHeights[row], mStyle.cellPadding * 2);
+
+        for (uint32_t cell = model.rowBegin(row); cell < model.rowEnd(row); ++cell)
         {
-            if(grid[row][col]==nullptr) {continue;}
-            grid[row][col]->width = colWidths[col];
+            int col = grid.cellCol[cell];
+            if (col < 0 || col >= numCols)
+                continue;
+
+            int lastCol = std::min(col + model.colspan[cell], numCols);
+            CellPosition pos;
+            pos.row = row;
+            pos.col = col;
+            pos.cell = cell;
+            pos.x = colX[col];
+            pos.y = 0;
+            pos.width = colX[lastCol] - colX[col];
+            pos.height = 0;
+            layout.positions.push_back(pos);
         }
     }
+    layout.rowOffsets.push_back(layout.positions.size());
 
-    for (int row = 0; row < numRows; ++row)
+    // Wrap every cell once, possibly on several threads
+    layout.text.resize(layout.positions.size());
+    std::vector<TextLayoutJob> jobs;
+    jobs.reserve(layout.positions.size());
+    for (size_t i = 0; i < layout.positions.size(); ++i)
     {
-        double maxRowHeight = 0;
-        for (int col = 0; col < numCols; ++col)
-        {
-            if(grid[row][col]==nullptr) {continue;}
-            std::shared_ptr<TableCell> cell = grid[row][col];
-            double fontSize = cell->fontSize > 0 ? cell->fontSize : mStyle.fontSize;
-            std::shared_ptr<PDFUsedFont> fontID;
-            if (!cell->font)
-            {
-                fontID = mStyle.font;
-            }
-            else
-            {
-                fontID = cell->font;
-            }
-            AdvancedTextWrapper wrapper(fontID, fontSize, 10);
-            AdvancedTextWrapper::WrappingOptions options;
-            double textWith=0;
-            for (int c = col; c < col + cell->colspan && c < numCols; ++c)
-            {
-                textWith += colWidths[c];
-            }
+        const auto &pos = layout.positions[i];
+        auto content = model.text(pos.cell);
+        if (content.empty())
+            continue;
 
-            options.maxWidth = textWith-(2*mStyle.cellPadding);
-            options.alignment = HAlignment::LEFT;
-            options.hyphenate = true;
-            auto dimension = wrapper.wrapText(cell->content, options);
-           double totalHeight =  dimension.totalHeight+(mStyle.cellPadding*2);
-           if(totalHeight>cell->height)
-            {
-                cell->height = totalHeight;
-            }
-            if(maxRowHeight<cell->height) 
-            {
-                maxRowHeight = cell->height;
-                for (int col = 0; col < numCols; ++col)
-                {
-                    if(grid[row][col]==nullptr) {continue;}
-                    grid[row][col]->height = maxRowHeight;
-                }
-            }
+        const CellStyle &style = model.style(pos.cell);
+        TextLayoutJob job;
+        job.text = content;
+        job.font = style.font ? style.font : mStyle.font;
+        job.fontSize = style.fontSize > 0 ? style.fontSize : mStyle.fontSize;
+        job.maxWidth = pos.width - (2 * mStyle.cellPadding);
+        job.lineSpace = 10;
+        job.result = &layout.text[i];
+        jobs.push_back(std::move(job));
+    }
+    pdf->layoutTexts(jobs);
 
-        }
+    // A row is as tall as its tallest cell
+    for (size_t i = 0; i < layout.positions.size(); ++i)
+    {
+        double &rowHeight = layout.rowHeights[layout.positions[i].row];
+        rowHeight = std::max(rowHeight, layout.text[i].totalHeight + (mStyle.cellPadding * 2));
     }
 
-    // Build cell positions
+    // Heights are known once every row is measured; rowspans cover the rows below them
+    double y = 0;
+    std::vector<double> rowY(numRows, 0);
     for (int row = 0; row < numRows; ++row)
     {
-        for (int col = 0; col < numCols; ++col)
+        rowY[row] = y;
+        y += layout.rowHeights[row];
+    }
+    for (auto &pos : layout.positions)
+    {
+        pos.y = rowY[pos.row];
+        for (int r = pos.row; r < pos.row + model.rowspan[pos.cell] && r < numRows; ++r)
         {
-            if(grid[row][col]==nullptr) {continue;}
-            std::shared_ptr<TableCell> cell = grid[row][col];
-            if (cell)
-            {
-                CellPosition pos;
-                pos.row = row;
-                pos.col = col;
-
-                pos.width = 0;
-
-                for (int c = col; c < col + cell->colspan && c < numCols; ++c)
-                {
-                    //cell->width = colWidths[c];
-                    pos.width += colWidths[c];
-                }
+            pos.height += layout.rowHeights[r];
+        }
+    }
 
-                pos.height = 0;
-                for (int r = row; r < row + cell->rowspan && r < numRows; ++r)
-                {
-                    if (cell->height > 0)
-                        pos.height += cell->height;
-                    else
-                        pos.height += rowHeights[r];
-                }
+    return layout;
+}
 
-                pos.cell = cell;
-                positions.push_back(pos);
-            }
+void PDFTable::IndexHeaderRows(const TableModel &model, CellLayout &layout)
+{
+    layout.headerRows.clear();
+    layout.headerHeight = 0;
+    for (int rowIdx = 0; rowIdx < static_cast<int>(model.rowCount()); ++rowIdx)
+    {
+        if (model.isHeaderRow(rowIdx))
+        {
+            layout.headerRows.push_back(rowIdx);
+            layout.headerHeight += layout.rowHeights[rowIdx];
         }
     }
-
-    return positions;
 }
 
-int PDFTable::DrawRowsOnPage(PDFFormXObject *FormXObject, PageContentContext *context,
-                             const std::vector<TableRow> &rows,
-                             const std::vector<CellPosition> &cellPositions,
-                             double startX, double startY, double tableWidth,
+int PDFTable::DrawRowsOnPage(PDFFormXObject *FormXObject,
+                             const TableModel &model,
+                             const CellLayout &cellLayout,
+                             double startX, double startY,
                              int startRow)
 {
+    TraceSpan span(pdf ? pdf->getTracer() : nullptr, "DrawRowsOnPage", "table");
 
     double currentY = startY;
-    int rowsDrawn = 0;
+    std::vector<int> rows;
 
-    for (int rowIdx = startRow; rowIdx < static_cast<int>(rows.size()); ++rowIdx)
+    for (int rowIdx = startRow; rowIdx < static_cast<int>(model.rowCount()); ++rowIdx)
     {
-        const auto &row = rows[rowIdx];
-        double rowHeight = row.cells[0]->height;
+        double rowHeight = cellLayout.rowHeights[rowIdx];
 
-        if (row.pageBreakBefore && rowsDrawn > 0)
+        if (model.hasPageBreakBefore(rowIdx) && !rows.empty())
         {
-            return rowsDrawn; // Force page break
+            break; // Force page break
         }
 
         if (currentY - rowHeight < margin)
         {
-            return rowsDrawn; // No more space
+            break; // No more space
         }
 
-        DrawRowCells(FormXObject, context, cellPositions, rowIdx, startX, currentY, tableWidth);
-
+        rows.push_back(rowIdx);
         currentY -= rowHeight;
-        rowsDrawn++;
     }
 
-    return rowsDrawn;
+    DrawRows(FormXObject, model, cellLayout, rows, startX, startY);
+    return static_cast<int>(rows.size());
 }
 
-void PDFTable::DrawRowCells(PDFFormXObject *FormXObject, PageContentContext *context,
-                            const std::vector<CellPosition> &cellPositions,
-                            int rowIdx, double startX, double rowY, double tableWidth)
+void PDFTable::DrawRows(PDFFormXObject *FormXObject,
+                        const TableModel &model,
+                        const CellLayout &cellLayout,
+                        const std::vector<int> &rows, double startX, double startY)
 {
-    double sx = startX;
-    for (const auto &pos : cellPositions)
+    PhaseTimer timer(pdf ? pdf->getStatsSink() : nullptr, RenderStats::CONTENT_EMIT);
+    if (rows.empty())
+        return;
+
+    double rowY = startY;
+    for (int rowIdx : rows)
     {
-        if (pos.row == rowIdx && pos.cell->isSpanned)
+        for (size_t i = cellLayout.rowOffsets[rowIdx]; i < cellLayout.rowOffsets[rowIdx + 1]; ++i)
         {
-            sx += pos.cell->width;
+            const auto &pos = cellLayout.positions[i];
+            const CellStyle &style = model.style(pos.cell);
+            DrawCellBackground(style, startX + pos.x, rowY, pos.width, pos.height);
+            DrawCellBorder(startX + pos.x, rowY, pos.width, pos.height,
+                           style.borderWidth >= 0 ? style.borderWidth : mStyle.borderWidth,
+                           style.topBorderWidth, style.bottomBorderWidth, style.leftBorderWidth, style.rightBorderWidth);
         }
-        else if (pos.row == rowIdx && !pos.cell->isSpanned)
+        rowY -= cellLayout.rowHeights[rowIdx];
+    }
+
+    ContentEmitter &emitter = pdf->emitterFor(FormXObject);
+    if (!emitter.isBound())
+    {
+        mGrid.clear();
+        return;
+    }
+    mGrid.flushFills(emitter);
+
+    rowY = startY;
+    for (int rowIdx : rows)
+    {
+        for (size_t i = cellLayout.rowOffsets[rowIdx]; i < cellLayout.rowOffsets[rowIdx + 1]; ++i)
         {
-            DrawCell(FormXObject, context, *pos.cell, sx, rowY, pos.width, pos.height);
-            sx += pos.cell->width;
+            const auto &pos = cellLayout.positions[i];
+            DrawCellContent(FormXObject, model.style(pos.cell), cellLayout.text[i],
+                            startX + pos.x, rowY, pos.width, pos.height);
         }
+        rowY -= cellLayout.rowHeights[rowIdx];
     }
-}
 
-void PDFTable::DrawCell(PDFFormXObject *FormXObject, PageContentContext *context, const TableCell &cell,
-                        double x, double y, double width, double height)
-{
-    XObjectContentContext *xobjectContentContext;
-    if (FormXObject != nullptr)
-        xobjectContentContext = FormXObject->GetContentContext();
-
-    if (FormXObject == nullptr)
-        context->q();
-    else
-        xobjectContentContext->q();
-    DrawCellBackground(FormXObject, context, cell, x, y, width, height);
-    DrawCellBorder(FormXObject, context, x, y, width, height, cell.borderWidth >= 0 ? cell.borderWidth : mStyle.borderWidth,cell.topBorderWidth,cell.bottomBorderWidth,cell.leftBorderWidth,cell.rightBorderWidth);
-    DrawCellContent(FormXObject, context, cell, x, y, width, height);
-    if (FormXObject == nullptr)
-        context->Q();
-    else
-        xobjectContentContext->Q();
+    mGrid.flushStrokes(emitter);
 }
 
-void PDFTable::DrawCellBackground(PDFFormXObject *FormXObject, PageContentContext *context, const TableCell &cell,
-                                  double x, double y, double width, double height)
+void PDFTable::DrawCellBackground(const CellStyle &style, double x, double y, double width, double height)
 {
 
     TableStyle::Color bgColor = mStyle.oddRowBackground;
 
-    if (cell.backgroundColor.r >= 0)
+    if (style.backgroundColor.r >= 0)
     {
-        bgColor = cell.backgroundColor;
+        bgColor = style.backgroundColor;
     }
-    else if (cell.isHeader)
+    else if (style.isHeader)
     {
         bgColor = mStyle.headerBackground;
     }
     if (bgColor.r == -1 || bgColor.g == -1 || bgColor.b == -1)
         return;
 
-    if (FormXObject == nullptr)
-    {
-        context->rg(bgColor.r, bgColor.g, bgColor.b);
-        context->re(x, y - height, width, height);
-        context->f();
-        context->rg(0, 0, 0);
-    }
-    else
-    {
-        XObjectContentContext *xobjectContentContext = FormXObject->GetContentContext();
-        xobjectContentContext->rg(bgColor.r, bgColor.g, bgColor.b);
-        xobjectContentContext->re(x, y - height, width, height);
-        xobjectContentContext->f();
-        xobjectContentContext->rg(0, 0, 0);
-    }
+    mGrid.addFill(bgColor.r, bgColor.g, bgColor.b, x, y - height, width, height);
 }
 
-void PDFTable::DrawCellBorder(PDFFormXObject *FormXObject, PageContentContext *context,
-                              double x, double y, double width, double height, double borderWidth, double topBorderWidth,double bottomBorderWidth,double leftBorderWidth,double rightBorderWidth)
+void PDFTable::DrawCellBorder(double x, double y, double width, double height, double borderWidth, double topBorderWidth,double bottomBorderWidth,double leftBorderWidth,double rightBorderWidth)
 {
     if (borderWidth == 0 && topBorderWidth==0 && bottomBorderWidth==0 && leftBorderWidth==0 && rightBorderWidth==0)
         return;
 
-    if(borderWidth>0)
-    {
-        pdf->addRectangle(FormXObject, x,  y- height, width, height,
-                                   -1.0, -1.0, -1.0,
-                                   mStyle.borderColor.r, mStyle.borderColor.g, mStyle.borderColor.b,
-                                   borderWidth);        
-    }
-    if(topBorderWidth>0)
-    {
-        double startX = x;
-        double startY = y;
-        double endX = x + width;
-        double endY = y;
-        pdf->addLine(FormXObject, startX, startY, endX, endY,
-                              topBorderWidth, mStyle.borderColor.r, mStyle.borderColor.g, mStyle.borderColor.b);
-    }
-    if(bottomBorderWidth>0)
-    {
-        double startX = x;
-        double startY = y - height;
-        double endX = x + width;
-        double endY = y - height;
-        pdf->addLine(FormXObject, startX, startY, endX, endY,
-                              topBorderWidth, mStyle.borderColor.r, mStyle.borderColor.g, mStyle.borderColor.b);
-    }
-    if(leftBorderWidth>0)
-    {
-        double startX = x;
-        double startY = y;
-        double endX = x;
-        double endY = y - height;
-        pdf->addLine(FormXObject, startX, startY, endX, endY,
-                              topBorderWidth, mStyle.borderColor.r, mStyle.borderColor.g, mStyle.borderColor.b);
-    }
-    if(rightBorderWidth>0)
-    {
-        double startX = x + width;
-        double startY = y;
-        double endX = x + width;
-        double endY = y- height;
-        pdf->addLine(FormXObject, startX, startY, endX, endY,
-                              topBorderWidth, mStyle.borderColor.r, mStyle.borderColor.g, mStyle.borderColor.b);
-    }
-
+    const TableStyle::Color &color = mStyle.borderColor;
+    if (borderWidth > 0)
+        mGrid.addFrame(borderWidth, color.r, color.g, color.b, x, y - height, width, height);
+    if (topBorderWidth > 0)
+        mGrid.addSegment(topBorderWidth, color.r, color.g, color.b, x, y, x + width, y);
+    if (bottomBorderWidth > 0)
+        mGrid.addSegment(bottomBorderWidth, color.r, color.g, color.b, x, y - height, x + width, y - height);
+    if (leftBorderWidth > 0)
+        mGrid.addSegment(leftBorderWidth, color.r, color.g, color.b, x, y, x, y - height);
+    if (rightBorderWidth > 0)
+        mGrid.addSegment(rightBorderWidth, color.r, color.g, color.b, x + width, y, x + width, y - height);
 }
 
-void PDFTable::DrawCellContent(PDFFormXObject *FormXObject, PageContentContext *context, const TableCell &cell,
-                               double x, double y, double width, double height)
+void PDFTable::DrawCellContent(PDFFormXObject *FormXObject, const CellStyle &style,
+                               const TextLayout &text, double x, double y, double width, double height)
 {
 
-    if (cell.content.empty())
+    if (text.lines.empty())
         return;
 
-    TableStyle::Color textColor = cell.textColor.r >= 0 ? cell.textColor : mStyle.textColor;
+    TableStyle::Color textColor = style.textColor.r >= 0 ? style.textColor : mStyle.textColor;
 
-    double fontSize = cell.fontSize > 0 ? cell.fontSize : mStyle.fontSize;
+    double fontSize = style.fontSize > 0 ? style.fontSize : mStyle.fontSize;
 
     std::shared_ptr<PDFUsedFont> fontID;
-    if (!cell.font)
+    if (!style.font)
     {
         fontID = mStyle.font;
     }
     else
     {
-        fontID = cell.font;
+        fontID = style.font;
     }
 
-    /*AbstractContentContext::TextOptions textOptions(
-        fontID.get(),
-        fontSize
-    );*/
-
-    // Calculate text position based on HAlignment
-    auto dimensions = fontID->CalculateTextDimensions(cell.content, fontSize);
-
     double textX = x + mStyle.cellPadding;
     double textY = y - mStyle.cellPadding;
 
-    //std::cout<<cell.content<<"  =>   x:"<<x<<"    y:"<<y<<"    textX:"<<textX<<"   textY:"<<textY<<"    cellPading:"<<mStyle.cellPadding<<"    height:"<<height<<"    width:"<<width<<"     Final height:"<<height- (mStyle.cellPadding*2)<<"     Final Width:"<<width- (mStyle.cellPadding*2)<<std::endl;
-   
-    pdf->addText(FormXObject,textX,textY,cell.content,fontID,fontSize,textColor.r, textColor.g, textColor.b,cell.hAlignment,cell.vAlignment,width- (mStyle.cellPadding*2),height- (mStyle.cellPadding*2),10,false);
+    pdf->drawTextLayout(FormXObject,textX,textY,text,fontID,fontSize,textColor.r, textColor.g, textColor.b,style.hAlignment,style.vAlignment,width- (mStyle.cellPadding*2),height- (mStyle.cellPadding*2),false);
     
 }
 
-double PDFTable::GetHeaderHeight(const std::vector<TableRow> &rows)
+void PDFTable::DrawTableHeader(PDFFormXObject *FormXObject,
+                               const TableModel &model,
+                               const CellLayout &cellLayout,
+                               double startX, double startY)
 {
-    double headerHeight = 0;
-    for (const auto &row : rows)
-    {
-        if (row.isHeader)
-        {
-            headerHeight += row.cells[0]->height;
-        }
-    }
-    return headerHeight;
+    DrawRows(FormXObject, model, cellLayout, cellLayout.headerRows, startX, startY);
 }
 
-void PDFTable::DrawTableHeader(PDFFormXObject *FormXObject, PageContentContext *context,
-                               const std::vector<TableRow> &rows,
-                               const std::vector<CellPosition> &cellPositions,
-                               double startX, double startY, double tableWidth)
+EPDFVersion OutputOptions::effectiveVersion() const
 {
-    double currentY = startY;
-    for (int rowIdx = 0; rowIdx < static_cast<int>(rows.size()); ++rowIdx)
-    {
-        const auto &row = rows[rowIdx];
-        double rowHeight = row.cells[0]->height;
-        if (row.isHeader)
-        {
-            DrawRowCells(FormXObject, context, cellPositions, rowIdx, startX, currentY, tableWidth);
-            currentY -= rowHeight;
-        }
-    }
+    if (xrefStream && version < ePDFVersion15)
+        return ePDFVersion15;
+    return version;
+}
+
+PDFCreationSettings OutputOptions::creationSettings() const
+{
+    return PDFCreationSettings(compressStreams, fonts != FontEmbedding::NONE,
+                               EncryptionOptions::DefaultEncryptionOptions(), xrefStream);
 }
 
 PDFCreator::PDFCreator(double width, double height, double margin, double headerHeight, double footerHeight)
-    : currentPage(nullptr), currentContext(nullptr), pageWidth(width), pageHeight(height), initPageFunc([this](int x)
-                                                                                                        { std::cout << "Page: " << x << std::endl; })
+    : logger(Logger::getDefault()), currentPage(nullptr), currentContext(nullptr), pageWidth(width), pageHeight(height)
 {
     pageStyle.margin = margin;
     pageStyle.headerHeight = headerHeight;
     pageStyle.footerHeight = footerHeight;
     pageNumber = 0;
+    textMetrics.setFontMutex(&fontMutex);
 }
 
 PDFCreator::~PDFCreator()
@@ -570,14 +930,43 @@ PDFCreator::~PDFCreator()
 
 bool PDFCreator::createDocument(const std::string &filename)
 {
-    EStatusCode status = pdfWriter.StartPDF(filename, ePDFVersion13);
+    EStatusCode status = pdfWriter.StartPDF(filename, outputOptions.effectiveVersion(), LogConfiguration::DefaultLogConfiguration(),
+                                            outputOptions.creationSettings());
     if (status != eSuccess)
     {
-        std::cerr << "Failed to create PDF document: " << filename << std::endl;
+        if (logger)
+            logger->log(LogLevel::ERROR, "Failed to create PDF document", filename);
         return false;
     }
     currentFilename = filename;
-    std::cout << "PDF document created: " << filename << std::endl;
+    output = nullptr;
+    documentSaved = false;
+    embeddedFontBytes = -1;
+    documentStart = tracer && tracer->isEnabled() ? Tracer::Clock::now() : Tracer::Clock::time_point();
+    log(LogLevel::INFO, "PDF document created");
+    setFont("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf");
+
+    return true;
+}
+
+bool PDFCreator::createDocument(OutputTarget *target, const std::string &name)
+{
+    if (!target)
+        return false;
+    EStatusCode status = pdfWriter.StartPDFForStream(target, outputOptions.effectiveVersion(), LogConfiguration::DefaultLogConfiguration(),
+                                                     outputOptions.creationSettings());
+    if (status != eSuccess)
+    {
+        if (logger)
+            logger->log(LogLevel::ERROR, "Failed to create PDF document", name);
+        return false;
+    }
+    currentFilename = name;
+    output = target;
+    documentSaved = false;
+    embeddedFontBytes = -1;
+    documentStart = tracer && tracer->isEnabled() ? Tracer::Clock::now() : Tracer::Clock::time_point();
+    log(LogLevel::INFO, "PDF document created");
     setFont("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf");
 
     return true;
@@ -586,23 +975,88 @@ bool PDFCreator::createDocument(const std::string &filename)
 bool PDFCreator::openDocument(const std::string &filename)
 {
 
-    EStatusCode status = pdfWriter.ModifyPDF(filename, ePDFVersion13, "");
+    EStatusCode status = pdfWriter.ModifyPDF(filename, outputOptions.effectiveVersion(), "", LogConfiguration::DefaultLogConfiguration(),
+                                             outputOptions.creationSettings());
     if (status != eSuccess)
     {
-        std::cerr << "Failed to create PDF document: " << filename << std::endl;
+        if (logger)
+            logger->log(LogLevel::ERROR, "Failed to create PDF document", filename);
         return false;
     }
     currentFilename = filename;
-    std::cout << "PDF document created: " << filename << std::endl;
+    documentSaved = false;
+    embeddedFontBytes = -1;
+    documentStart = tracer && tracer->isEnabled() ? Tracer::Clock::now() : Tracer::Clock::time_point();
+    log(LogLevel::INFO, "PDF document created");
     setFont();
 
     return true;
 }
 
-bool PDFCreator::saveDocument()
+ObjectIDType PDFCreator::addDeferredForm(std::function<void(PDFFormXObject *)> render)
+{
+    ObjectIDType formId = pdfWriter.GetObjectsContext().GetInDirectObjectsRegistry().AllocateNewObjectID();
+    deferredForms.push_back(std::make_pair(formId, render));
+    return formId;
+}
+
+void PDFCreator::placeForm(PDFFormXObject *FormXObject, ObjectIDType formId)
+{
+    if (!FormXObject && !currentContext)
+        return;
+
+    ResourcesDictionary &resourcesDictionary = FormXObject == nullptr ? currentPage->GetResourcesDictionary()
+                                                                      : FormXObject->GetResourcesDictionary();
+    ContentEmitter &emitter = emitterFor(FormXObject);
+    emitter.save();
+    emitter.context()->Do(resourcesDictionary.AddFormXObjectMapping(formId));
+    emitter.restore();
+}
+
+ContentEmitter &PDFCreator::emitterFor(PDFFormXObject *FormXObject)
+{
+    if (FormXObject == nullptr)
+        return pageEmitter;
+
+    ContentEmitter &emitter = formEmitters[FormXObject];
+    if (!emitter.isBound())
+    {
+        emitter.bind(FormXObject->GetContentContext());
+        emitter.setCoalesceText(outputOptions.coalesceText);
+    }
+    return emitter;
+}
+
+ObjectIDType PDFCreator::endForm(PDFFormXObject *formXObject)
+{
+    auto it = formEmitters.find(formXObject);
+    if (it != formEmitters.end())
+    {
+        it->second.finish();
+        countOperators(it->second);
+        formEmitters.erase(it);
+    }
+    ObjectIDType formObjectID = formXObject->GetObjectID();
+    if (pdfWriter.EndFormXObjectAndRelease(formXObject) != PDFHummus::eSuccess)
+        return 0;
+    if (stats)
+        stats->formXObjects++;
+    return formObjectID;
+}
+
+void PDFCreator::countOperators(const ContentEmitter &emitter)
+{
+    if (stats)
+        stats->operators += emitter.operatorCount();
+}
+
+void PDFCreator::endPage()
 {
     if (currentContext)
     {
+        pageEmitter.finish();
+        countOperators(pageEmitter);
+        pageEmitter.bind(nullptr);
         pdfWriter.EndPageContentContext(currentContext);
         currentContext = nullptr;
     }
@@ -611,51 +1065,93 @@ bool PDFCreator::saveDocument()
     {
         pdfWriter.WritePageAndRelease(currentPage);
         currentPage = nullptr;
+        // The page's objects are complete; let a streaming reader have them
+        if (output)
+            output->flush();
+        if (tracer && pageStart != Tracer::Clock::time_point())
+            tracer->record("page", "document", pageStart, Tracer::Clock::now(), "page " + std::to_string(pageNumber));
+        pageStart = Tracer::Clock::time_point();
+    }
+}
+
+bool PDFCreator::saveDocument()
+{
+    // Forms cannot be written inside a page's content stream; the deferred forms' ids are
+    // already referenced, so the last page is finished first
+    endPage();
+
+    documentValues["PAGE_COUNT"] = std::to_string(pageNumber);
+    for (auto &total : documentTotals)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.15g", total.second);
+        documentValues[total.first] = buffer;
+    }
+    for (auto &deferred : deferredForms)
+    {
+        PDFFormXObject *formXObject = pdfWriter.StartFormXObject(PDFRectangle(-pageWidth, -pageHeight, 2 * pageWidth, 2 * pageHeight),
+                                                                 deferred.first);
+        // The id is referenced by the pages; without its object the xref would be broken
+        if (!formXObject)
+        {
+            log(LogLevel::ERROR, "Failed to write deferred form");
+            deferredForms.clear();
+            return false;
+        }
+        deferred.second(formXObject);
+        if (!endForm(formXObject))
+        {
+            log(LogLevel::ERROR, "Failed to end deferred form");
+            deferredForms.clear();
+            return false;
+        }
     }
+    deferredForms.clear();
 
-    EStatusCode status = pdfWriter.EndPDF();
+    EStatusCode status;
+    {
+        PhaseTimer timer(stats, RenderStats::END_PDF);
+        TraceSpan span(tracer.get(), "EndPDF", "document");
+        status = output ? pdfWriter.EndPDFForStream() : pdfWriter.EndPDF();
+        if (output && (!output->flush() || output->failed()))
+            status = eFailure;
+    }
+    if (tracer && documentStart != Tracer::Clock::time_point())
+        tracer->record("document", "document", documentStart, Tracer::Clock::now(), currentFilename);
+    documentStart = Tracer::Clock::time_point();
     if (status == eSuccess)
     {
-        std::cout << "PDF document saved: " << currentFilename << std::endl;
+        documentSaved = true;
+        textMetrics.publish();
+        for (auto &metrics : workerMetrics)
+        {
+            metrics.publish();
+        }
+        log(LogLevel::INFO, "PDF document saved");
         return true;
     }
     else
     {
-        std::cerr << "Failed to save PDF document" << std::endl;
+        log(LogLevel::ERROR, "Failed to save PDF document");
         return false;
     }
 }
 
-void PDFCreator::closeDocument()
+void PDFCreator::log(LogLevel level, const std::string &message, int object) const
 {
+    if (logger && logger->enabled(level))
+        logger->log(level, message, currentFilename, pageNumber, object);
+}
 
-    if (currentContext)
-    {
-        pdfWriter.EndPageContentContext(currentContext);
-        currentContext = nullptr;
-    }
-
-    if (currentPage)
-    {
-        pdfWriter.WritePageAndRelease(currentPage);
-        currentPage = nullptr;
-    }
+void PDFCreator::closeDocument()
+{
+    endPage();
 }
 
 void PDFCreator::createNewPage()
 {
     // Finalize current page if exists
-    if (currentContext)
-    {
-        pdfWriter.EndPageContentContext(currentContext);
-        currentContext = nullptr;
-    }
-
-    if (currentPage)
-    {
-        pdfWriter.WritePageAndRelease(currentPage);
-        currentPage = nullptr;
-    }
+    endPage();
 
     // Create new page
     currentPage = new PDFPage();
@@ -664,15 +1160,22 @@ void PDFCreator::createNewPage()
     currentContext = pdfWriter.StartPageContentContext(currentPage);
     if (!currentContext)
     {
-        std::cerr << "Failed to create page content context" << std::endl;
+        log(LogLevel::ERROR, "Failed to create page content context");
         delete currentPage;
         currentPage = nullptr;
         return;
     }
+    pageEmitter.bind(currentContext);
+    pageEmitter.setCoalesceText(outputOptions.coalesceText);
 
     pageNumber++;
+    log(LogLevel::DEBUG, "Page started");
+    pageStart = tracer && tracer->isEnabled() ? Tracer::Clock::now() : Tracer::Clock::time_point();
     if (initPageFunc)
+    {
+        TraceSpan span(tracer.get(), "initPageFunc", "page");
         initPageFunc(pageNumber);
+    }
 }
 
 PDFFormXObject *PDFCreator::createHeader()
@@ -691,11 +1194,10 @@ ObjectIDType PDFCreator::closeXObject(PDFFormXObject *formXObject)
 {
     if (formXObject)
     {
-        auto formObjectID = formXObject->GetObjectID();
-        if (pdfWriter.EndFormXObjectAndRelease(formXObject) != PDFHummus::eSuccess)
+        auto formObjectID = endForm(formXObject);
+        if (formObjectID == 0)
         {
-            std::cout << "failed to write XObject form\n"
-                      << std::endl;
+            log(LogLevel::ERROR, "Failed to write XObject form");
             return 0;
         }
         formXObject = nullptr;
@@ -723,61 +1225,290 @@ void PDFCreator::setPageStyle(double margin, double headerHeight, double footerH
     pageStyle.footerHeight = footerHeight;
 }
 
-void PDFCreator::setFont(const std::string &fontPath)
+void PDFCreator::setFont(const std::string &fontPath)
+{
+    font = getFontByPath(fontPath);
+    return;
+}
+
+// Sums the stream lengths of FontFile, FontFile2 and FontFile3 in every font descriptor
+static size_t measureEmbeddedFontBytes(IByteReaderWithPosition *input)
+{
+    PDFParser parser;
+    if (parser.StartPDFParsing(input) != eSuccess)
+        return 0;
+
+    static const char *fontFileKeys[] = {"FontFile", "FontFile2", "FontFile3"};
+    size_t bytes = 0;
+    for (ObjectIDType id = 1; id < parser.GetObjectsCount(); id++)
+    {
+        RefCountPtr<PDFObject> object(parser.ParseNewObject(id));
+        if (!object || object->GetType() != PDFObject::ePDFObjectDictionary)
+            continue;
+        PDFDictionary *descriptor = static_cast<PDFDictionary *>(object.GetPtr());
+        for (const char *key : fontFileKeys)
+        {
+            if (!descriptor->Exists(key))
+                continue;
+            RefCountPtr<PDFObject> fontFile(parser.QueryDictionaryObject(descriptor, key));
+            if (!fontFile || fontFile->GetType() != PDFObject::ePDFObjectStream)
+                continue;
+            RefCountPtr<PDFDictionary> streamDictionary(static_cast<PDFStreamInput *>(fontFile.GetPtr())->QueryStreamDictionary());
+            RefCountPtr<PDFObject> length(parser.QueryDictionaryObject(streamDictionary.GetPtr(), "Length"));
+            if (!!length && length->GetType() == PDFObject::ePDFObjectInteger)
+                bytes += static_cast<size_t>(static_cast<PDFInteger *>(length.GetPtr())->GetValue());
+        }
+    }
+    return bytes;
+}
+
+size_t PDFCreator::getEmbeddedFontBytes()
+{
+    if (embeddedFontBytes < 0)
+    {
+        if (!documentSaved)
+            return 0;
+        if (!output)
+        {
+            InputFile file;
+            if (file.OpenFile(currentFilename) != eSuccess)
+                return 0;
+            embeddedFontBytes = static_cast<long long>(measureEmbeddedFontBytes(file.GetInputStream()));
+        }
+        else if (MemoryOutput *memory = dynamic_cast<MemoryOutput *>(output))
+        {
+            InputByteArrayStream input(memory->data(), static_cast<IOBasicTypes::LongFilePositionType>(memory->size()));
+            embeddedFontBytes = static_cast<long long>(measureEmbeddedFontBytes(&input));
+        }
+        else
+        {
+            // Streamed bytes are gone
+            return 0;
+        }
+    }
+    return static_cast<size_t>(embeddedFontBytes);
+}
+
+void PDFCreator::releaseOutput()
+{
+    if (output && embeddedFontBytes < 0)
+    {
+        // Measure while the bytes are still reachable; a streamed document reports 0
+        if (documentSaved && dynamic_cast<MemoryOutput *>(output))
+            getEmbeddedFontBytes();
+        else
+            embeddedFontBytes = 0;
+    }
+    output = nullptr;
+}
+
+std::shared_ptr<PDFUsedFont> PDFCreator::getFontByPath(const std::string &fontPath)
+{
+    auto it = fontCache.find(fontPath);
+    if (it != fontCache.end())
+    {
+        return it->second;
+    }
+    PDFUsedFont *rawFont = pdfWriter.GetFontForFile(fontPath);
+    if (!rawFont)
+    {
+        throw std::runtime_error("Failed to load font: " + fontPath);
+    }
+
+    auto sharedFont = std::shared_ptr<PDFUsedFont>(rawFont,
+                                                   [](PDFUsedFont *font) {});
+    fontCache.emplace(fontPath, sharedFont);
+    fontPaths[rawFont] = fontPath;
+    return sharedFont;
+};
+
+void PDFCreator::setResourcePool(std::shared_ptr<ResourcePool> pool)
+{
+    resources = pool;
+    textMetrics.setResourcePool(resources.get(), &fontPaths);
+    for (auto &metrics : workerMetrics)
+    {
+        metrics.setResourcePool(resources.get(), &fontPaths);
+    }
+}
+
+void PDFCreator::warmUpTextMetrics(const std::vector<double> &fontSizes, const std::string &charset)
+{
+    std::string glyphs = charset;
+    if (glyphs.empty())
+    {
+        for (char c = 0x20; c < 0x7F; ++c)
+            glyphs += c;
+    }
+
+    for (auto &entry : fontCache)
+    {
+        for (double size : fontSizes)
+        {
+            textMetrics.get(entry.second.get(), size).warmUp(entry.second.get(), glyphs);
+        }
+    }
+}
+
+void PDFCreator::addHeader(ObjectIDType FormXObjectId)
+{
+    if (!currentContext)
+        return;
+
+    pageEmitter.save();
+    pageEmitter.cm(1, 0, 0, 1, pageStyle.margin, pageHeight - pageStyle.headerHeight);
+    pageEmitter.context()->Do(currentPage->GetResourcesDictionary().AddFormXObjectMapping(FormXObjectId));
+    pageEmitter.restore();
+}
+
+void PDFCreator::addFooter(ObjectIDType FormXObjectId)
+{
+
+    if (!currentContext)
+        return;
+    pageEmitter.save();
+    pageEmitter.cm(1, 0, 0, 1, pageStyle.margin, pageStyle.footerHeight);
+    pageEmitter.context()->Do(currentPage->GetResourcesDictionary().AddFormXObjectMapping(FormXObjectId));
+    pageEmitter.restore();
+}
+
+Dimension PDFCreator::addText(PDFFormXObject *FormXObject, double x, double y, const std::string &text,std::shared_ptr<PDFUsedFont> textFont, double fontSize,
+                              double r, double g, double b, HAlignment hAlignment,VAlignment vAlignment, double maxWidth,double maxheight, double lineSpace, bool isHidden)
+{
+    Dimension ret;
+    ret.x = x;
+    ret.y = y;
+
+    if (!FormXObject && !currentContext)
+        return ret;
+
+    auto layout = layoutText(text, textFont, fontSize, maxWidth, lineSpace);
+    return drawTextLayout(FormXObject, x, y, layout, textFont, fontSize, r, g, b, hAlignment, vAlignment, maxWidth, maxheight, isHidden);
+}
+
+AdvancedTextWrapper &PDFCreator::getTextWrapper(std::shared_ptr<PDFUsedFont> textFont, double fontSize, double lineSpace)
+{
+    if (!textWrapper || !textWrapper->matches(textFont.get(), fontSize, lineSpace))
+    {
+        textWrapper.reset(new AdvancedTextWrapper(textFont, fontSize, lineSpace, &textMetrics));
+    }
+    return *textWrapper;
+}
+
+void PDFCreator::setWorkerThreads(size_t threads)
+{
+    workers.reset(threads > 0 ? new ThreadPool(threads) : nullptr);
+    workerMetrics.clear();
+    workerMetrics.resize(threads);
+    for (auto &metrics : workerMetrics)
+    {
+        metrics.setFontMutex(&fontMutex);
+        metrics.setResourcePool(resources.get(), &fontPaths);
+        metrics.setCounting(stats != nullptr);
+    }
+}
+
+void PDFCreator::setStatsEnabled(bool enabled)
+{
+    if (enabled && !stats)
+    {
+        statsData = RenderStats();
+        stats = &statsData;
+    }
+    else if (!enabled)
+    {
+        stats = nullptr;
+    }
+    textMetrics.setCounting(enabled);
+    for (auto &metrics : workerMetrics)
+    {
+        metrics.setCounting(enabled);
+    }
+}
+
+RenderStats PDFCreator::getStats() const
 {
-    font = getFontByPath(fontPath);
-    return;
-}
+    RenderStats snapshot = statsData;
+    if (!stats)
+        return snapshot;
 
-std::shared_ptr<PDFUsedFont> PDFCreator::getFontByPath(const std::string &fontPath)
-{
-    auto it = fontCache.find(fontPath);
-    if (it != fontCache.end())
+    snapshot.pages = pageNumber;
+    snapshot.operators += pageEmitter.operatorCount();
+    for (auto &form : formEmitters)
     {
-        return it->second;
+        snapshot.operators += form.second.operatorCount();
     }
-    PDFUsedFont *rawFont = pdfWriter.GetFontForFile(fontPath);
-    if (!rawFont)
+
+    auto addCounters = [&snapshot](const TextMetricsCounters *counters)
     {
-        throw std::runtime_error("Failed to load font: " + fontPath);
+        if (!counters)
+            return;
+        snapshot.glyphMeasures += counters->measures;
+        snapshot.glyphCacheHits += counters->hits;
+        snapshot.glyphCacheMisses += counters->misses;
+        snapshot.seconds[RenderStats::TEXT_MEASURE] += counters->measureSeconds;
+    };
+    addCounters(textMetrics.counters());
+    for (auto &metrics : workerMetrics)
+    {
+        addCounters(metrics.counters());
     }
+    return snapshot;
+}
 
-    auto sharedFont = std::shared_ptr<PDFUsedFont>(rawFont,
-                                                   [](PDFUsedFont *font) {});
-    fontCache.emplace(fontPath, sharedFont);
-    return sharedFont;
-};
-
-void PDFCreator::addHeader(ObjectIDType FormXObjectId)
+void PDFCreator::layoutTexts(std::vector<TextLayoutJob> &jobs)
 {
-    if (!currentContext)
+    PhaseTimer timer(stats, RenderStats::TEXT_WRAP);
+    if (!workers || jobs.size() < kParallelLayoutThreshold)
+    {
+        for (auto &job : jobs)
+        {
+            *job.result = layoutText(job.text, job.font, job.fontSize, job.maxWidth, job.lineSpace);
+        }
         return;
+    }
+
+    // Each participant wraps with its own metrics cache; the calling thread uses the document's
+    workers->parallelFor(jobs.size(), 64, [this, &jobs](size_t begin, size_t end, size_t participant)
+                         {
+        TraceSpan span(tracer.get(), "layoutTexts", "text");
+        TextMetricsCache &metrics = participant < workerMetrics.size() ? workerMetrics[participant] : textMetrics;
+        std::unique_ptr<AdvancedTextWrapper> wrapper;
+        for (size_t i = begin; i < end; ++i)
+        {
+            auto &job = jobs[i];
+            auto jobFont = job.font ? job.font : font;
+            if (!wrapper || !wrapper->matches(jobFont.get(), job.fontSize, job.lineSpace))
+                wrapper.reset(new AdvancedTextWrapper(jobFont, job.fontSize, job.lineSpace, &metrics));
 
-    currentContext->q();
-    currentContext->cm(1, 0, 0, 1, pageStyle.margin, pageHeight - pageStyle.headerHeight);
-    currentContext->Do(currentPage->GetResourcesDictionary().AddFormXObjectMapping(FormXObjectId));
-    currentContext->Q();
+            AdvancedTextWrapper::WrappingOptions options;
+            options.maxWidth = job.maxWidth > 0 ? job.maxWidth : pageWidth;
+            options.hyphenate = true;
+            *job.result = wrapper->wrapText(job.text, options);
+        } });
 }
 
-void PDFCreator::addFooter(ObjectIDType FormXObjectId)
+TextLayout PDFCreator::layoutText(std::string_view text, std::shared_ptr<PDFUsedFont> textFont, double fontSize,
+                                  double maxWidth, double lineSpace)
 {
-
-    if (!currentContext)
-        return;
-    currentContext->q();
-    currentContext->cm(1, 0, 0, 1, pageStyle.margin, pageStyle.footerHeight);
-    currentContext->Do(currentPage->GetResourcesDictionary().AddFormXObjectMapping(FormXObjectId));
-    currentContext->Q();
+    PhaseTimer timer(stats, RenderStats::TEXT_WRAP);
+    AdvancedTextWrapper::WrappingOptions options;
+    options.maxWidth = maxWidth > 0 ? maxWidth : pageWidth;
+    options.hyphenate = true;
+    return getTextWrapper(textFont ? textFont : font, fontSize, lineSpace).wrapText(text, options);
 }
 
-Dimension PDFCreator::addText(PDFFormXObject *FormXObject, double x, double y, const std::string &text,std::shared_ptr<PDFUsedFont> textFont, double fontSize,
-                              double r, double g, double b, HAlignment hAlignment,VAlignment vAlignment, double maxWidth,double maxheight, double lineSpace, bool isHidden)
+Dimension PDFCreator::drawTextLayout(PDFFormXObject *FormXObject, double x, double y, const TextLayout &layout,
+                                     std::shared_ptr<PDFUsedFont> textFont, double fontSize,
+                                     double r, double g, double b, HAlignment hAlignment, VAlignment vAlignment,
+                                     double maxWidth, double maxheight, bool isHidden)
 {
+    PhaseTimer timer(stats, RenderStats::CONTENT_EMIT);
     Dimension ret;
     ret.x = x;
     ret.y = y;
 
-    if (!currentContext)
+    if (!FormXObject && !currentContext)
         return ret;
 
      std::shared_ptr<PDFUsedFont> fontID;
@@ -798,97 +1529,55 @@ Dimension PDFCreator::addText(PDFFormXObject *FormXObject, double x, double y, c
     if (maxheight > 0)
         maxHeight_ = maxheight;
 
-
-    AdvancedTextWrapper wrapper(fontID, fontSize, lineSpace);
-    AdvancedTextWrapper::WrappingOptions options;
-
-    options.maxWidth = maxWidth_;
-    options.alignment = hAlignment;
-    options.hyphenate = true;
-    auto result = wrapper.wrapText(text, options);
-    auto result1 = wrapper.wrapText("X", options);
     double currentY = y;
     double maxLineWidth = 0;
     switch (vAlignment)
     {
         case VAlignment::CENTER:
-            currentY = y - (maxHeight_ - result.totalHeight) / 2-(result1.totalHeight);
+            currentY = y - (maxHeight_ - layout.totalHeight) / 2-(layout.lineHeight);
             break;
         case VAlignment::TOP:
-            currentY = y -result1.totalHeight;
+            currentY = y -layout.lineHeight;
             break;
         case VAlignment::BOTTOM:
         default:
-            currentY = y-maxHeight_+ result.totalHeight -result1.totalHeight;
+            currentY = y-maxHeight_+ layout.totalHeight -layout.lineHeight;
             break;
     }
-    //std::cout<<" result.totalHeight:"<<result.totalHeight<<" result1.totalHeight:"<<result1.totalHeight<<"         currentY: "<<currentY<<std::endl;
-    if (FormXObject == nullptr)
+    // Consecutive texts share one BT..ET and move with relative Td; colour and font are only
+    // written when they change
+    ContentEmitter &emitter = emitterFor(FormXObject);
+    if (!isHidden)
     {
-        currentContext->BT();
-        currentContext->k(r, g, b, 1);
-        currentContext->Tf(fontID.get(), fontSize);
-        for (size_t i = 0; i < result.lines.size(); ++i)
-        {
-            if (result.lineWidths[i] > maxLineWidth)
-                maxLineWidth = result.lineWidths[i];
-            double xPosition = x;
-            double yPosition = y;
-            switch (hAlignment)
-            {
-                case HAlignment::CENTER:
-                    xPosition = x + (maxWidth_ - result.lineWidths[i]) / 2;
-                    break;
-                case HAlignment::RIGHT:
-                    xPosition = x + (maxWidth_ - result.lineWidths[i]);
-                    break;
-                case HAlignment::LEFT:
-                default:
-                    xPosition = x;
-                    break;
-            }
-            
-            if (!isHidden)
-            {
-                currentContext->Tm(1, 0, 0, 1, xPosition, currentY);
-                currentContext->Tj(result.lines[i]);
-            }
-            currentY -= result.lineHeight + lineSpace;
-        }
-        currentContext->ET();
+        emitter.beginText();
+        emitter.fillCMYK(r, g, b, 1);
+        emitter.font(fontID.get(), fontSize);
     }
-    else
+    for (size_t i = 0; i < layout.lines.size(); ++i)
     {
-        XObjectContentContext *xobjectContentContext = FormXObject->GetContentContext();
-        xobjectContentContext->BT();
-        xobjectContentContext->k(r, g, b, 1);
-        xobjectContentContext->Tf(fontID.get(), fontSize);
-        for (size_t i = 0; i < result.lines.size(); ++i)
+        if (layout.lineWidths[i] > maxLineWidth)
+            maxLineWidth = layout.lineWidths[i];
+        double xPosition = x;
+        switch (hAlignment)
         {
-            if (result.lineWidths[i] > maxLineWidth)
-                maxLineWidth = result.lineWidths[i];
-            double xPosition = x;
-            switch (hAlignment)
-            {
             case HAlignment::CENTER:
-                xPosition = x + (maxWidth_ - result.lineWidths[i]) / 2;
+                xPosition = x + (maxWidth_ - layout.lineWidths[i]) / 2;
                 break;
             case HAlignment::RIGHT:
-                xPosition = x + (maxWidth_ - result.lineWidths[i]);
+                xPosition = x + (maxWidth_ - layout.lineWidths[i]);
                 break;
             case HAlignment::LEFT:
             default:
                 xPosition = x;
                 break;
-            }
-            if (!isHidden)
-            {
-                xobjectContentContext->Tm(1, 0, 0, 1, xPosition, currentY);
-                xobjectContentContext->Tj(result.lines[i]);
-            }
-            currentY -= result.lineHeight + lineSpace;
         }
-        xobjectContentContext->ET();
+
+        if (!isHidden)
+        {
+            emitter.textPosition(xPosition, currentY);
+            emitter.text()->Tj(layout.lines[i]);
+        }
+        currentY -= layout.lineHeight + layout.lineSpace;
     }
     ret.height = y - currentY;
     ret.width = maxLineWidth;
@@ -899,6 +1588,7 @@ Dimension PDFCreator::addText(PDFFormXObject *FormXObject, double x, double y, c
 Dimension PDFCreator::addLine(PDFFormXObject *FormXObject, double startX, double startY, double endX, double endY,
                               double lineWidth, double r, double g, double b)
 {
+    PhaseTimer timer(stats, RenderStats::CONTENT_EMIT);
     Dimension ret;
     double minX = std::min({startX, endX});
     double maxX = std::max({startX, endX});
@@ -910,30 +1600,15 @@ Dimension PDFCreator::addLine(PDFFormXObject *FormXObject, double startX, double
     ret.height = maxY - minY;
     ret.y = minY;
 
-    if (!currentContext)
+    if (!FormXObject && !currentContext)
         return ret;
 
-    if (FormXObject == nullptr)
-    {
-        currentContext->rg(r, g, b);
-        currentContext->w(lineWidth);
-        currentContext->m(startX, startY);
-        currentContext->l(endX, endY);
-        currentContext->S();
-        currentContext->w(1);
-        currentContext->rg(0, 0, 0);
-    }
-    else
-    {
-        XObjectContentContext *xobjectContentContext = FormXObject->GetContentContext();
-        xobjectContentContext->rg(r, g, b);
-        xobjectContentContext->w(lineWidth);
-        xobjectContentContext->m(startX, startY);
-        xobjectContentContext->l(endX, endY);
-        xobjectContentContext->S();
-        xobjectContentContext->w(1);
-        xobjectContentContext->rg(0, 0, 0);
-    }
+    ContentEmitter &emitter = emitterFor(FormXObject);
+    emitter.fillRGB(r, g, b);
+    emitter.lineWidth(lineWidth);
+    emitter.m(startX, startY);
+    emitter.l(endX, endY);
+    emitter.S();
     ret.ok = true;
     return ret;
 }
@@ -954,55 +1629,31 @@ Dimension PDFCreator::addRectangle(PDFFormXObject *FormXObject, double x, double
                                    double strokeR, double strokeG, double strokeB,
                                    double lineWidth)
 {
+    PhaseTimer timer(stats, RenderStats::CONTENT_EMIT);
     Dimension ret;
     ret.x = x;
     ret.y = y;
     ret.width = width;
     ret.height = height;
 
-    if (!currentContext)
+    if (!FormXObject && !currentContext)
         return ret;
 
-    if (FormXObject == nullptr)
-    {
-        currentContext->w(lineWidth);
-
-        // Fill if color specified
-        if (fillR >= 0 && fillG >= 0 && fillB >= 0)
-        {
-            currentContext->rg(fillR, fillG, fillB);
-            currentContext->re(x, y, width, height);
-            currentContext->f();
-        }
+    ContentEmitter &emitter = emitterFor(FormXObject);
+    emitter.lineWidth(lineWidth);
 
-        // Stroke
-        currentContext->rg(strokeR, strokeG, strokeB);
-        currentContext->re(x, y, width, height);
-        currentContext->S();
-
-        currentContext->rg(0, 0, 0);
-        currentContext->w(1); // Reset line width
-    }
-    else
+    // Fill if color specified
+    if (fillR >= 0 && fillG >= 0 && fillB >= 0)
     {
-        XObjectContentContext *xobjectContentContext = FormXObject->GetContentContext();
-        xobjectContentContext->w(lineWidth);
-
-        // Fill if color specified
-        if (fillR >= 0 && fillG >= 0 && fillB >= 0)
-        {
-            xobjectContentContext->rg(fillR, fillG, fillB);
-            xobjectContentContext->re(x, y, width, height);
-            xobjectContentContext->f();
-        }
-
-        // Stroke
-        xobjectContentContext->rg(strokeR, strokeG, strokeB);
-        xobjectContentContext->re(x, y, width, height);
-        xobjectContentContext->S();
-        xobjectContentContext->rg(0, 0, 0);
-        xobjectContentContext->w(1); // Reset line width
+        emitter.fillRGB(fillR, fillG, fillB);
+        emitter.re(x, y, width, height);
+        emitter.f();
     }
+
+    // Stroke
+    emitter.fillRGB(strokeR, strokeG, strokeB);
+    emitter.re(x, y, width, height);
+    emitter.S();
     ret.ok = true;
     return ret;
 }
@@ -1012,96 +1663,51 @@ Dimension PDFCreator::addCircle(PDFFormXObject *FormXObject, double centerX, dou
                                 double strokeR, double strokeG, double strokeB,
                                 double lineWidth)
 {
+    PhaseTimer timer(stats, RenderStats::CONTENT_EMIT);
     Dimension ret;
     ret.x = centerX - radius;
     ret.y = centerY - radius;
     ret.width = radius * 2;
     ret.height = ret.width;
 
-    if (!currentContext)
+    if (!FormXObject && !currentContext)
         return ret;
 
-    XObjectContentContext *xobjectContentContext;
-    if (FormXObject != nullptr)
-        xobjectContentContext = FormXObject->GetContentContext();
-
-    if (FormXObject == nullptr)
+    ContentEmitter &emitter = emitterFor(FormXObject);
+    emitter.lineWidth(lineWidth);
+    if (fillR >= 0 && fillG >= 0 && fillB >= 0)
     {
-        currentContext->w(lineWidth);
-        if (fillR >= 0 && fillG >= 0 && fillB >= 0)
-        {
-            currentContext->rg(fillR, fillG, fillB);
-            drawCircle(FormXObject, currentContext, centerX, centerY, radius);
-            currentContext->f();
-        }
-
-        currentContext->rg(strokeR, strokeG, strokeB);
-        drawCircle(FormXObject, currentContext, centerX, centerY, radius);
-        currentContext->S();
-        currentContext->w(1);
-        currentContext->rg(0, 0, 0);
+        emitter.fillRGB(fillR, fillG, fillB);
+        drawCircle(emitter, centerX, centerY, radius);
+        emitter.f();
     }
-    else
-    {
-        xobjectContentContext->w(lineWidth);
-        if (fillR >= 0 && fillG >= 0 && fillB >= 0)
-        {
-            xobjectContentContext->rg(fillR, fillG, fillB);
-            drawCircle(FormXObject, currentContext, centerX, centerY, radius);
-            xobjectContentContext->f();
-        }
 
-        xobjectContentContext->rg(strokeR, strokeG, strokeB);
-        drawCircle(FormXObject, currentContext, centerX, centerY, radius);
-        xobjectContentContext->S();
-        xobjectContentContext->w(1);
-        xobjectContentContext->rg(0, 0, 0);
-    }
+    emitter.fillRGB(strokeR, strokeG, strokeB);
+    drawCircle(emitter, centerX, centerY, radius);
+    emitter.S();
     ret.ok = true;
     return ret;
 }
 
-void PDFCreator::drawCircle(PDFFormXObject *FormXObject, PageContentContext *context, double centerX, double centerY, double radius)
+void PDFCreator::drawCircle(ContentEmitter &emitter, double centerX, double centerY, double radius)
 {
     const double magic = 0.551784;
     double m = radius * magic;
 
-    if (FormXObject == nullptr)
-    {
-
-        context->m(centerX, centerY + radius);
-        context->c(centerX + m, centerY + radius,
-                   centerX + radius, centerY + m,
-                   centerX + radius, centerY);
-        context->c(centerX + radius, centerY - m,
-                   centerX + m, centerY - radius,
-                   centerX, centerY - radius);
-        context->c(centerX - m, centerY - radius,
-                   centerX - radius, centerY - m,
-                   centerX - radius, centerY);
-        context->c(centerX - radius, centerY + m,
-                   centerX - m, centerY + radius,
-                   centerX, centerY + radius);
-        context->h();
-    }
-    else
-    {
-        XObjectContentContext *xobjectContentContext = FormXObject->GetContentContext();
-        xobjectContentContext->m(centerX, centerY + radius);
-        xobjectContentContext->c(centerX + m, centerY + radius,
-                                 centerX + radius, centerY + m,
-                                 centerX + radius, centerY);
-        xobjectContentContext->c(centerX + radius, centerY - m,
-                                 centerX + m, centerY - radius,
-                                 centerX, centerY - radius);
-        xobjectContentContext->c(centerX - m, centerY - radius,
-                                 centerX - radius, centerY - m,
-                                 centerX - radius, centerY);
-        xobjectContentContext->c(centerX - radius, centerY + m,
-                                 centerX - m, centerY + radius,
-                                 centerX, centerY + radius);
-        xobjectContentContext->h();
-    }
+    emitter.m(centerX, centerY + radius);
+    emitter.c(centerX + m, centerY + radius,
+              centerX + radius, centerY + m,
+              centerX + radius, centerY);
+    emitter.c(centerX + radius, centerY - m,
+              centerX + m, centerY - radius,
+              centerX, centerY - radius);
+    emitter.c(centerX - m, centerY - radius,
+              centerX - radius, centerY - m,
+              centerX - radius, centerY);
+    emitter.c(centerX - radius, centerY + m,
+              centerX - m, centerY + radius,
+              centerX, centerY + radius);
+    emitter.h();
 }
 
 Dimension PDFCreator::addTriangle(PDFFormXObject *FormXObject, double x1, double y1, double x2, double y2, double x3, double y3,
@@ -1109,6 +1715,7 @@ Dimension PDFCreator::addTriangle(PDFFormXObject *FormXObject, double x1, double
                                   double strokeR, double strokeG, double strokeB,
                                   double lineWidth)
 {
+    PhaseTimer timer(stats, RenderStats::CONTENT_EMIT);
     Dimension ret;
     double minX = std::min({x1, x2, x3});
     double maxX = std::max({x1, x2, x3});
@@ -1121,68 +1728,38 @@ Dimension PDFCreator::addTriangle(PDFFormXObject *FormXObject, double x1, double
     ret.height = maxY - minY;
     ret.y = minY;
 
-    if (!currentContext)
+    if (!FormXObject && !currentContext)
         return ret;
 
-    if (FormXObject == nullptr)
-    {
-        currentContext->w(lineWidth);
-
-        // Fill if color specified
-        if (fillR >= 0 && fillG >= 0 && fillB >= 0)
-        {
-            currentContext->rg(fillR, fillG, fillB);
-            currentContext->m(x1, y1);
-            currentContext->l(x2, y2);
-            currentContext->l(x3, y3);
-            currentContext->h();
-            currentContext->f();
-        }
+    ContentEmitter &emitter = emitterFor(FormXObject);
+    emitter.lineWidth(lineWidth);
 
-        // Stroke
-        currentContext->rg(strokeR, strokeG, strokeB);
-        currentContext->m(x1, y1);
-        currentContext->l(x2, y2);
-        currentContext->l(x3, y3);
-        currentContext->h();
-        currentContext->S();
-        currentContext->rg(0, 0, 0);
-        currentContext->w(1);
-    }
-    else
+    // Fill if color specified
+    if (fillR >= 0 && fillG >= 0 && fillB >= 0)
     {
-        XObjectContentContext *xobjectContentContext = FormXObject->GetContentContext();
-        xobjectContentContext->w(lineWidth);
-
-        // Fill if color specified
-        if (fillR >= 0 && fillG >= 0 && fillB >= 0)
-        {
-            xobjectContentContext->rg(fillR, fillG, fillB);
-            xobjectContentContext->m(x1, y1);
-            xobjectContentContext->l(x2, y2);
-            xobjectContentContext->l(x3, y3);
-            xobjectContentContext->h();
-            xobjectContentContext->f();
-        }
-
-        // Stroke
-        xobjectContentContext->rg(strokeR, strokeG, strokeB);
-        xobjectContentContext->m(x1, y1);
-        xobjectContentContext->l(x2, y2);
-        xobjectContentContext->l(x3, y3);
-        xobjectContentContext->h();
-        xobjectContentContext->S();
-        xobjectContentContext->w(1);
-        xobjectContentContext->rg(0, 0, 0);
+        emitter.fillRGB(fillR, fillG, fillB);
+        emitter.m(x1, y1);
+        emitter.l(x2, y2);
+        emitter.l(x3, y3);
+        emitter.h();
+        emitter.f();
     }
+
+    // Stroke
+    emitter.fillRGB(strokeR, strokeG, strokeB);
+    emitter.m(x1, y1);
+    emitter.l(x2, y2);
+    emitter.l(x3, y3);
+    emitter.h();
+    emitter.S();
     ret.ok = true;
     return ret;
 }
 
 Dimension PDFCreator::DrawTableOnPages(PDFFormXObject *FormXObject, std::shared_ptr<PDFTable> table,
-                                       const std::vector<TableRow> &rows,
-                                       const std::vector<CellPosition> &cellPositions,
-                                       double startX, double tableWidth)
+                                       const TableModel &model,
+                                       const CellLayout &cellLayout,
+                                       double startX)
 {
     Dimension ret;
     ret.x = startX;
@@ -1190,7 +1767,7 @@ Dimension PDFCreator::DrawTableOnPages(PDFFormXObject *FormXObject, std::shared_
     int currentRow = 0;
     bool isFirstPage = true;
 
-    while (currentRow < static_cast<int>(rows.size()))
+    while (currentRow < static_cast<int>(model.rowCount()))
     {
         double currentPageY = table->mCurrentY;
         if (!isFirstPage)
@@ -1203,18 +1780,22 @@ Dimension PDFCreator::DrawTableOnPages(PDFFormXObject *FormXObject, std::shared_
 
         if (!isFirstPage)
         {
-            table->DrawTableHeader(FormXObject, currentContext, rows, cellPositions, startX, currentPageY, tableWidth);
-            currentPageY -= table->GetHeaderHeight(rows);
+            table->DrawTableHeader(FormXObject, model, cellLayout, startX, currentPageY);
+            currentPageY -= cellLayout.headerHeight;
         }
 
-        int rowsDrawn = table->DrawRowsOnPage(FormXObject, currentContext, rows, cellPositions,
-                                              startX, currentPageY, tableWidth, currentRow);
+        int rowsDrawn = table->DrawRowsOnPage(FormXObject, model, cellLayout,
+                                              startX, currentPageY, currentRow);
 
         if (rowsDrawn == 0)
         {
             // Couldn't fit any rows, need to handle this case
             break;
         }
+        ret.y = currentPageY;
+        for (int i = currentRow; i < currentRow + rowsDrawn; ++i)
+            ret.y -= cellLayout.rowHeights[i];
+        ret.page = pageNumber;
 
         currentRow += rowsDrawn;
 
@@ -1234,12 +1815,36 @@ Dimension PDFCreator::DrawTableWithPageBreaks(PDFFormXObject *FormXObject, std::
     if (rows.empty())
         return ret;
 
+    TableModel model;
+    size_t cellCount = 0;
+    for (const auto &row : rows)
+    {
+        cellCount += row.cells.size();
+    }
+    model.reserve(rows.size(), cellCount);
+    for (const auto &row : rows)
+    {
+        model.addRow(row);
+    }
+
+    return DrawTableModel(FormXObject, table, model, startX, startY, tableWidth);
+}
+
+Dimension PDFCreator::DrawTableModel(PDFFormXObject *FormXObject, std::shared_ptr<PDFTable> table, const TableModel &model,
+                                     double startX, double startY, double tableWidth)
+{
+    Dimension ret;
+    ret.ok = true;
+    if (model.rowCount() == 0)
+        return ret;
+
     table->mCurrentY = startY;
 
-    auto cellGrid = table->BuildCellGrid(rows);
-    auto cellPositions = table->CalculateCellPositions(cellGrid, tableWidth);
+    auto cellGrid = table->BuildCellGrid(model);
+    auto cellLayout = table->CalculateCellPositions(model, cellGrid, tableWidth);
+    table->IndexHeaderRows(model, cellLayout);
 
-    return DrawTableOnPages(FormXObject, table, rows, cellPositions, startX, tableWidth);
+    return DrawTableOnPages(FormXObject, table, model, cellLayout, startX);
 }
 
 std::shared_ptr<PDFTable> PDFCreator::CreateTable()
@@ -1249,45 +1854,311 @@ std::shared_ptr<PDFTable> PDFCreator::CreateTable()
     return tables.back();
 }
 
-PDFImageXObject *PDFCreator::getImageXObject(const std::string &imagePath)
+std::unique_ptr<TableStream> PDFCreator::BeginTableStream(PDFFormXObject *FormXObject, std::shared_ptr<PDFTable> table,
+                                                      double startX, double startY, double tableWidth)
+{
+    return std::unique_ptr<TableStream>(new TableStream(this, FormXObject, table, startX, startY, tableWidth));
+}
+
+Dimension PDFCreator::DrawTableStreaming(PDFFormXObject *FormXObject, std::shared_ptr<PDFTable> table,
+                                         const std::function<bool(TableRow &)> &nextRow,
+                                         double startX, double startY, double tableWidth)
+{
+    auto stream = BeginTableStream(FormXObject, table, startX, startY, tableWidth);
+    TableRow row;
+    while (nextRow(row))
+    {
+        if (!stream->addRow(row))
+            break;
+        row = TableRow();
+    }
+    return stream->finish();
+}
+
+TableStream::TableStream(PDFCreator *pdf_, PDFFormXObject *formXObject_, std::shared_ptr<PDFTable> table_,
+                         double startX_, double startY_, double tableWidth_)
+    : pdf(pdf_), formXObject(formXObject_), table(table_), startX(startX_), tableWidth(tableWidth_), currentY(startY_)
+{
+    table->mCurrentY = startY_;
+    result.x = startX_;
+    result.y = startY_;
+}
+
+bool TableStream::addRow(const TableRow &row)
+{
+    if (failed)
+        return false;
+
+    int rowIdx = band.rowCount();
+    band.addRow(row);
+    for (const auto &cell : row.cells)
+    {
+        bandSpanEnd = std::max(bandSpanEnd, rowIdx + cell->rowspan - 1);
+    }
+    if (row.isHeader)
+        headerRows.addRow(row);
+
+    // A band can only be laid out once no rowspan reaches past its last row
+    if (band.rowCount() >= kMaxBandRows)
+    {
+        if (bandSpanEnd > rowIdx)
+            cutSpans();
+        flushBand();
+    }
+    else if (bandSpanEnd <= rowIdx && band.rowCount() >= kWindowRows)
+    {
+        flushBand();
+    }
+
+    return !failed;
+}
+
+Dimension TableStream::finish()
+{
+    flushBand();
+    result.y = currentY;
+    result.page = pdf->pageNumber;
+    result.ok = !failed;
+    return result;
+}
+
+// Ends every rowspan at the last row of the band; the rows after it leave the covered cells empty
+void TableStream::cutSpans()
+{
+    int rows = band.rowCount();
+    for (int row = 0; row < rows; ++row)
+    {
+        for (uint32_t cell = band.rowBegin(row); cell < band.rowEnd(row); ++cell)
+        {
+            if (band.rowspan[cell] > rows - row)
+                band.rowspan[cell] = static_cast<uint16_t>(rows - row);
+        }
+    }
+    pdf->log(LogLevel::WARNING, "Table rowspans chain past " + std::to_string(kMaxBandRows) +
+                                    " rows; cut at the end of the band");
+}
+
+void TableStream::flushBand()
+{
+    if (band.rowCount() == 0 || failed)
+        return;
+
+    if (!pdf->currentContext)
+    {
+        failed = true;
+        return;
+    }
+
+    if (colWidths.empty())
+    {
+        auto grid = table->BuildCellGrid(band);
+        colWidths = table->CalculateColumnWidths(band, grid, tableWidth);
+        columns = colWidths.size();
+    }
+    auto grid = table->BuildCellGrid(band, columns);
+    auto layout = table->CalculateCellPositions(band, grid, colWidths);
+
+    int count = band.rowCount();
+    int drawn = 0;
+    while (drawn < count)
+    {
+        if (band.hasPageBreakBefore(drawn) && rowsOnPage)
+        {
+            startNewPage();
+            if (failed)
+                break;
+        }
+
+        int rowsDrawn = table->DrawRowsOnPage(formXObject, band, layout,
+                                              startX, currentY, drawn);
+        for (int i = drawn; i < drawn + rowsDrawn; ++i)
+        {
+            currentY -= layout.rowHeights[i];
+        }
+        drawn += rowsDrawn;
+        if (rowsDrawn > 0)
+            rowsOnPage = true;
+
+        if (drawn < count)
+        {
+            // Nothing fits on an empty page, and form XObjects cannot continue on another page
+            if ((rowsDrawn == 0 && !rowsOnPage) || formXObject != nullptr)
+            {
+                failed = true;
+                break;
+            }
+            startNewPage();
+            if (failed)
+                break;
+        }
+    }
+
+    band.clear();
+    bandSpanEnd = 0;
+}
+
+void TableStream::startNewPage()
+{
+    pdf->createNewPage();
+    if (!pdf->currentContext)
+    {
+        failed = true;
+        return;
+    }
+    currentY = pdf->pageHeight - pdf->pageStyle.margin - pdf->pageStyle.headerHeight - 50;
+    rowsOnPage = false;
+
+    if (headerRows.rowCount() == 0)
+        return;
+
+    if (!headerLaidOut)
+    {
+        auto grid = table->BuildCellGrid(headerRows, columns);
+        headerLayout = table->CalculateCellPositions(headerRows, grid, colWidths);
+        table->IndexHeaderRows(headerRows, headerLayout);
+        headerLaidOut = true;
+    }
+    table->DrawTableHeader(formXObject, headerRows, headerLayout, startX, currentY);
+    currentY -= headerLayout.headerHeight;
+}
+
+// Format from the file signature
+static bool hasSignature(const char *data, std::streamsize count, const char *signature, size_t length)
+{
+    return count >= static_cast<std::streamsize>(length) && std::memcmp(data, signature, length) == 0;
+}
+
+// FNV-1a over the file contents; false when the file cannot be read
+bool PDFCreator::hashImageFile(const std::string &imagePath, uint64_t &hash, ImageFormat &format)
+{
+    std::ifstream file(imagePath, std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    hash = kFnvOffsetBasis;
+    format = ImageFormat::OTHER;
+    char buffer[65536];
+    bool first = true;
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+    {
+        std::streamsize count = file.gcount();
+        if (first)
+        {
+            if (hasSignature(buffer, count, "\xFF\xD8", 2))
+                format = ImageFormat::JPEG;
+            else if (hasSignature(buffer, count, "\x89PNG\r\n\x1A\n", 8))
+                format = ImageFormat::PNG;
+            else if (hasSignature(buffer, count, "II*\0", 4) || hasSignature(buffer, count, "MM\0*", 4))
+                format = ImageFormat::TIFF;
+            first = false;
+        }
+        hash = hashBytes(buffer, count, hash);
+    }
+    return true;
+}
+
+const PDFCreator::CachedImage *PDFCreator::getCachedImage(const std::string &imagePath, int index, bool canEmbed)
 {
-    auto it = imageCache.find(imagePath);
+    auto known = imageHashes.find(imagePath);
+    if (known == imageHashes.end())
+    {
+        uint64_t hash = 0;
+        ImageFormat format = ImageFormat::OTHER;
+        if (!hashImageFile(imagePath, hash, format))
+        {
+            log(LogLevel::ERROR, "Failed to load image: " + imagePath);
+            return nullptr;
+        }
+        known = imageHashes.emplace(imagePath, std::make_pair(hash, format)).first;
+    }
+    // Other formats keep going through DrawImage
+    ImageFormat format = known->second.second;
+    if (format == ImageFormat::OTHER)
+        return nullptr;
+
+    uint64_t hash = known->second.first;
+    auto key = std::make_pair(hash, index);
+    auto it = imageCache.find(key);
     if (it != imageCache.end())
     {
-        return it->second;
+        if (stats)
+            stats->imageCacheHits++;
+        return it->second.id ? &it->second : nullptr;
     }
 
-    // Create new image XObject
-    PDFImageXObject *imageXObject = pdfWriter.CreateImageXObjectFromJPGFile(imagePath.c_str());
+    // A form XObject's stream cannot be interrupted to write the image object
+    if (!canEmbed)
+        return nullptr;
+
+    if (stats)
+        stats->imageCacheMisses++;
 
-    if (imageXObject)
+    if (currentContext)
+    {
+        pageEmitter.finish();
+        pdfWriter.PausePageContentContext(currentContext);
+    }
+    CachedImage image;
+    if (format == ImageFormat::JPEG)
     {
-        imageCache[imagePath] = imageXObject;
-        std::cout << "Loaded image: " << imagePath << std::endl;
+        PDFImageXObject *imageXObject = pdfWriter.CreateImageXObjectFromJPGFile(imagePath);
+        if (imageXObject)
+        {
+            image.id = imageXObject->GetImageObjectID();
+            delete imageXObject;
+        }
     }
     else
     {
-        std::cerr << "Failed to load image: " << imagePath << std::endl;
+        PDFFormXObject *formXObject = nullptr;
+        if (format == ImageFormat::PNG)
+        {
+            formXObject = pdfWriter.CreateFormXObjectFromPNGFile(imagePath);
+        }
+        else
+        {
+            TIFFUsageParameters tiff = TIFFUsageParameters::DefaultTIFFUsageParameters();
+            tiff.PageIndex = index > 0 ? index : 0;
+            formXObject = pdfWriter.CreateFormXObjectFromTIFFFile(imagePath, tiff);
+        }
+        if (formXObject)
+        {
+            image.id = formXObject->GetObjectID();
+            image.isForm = true;
+            delete formXObject;
+        }
+    }
+    if (!image.id)
+    {
+        log(LogLevel::ERROR, "Failed to load image: " + imagePath);
+        imageCache[key] = CachedImage();
+        return nullptr;
     }
+    getImageDimensions(imagePath, image.width, image.height);
+    if (stats)
+        stats->imageXObjects++;
+    if (logger && logger->enabled(LogLevel::DEBUG))
+        log(LogLevel::DEBUG, "Loaded image: " + imagePath);
+    return &(imageCache[key] = image);
+}
 
-    return imageXObject;
+bool PDFCreator::preloadImage(const std::string &imagePath, int index)
+{
+    PhaseTimer timer(stats, RenderStats::IMAGE_EMBED);
+    return getCachedImage(imagePath, index, true) != nullptr;
 }
 
 Dimension PDFCreator::embedImage(PDFFormXObject *FormXObject, const std::string &imagePath, double x, double y, double width, double height, double scale, double angle, int index)
 {
+    PhaseTimer timer(stats, RenderStats::IMAGE_EMBED);
     Dimension ret;
     ret.x = x;
     ret.y = y;
     if (!currentPage || !currentContext)
     {
-        std::cerr << "No active page or context" << std::endl;
+        log(LogLevel::ERROR, "No active page or context");
         return ret;
     }
-    XObjectContentContext *xobjectContentContext;
-    if (FormXObject != nullptr)
-    {
-        xobjectContentContext = FormXObject->GetContentContext();
-    }
     AbstractContentContext::ImageOptions opt;
     if (index > 0)
         opt.imageIndex = index;
@@ -1302,7 +2173,6 @@ Dimension PDFCreator::embedImage(PDFFormXObject *FormXObject, const std::string
         }
         if (angle > 0)
         {
-            double a = angle * (3.14159 / 180);
             opt.matrix[0] = cos(angle) * s;
             opt.matrix[1] = sin(angle) * s;
             opt.matrix[2] = -sin(angle) * s;
@@ -1316,30 +2186,63 @@ Dimension PDFCreator::embedImage(PDFFormXObject *FormXObject, const std::string
         opt.boundingBoxWidth = width;
         opt.fitProportional = true;
     }
-    if (FormXObject == nullptr)
+
+    const CachedImage *image = getCachedImage(imagePath, index, FormXObject == nullptr);
+    ContentEmitter &emitter = emitterFor(FormXObject);
+    if (!image)
     {
-        currentContext->DrawImage(x, y, imagePath, opt);
+        // DrawImage wraps its operators in q/Q, so the tracked state stays valid
+        emitter.context()->DrawImage(x, y, imagePath, opt);
+        ret.ok = true;
+        return ret;
     }
-    else
+
+    // Same placement DrawImage uses, applied to the unit square of the shared image XObject
+    double m[6] = {1, 0, 0, 1, 0, 0};
+    if (opt.transformationMethod == AbstractContentContext::eMatrix)
     {
-        xobjectContentContext->DrawImage(x, y, imagePath, opt);
+        std::copy(opt.matrix, opt.matrix + 6, m);
     }
+    else if (opt.transformationMethod == AbstractContentContext::eFit && image->width > 0 && image->height > 0)
+    {
+        double scaleX = opt.boundingBoxWidth / image->width;
+        double scaleY = opt.boundingBoxHeight / image->height;
+        if (opt.fitProportional)
+            scaleX = scaleY = std::min(scaleX, scaleY);
+        m[0] = scaleX;
+        m[3] = scaleY;
+    }
+
+    ResourcesDictionary &dictionary = FormXObject == nullptr ? currentPage->GetResourcesDictionary()
+                                                             : FormXObject->GetResourcesDictionary();
+    std::string imageName = image->isForm ? dictionary.AddFormXObjectMapping(image->id)
+                                          : dictionary.AddImageXObjectMapping(image->id);
+    // A PNG/TIFF form already spans width x height
+    double unitX = image->isForm ? 1 : image->width;
+    double unitY = image->isForm ? 1 : image->height;
+    emitter.save();
+    emitter.cm(m[0] * unitX, m[1] * unitX, m[2] * unitY, m[3] * unitY, m[4] + x, m[5] + y);
+    emitter.context()->Do(imageName);
+    emitter.restore();
+
     ret.ok = true;
     return ret;
 }
 
 void PDFCreator::getImageDimensions(const std::string &imagePath, double &width, double &height)
 {
+    if (resources && resources->getImageDimensions(imagePath, width, height))
+        return;
+
     DoubleAndDoublePair jpgDimensions = pdfWriter.GetImageDimensions(imagePath);
     width = jpgDimensions.first;
     height = jpgDimensions.second;
+    if (resources)
+        resources->putImageDimensions(imagePath, width, height);
 }
 
 void PDFCreator::clearImageCache()
 {
-    for (auto &pair : imageCache)
-    {
-        delete pair.second;
-    }
     imageCache.clear();
+    imageHashes.clear();
 }
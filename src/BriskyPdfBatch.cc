@@ -0,0 +1,78 @@
+#include "BriskyPdfBatch.h"
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+static size_t batchThreads(size_t threads)
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    return threads > 1 ? threads - 1 : 0;
+}
+
+// The calling thread takes part in parallelFor, so the pool is one thread short of the requested count
+PDFBatch::PDFBatch(size_t threads)
+    : workers(batchThreads(threads)), resources(std::make_shared<ResourcePool>()), logger(Logger::getDefault())
+{
+}
+
+BatchReport PDFBatch::processStrings(const std::vector<std::string> &jsonJobs)
+{
+    return run(jsonJobs.size(), [&jsonJobs](PDFJson &parser, size_t i)
+               { return parser.processFromString(jsonJobs[i]); });
+}
+
+BatchReport PDFBatch::processFiles(const std::vector<std::string> &filenames)
+{
+    return run(filenames.size(), [&filenames](PDFJson &parser, size_t i)
+               { return parser.processFromFile(filenames[i]); });
+}
+
+BatchReport PDFBatch::run(size_t count, const std::function<bool(PDFJson &, size_t)> &job)
+{
+    BatchReport report;
+    report.jobs = count;
+    std::vector<char> results(count, 0);
+
+    auto start = std::chrono::steady_clock::now();
+    workers.parallelFor(count, 1, [this, &job, &results](size_t begin, size_t end, size_t)
+                        {
+        for (size_t i = begin; i < end; ++i)
+        {
+            std::shared_ptr<PDFCreator> pdf;
+            PDFJson parser(pdf);
+            parser.setResourcePool(resources);
+            parser.setTracer(tracer);
+            parser.setLogger(logger);
+            try
+            {
+                results[i] = job(parser, i) ? 1 : 0;
+            }
+            catch (const std::exception &e)
+            {
+                logger->log(LogLevel::ERROR, "Batch job " + std::to_string(i) + " failed: " + e.what());
+            }
+        } });
+    auto end = std::chrono::steady_clock::now();
+
+    report.seconds = std::chrono::duration<double>(end - start).count();
+    report.results.assign(results.begin(), results.end());
+    for (char ok : results)
+    {
+        if (ok)
+            report.succeeded++;
+        else
+            report.failed++;
+    }
+    if (report.seconds > 0)
+        report.jobsPerSecond = count / report.seconds;
+
+    if (logger->enabled(LogLevel::INFO))
+    {
+        char summary[128];
+        std::snprintf(summary, sizeof(summary), "Batch: %zu/%zu documents in %.3fs (%.1f jobs/s)",
+                      report.succeeded, report.jobs, report.seconds, report.jobsPerSecond);
+        logger->log(LogLevel::INFO, summary);
+    }
+    return report;
+}
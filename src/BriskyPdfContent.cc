@@ -0,0 +1,428 @@
+#include "BriskyPdfContent.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+ContentBuffer::ContentBuffer(size_t capacity) : mCapacity(capacity)
+{
+    mData.reserve(capacity);
+}
+
+void ContentBuffer::number(double value)
+{
+    static const double kScale = 10000; // 10^kDecimals
+
+    if (!std::isfinite(value))
+        value = 0;
+    if (std::fabs(value) >= 1e12)
+    {
+        // Far outside any page; keep the digits rather than the speed
+        char text[64];
+        int length = snprintf(text, sizeof(text), "%.0f ", value);
+        mData.append(text, length);
+        return;
+    }
+
+    long long scaled = std::llround(std::fabs(value) * kScale);
+    if (scaled == 0)
+    {
+        mData += "0 ";
+        return;
+    }
+    if (value < 0)
+        mData += '-';
+
+    char digits[24];
+    int length = 0;
+    long long integer = scaled / static_cast<long long>(kScale);
+    int fraction = static_cast<int>(scaled % static_cast<long long>(kScale));
+    do
+    {
+        digits[length++] = static_cast<char>('0' + integer % 10);
+        integer /= 10;
+    } while (integer > 0);
+    while (length > 0)
+        mData += digits[--length];
+
+    if (fraction != 0)
+    {
+        int decimals = kDecimals;
+        while (fraction % 10 == 0)
+        {
+            fraction /= 10;
+            decimals--;
+        }
+        mData += '.';
+        for (int i = decimals - 1; i >= 0; --i)
+        {
+            digits[i] = static_cast<char>('0' + fraction % 10);
+            fraction /= 10;
+        }
+        mData.append(digits, decimals);
+    }
+    mData += ' ';
+}
+
+void ContentBuffer::op(const char *op)
+{
+    mData += op;
+    mData += '\n';
+}
+
+void ContentBuffer::flush(AbstractContentContext *context)
+{
+    if (mData.empty())
+        return;
+    if (context)
+        context->WriteFreeCode(mData);
+    // clear() keeps the allocation for the next batch of operators
+    mData.clear();
+}
+
+bool ContentEmitter::Color::set(ColorSpace newSpace, double a, double b, double c, double d)
+{
+    if (space == newSpace && value[0] == a && value[1] == b && value[2] == c && value[3] == d)
+        return false;
+    space = newSpace;
+    value[0] = a;
+    value[1] = b;
+    value[2] = c;
+    value[3] = d;
+    return true;
+}
+
+void ContentEmitter::bind(AbstractContentContext *context)
+{
+    mBuffer.clear();
+    mOperators = 0;
+    mContext = context;
+    mState = State();
+    mSaved.clear();
+    mInText = false;
+}
+
+AbstractContentContext *ContentEmitter::context()
+{
+    finish();
+    mOperators++;
+    return mContext;
+}
+
+void ContentEmitter::finish()
+{
+    endText();
+    mBuffer.flush(mContext);
+}
+
+void ContentEmitter::save()
+{
+    finish();
+    mOperators++;
+    mContext->q();
+    mSaved.push_back(mState);
+}
+
+void ContentEmitter::restore()
+{
+    finish();
+    mOperators++;
+    mContext->Q();
+    if (mSaved.empty())
+    {
+        mState = State();
+        return;
+    }
+    mState = mSaved.back();
+    mSaved.pop_back();
+}
+
+void ContentEmitter::invalidate()
+{
+    mState = State();
+}
+
+void ContentEmitter::path()
+{
+    endText();
+}
+
+// Checked after every operator, so long m/l/re/Td runs stay within the buffer too
+void ContentEmitter::op(const char *op)
+{
+    mBuffer.op(op);
+    mOperators++;
+    if (mBuffer.size() >= kFlushBytes)
+        mBuffer.flush(mContext);
+}
+
+void ContentEmitter::fillRGB(double r, double g, double b)
+{
+    if (!mState.fill.set(ColorSpace::RGB, r, g, b, 0))
+        return;
+    mBuffer.number(r);
+    mBuffer.number(g);
+    mBuffer.number(b);
+    op("rg");
+}
+
+void ContentEmitter::fillCMYK(double c, double m, double y, double k)
+{
+    if (!mState.fill.set(ColorSpace::CMYK, c, m, y, k))
+        return;
+    mBuffer.number(c);
+    mBuffer.number(m);
+    mBuffer.number(y);
+    mBuffer.number(k);
+    op("k");
+}
+
+void ContentEmitter::strokeRGB(double r, double g, double b)
+{
+    if (!mState.stroke.set(ColorSpace::RGB, r, g, b, 0))
+        return;
+    mBuffer.number(r);
+    mBuffer.number(g);
+    mBuffer.number(b);
+    op("RG");
+}
+
+void ContentEmitter::lineWidth(double width)
+{
+    if (mState.lineWidth == width)
+        return;
+    mState.lineWidth = width;
+    mBuffer.number(width);
+    op("w");
+}
+
+void ContentEmitter::m(double x, double y)
+{
+    path();
+    mBuffer.number(x);
+    mBuffer.number(y);
+    op("m");
+}
+
+void ContentEmitter::l(double x, double y)
+{
+    mBuffer.number(x);
+    mBuffer.number(y);
+    op("l");
+}
+
+void ContentEmitter::c(double x1, double y1, double x2, double y2, double x3, double y3)
+{
+    mBuffer.number(x1);
+    mBuffer.number(y1);
+    mBuffer.number(x2);
+    mBuffer.number(y2);
+    mBuffer.number(x3);
+    mBuffer.number(y3);
+    op("c");
+}
+
+void ContentEmitter::h()
+{
+    op("h");
+}
+
+void ContentEmitter::re(double x, double y, double width, double height)
+{
+    path();
+    mBuffer.number(x);
+    mBuffer.number(y);
+    mBuffer.number(width);
+    mBuffer.number(height);
+    op("re");
+}
+
+void ContentEmitter::f()
+{
+    op("f");
+}
+
+void ContentEmitter::S()
+{
+    op("S");
+}
+
+void ContentEmitter::cm(double a, double b, double c, double d, double e, double f)
+{
+    path();
+    mBuffer.number(a);
+    mBuffer.number(b);
+    mBuffer.number(c);
+    mBuffer.number(d);
+    mBuffer.number(e);
+    mBuffer.number(f);
+    op("cm");
+}
+
+void ContentEmitter::J(int lineCap)
+{
+    mBuffer.number(lineCap);
+    op("J");
+}
+
+void ContentEmitter::beginText()
+{
+    if (mInText)
+        return;
+    op("BT");
+    mInText = true;
+    mLineX = 0;
+    mLineY = 0;
+}
+
+void ContentEmitter::endText()
+{
+    if (!mInText)
+        return;
+    op("ET");
+    mInText = false;
+}
+
+AbstractContentContext *ContentEmitter::text()
+{
+    beginText();
+    mBuffer.flush(mContext);
+    mOperators++;
+    return mContext;
+}
+
+void ContentEmitter::textPosition(double x, double y)
+{
+    if (!mCoalesceText)
+    {
+        endText();
+        beginText();
+        mBuffer.number(1);
+        mBuffer.number(0);
+        mBuffer.number(0);
+        mBuffer.number(1);
+        mBuffer.number(x);
+        mBuffer.number(y);
+        op("Tm");
+        return;
+    }
+    beginText();
+    double dx = std::round((x - mLineX) * 1000) / 1000;
+    double dy = std::round((y - mLineY) * 1000) / 1000;
+    mBuffer.number(dx);
+    mBuffer.number(dy);
+    op("Td");
+    mLineX += dx;
+    mLineY += dy;
+}
+
+void ContentEmitter::font(PDFUsedFont *font, double size)
+{
+    if (mState.font == font && mState.fontSize == size)
+        return;
+    mState.font = font;
+    mState.fontSize = size;
+    mBuffer.flush(mContext);
+    mOperators++;
+    mContext->Tf(font, size);
+}
+
+void PathBatch::addFill(double r, double g, double b, double x, double y, double width, double height)
+{
+    std::vector<double> &rects = fills[Rgb(r, g, b)];
+    rects.push_back(x);
+    rects.push_back(y);
+    rects.push_back(width);
+    rects.push_back(height);
+}
+
+void PathBatch::addSegment(double lineWidth, double r, double g, double b, double x1, double y1, double x2, double y2)
+{
+    Lines &lines = strokes[std::make_tuple(lineWidth, r, g, b)];
+    if (y1 == y2)
+        lines[std::make_pair(true, y1)].push_back(std::make_pair(std::min(x1, x2), std::max(x1, x2)));
+    else if (x1 == x2)
+        lines[std::make_pair(false, x1)].push_back(std::make_pair(std::min(y1, y2), std::max(y1, y2)));
+}
+
+void PathBatch::addFrame(double lineWidth, double r, double g, double b, double x, double y, double width, double height)
+{
+    addSegment(lineWidth, r, g, b, x, y, x + width, y);
+    addSegment(lineWidth, r, g, b, x, y + height, x + width, y + height);
+    addSegment(lineWidth, r, g, b, x, y, x, y + height);
+    addSegment(lineWidth, r, g, b, x + width, y, x + width, y + height);
+}
+
+void PathBatch::clear()
+{
+    fills.clear();
+    strokes.clear();
+}
+
+void PathBatch::flushFills(ContentEmitter &emitter)
+{
+    if (fills.empty())
+        return;
+
+    for (const auto &group : fills)
+    {
+        emitter.fillRGB(std::get<0>(group.first), std::get<1>(group.first), std::get<2>(group.first));
+        const std::vector<double> &rects = group.second;
+        for (size_t i = 0; i + 3 < rects.size(); i += 4)
+        {
+            emitter.re(rects[i], rects[i + 1], rects[i + 2], rects[i + 3]);
+        }
+        emitter.f();
+    }
+    fills.clear();
+}
+
+void PathBatch::flushStrokes(ContentEmitter &emitter)
+{
+    if (strokes.empty())
+        return;
+
+    // Projecting caps close the corners where separately stroked runs meet
+    emitter.save();
+    emitter.J(2);
+    for (auto &group : strokes)
+    {
+        emitter.lineWidth(std::get<0>(group.first));
+        emitter.strokeRGB(std::get<1>(group.first), std::get<2>(group.first), std::get<3>(group.first));
+        for (auto &line : group.second)
+        {
+            bool horizontal = line.first.first;
+            double fixed = line.first.second;
+            auto &spans = line.second;
+            std::sort(spans.begin(), spans.end());
+
+            double start = spans[0].first;
+            double end = spans[0].second;
+            for (size_t i = 1; i <= spans.size(); ++i)
+            {
+                if (i < spans.size() && spans[i].first <= end)
+                {
+                    end = std::max(end, spans[i].second);
+                    continue;
+                }
+                if (horizontal)
+                {
+                    emitter.m(start, fixed);
+                    emitter.l(end, fixed);
+                }
+                else
+                {
+                    emitter.m(fixed, start);
+                    emitter.l(fixed, end);
+                }
+                if (i < spans.size())
+                {
+                    start = spans[i].first;
+                    end = spans[i].second;
+                }
+            }
+        }
+        emitter.S();
+    }
+    emitter.restore();
+    strokes.clear();
+}
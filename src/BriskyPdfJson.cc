@@ -1,14 +1,98 @@
 #include "BriskyPdfJson.h"
 #include <fstream>
 #include <sstream>
+#include <chrono>
+#include <iterator>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-PDFJson::PDFJson(std::shared_ptr<PDFCreator> pdf_):pdf(pdf_) {
+// A job file as one writable, NUL-terminated buffer for in-situ parsing. On POSIX the
+// file is mapped copy-on-write, so only pages the parser writes to are duplicated.
+// A file that ends exactly on a page boundary has no zero fill after it and is read
+// into memory instead, as is every file where mmap is not available.
+class JsonInputBuffer {
+public:
+    JsonInputBuffer() = default;
+    JsonInputBuffer(const JsonInputBuffer&) = delete;
+    JsonInputBuffer& operator=(const JsonInputBuffer&) = delete;
+    ~JsonInputBuffer()
+    {
+#ifndef _WIN32
+        if (mMapped)
+            munmap(mData, mSize);
+#endif
+    }
+
+    bool open(const std::string& filename)
+    {
+#ifndef _WIN32
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        long pageSize = sysconf(_SC_PAGESIZE);
+        if (fstat(fd, &info) == 0 && info.st_size > 0 && pageSize > 0 && info.st_size % pageSize != 0)
+        {
+            void* data = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                mData = static_cast<char*>(data);
+                mSize = info.st_size;
+                mMapped = true;
+                ::close(fd);
+                return true;
+            }
+        }
+        ::close(fd);
+#endif
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open())
+            return false;
+        mCopy.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        mCopy.push_back('\0');
+        mData = mCopy.data();
+        mSize = mCopy.size() - 1;
+        return true;
+    }
+
+    char* data() { return mData; }
+    size_t size() const { return mSize; }
+
+private:
+    char* mData = nullptr;
+    size_t mSize = 0;
+    bool mMapped = false;
+    std::vector<char> mCopy;
+};
+
+PDFJson::PDFJson(std::shared_ptr<PDFCreator> pdf_):pdf(pdf_), logger(Logger::getDefault()) {
     clear();
 }
 
 void PDFJson::clear() {
     config = DocumentConfig();
     processSuccess = false;
+    parseSeconds = 0;
+    headerForms = HeaderFooterForms();
+    footerForms = HeaderFooterForms();
+    countedParts.clear();
+}
+
+void PDFJson::log(LogLevel level, const std::string& message, int object, int page) const {
+    if (!logger || !logger->enabled(level))
+        return;
+    if (page == 0 && pdf)
+        page = pdf->pageNumber;
+    logger->log(level, message, config.file_name, page, object);
 }
 
 bool PDFJson::hasMember(const Value& obj, const char* name) const {
@@ -41,109 +125,163 @@ Color PDFJson::processColor(const Value& colorObj) const {
     return color;
 }
 
+int PDFJson::internFont(std::vector<std::string>& fonts, const std::string& fontPath) {
+    if (fontPath.empty())
+        return -1;
+    auto it = std::find(fonts.begin(), fonts.end(), fontPath);
+    if (it != fonts.end())
+        return it - fonts.begin();
+    fonts.push_back(fontPath);
+    return fonts.size() - 1;
+}
+std::vector<std::shared_ptr<PDFUsedFont>> PDFJson::resolveFonts(const std::vector<std::string>& fonts) const {
+    std::vector<std::shared_ptr<PDFUsedFont>> resolved;
+    resolved.reserve(fonts.size());
+    for (const auto& fontPath : fonts) {
+        resolved.push_back(pdf->getFontByPath(fontPath));
+    }
+    return resolved;
+}
+static HAlignment decodeHAlignment(const std::string& h_alignment, HAlignment defaultValue) {
+    if (h_alignment == "left")
+        return HAlignment::LEFT;
+    else if (h_alignment == "right")
+        return HAlignment::RIGHT;
+    else if (h_alignment == "center")
+        return HAlignment::CENTER;
+    return defaultValue;
+}
+static VAlignment decodeVAlignment(const std::string& v_alignment, VAlignment defaultValue) {
+    if (v_alignment == "top")
+        return VAlignment::TOP;
+    else if (v_alignment == "bottom")
+        return VAlignment::BOTTOM;
+    else if (v_alignment == "center")
+        return VAlignment::CENTER;
+    return defaultValue;
+}
+// "1.3" .. "1.7" and "2.0"; anything else keeps the 1.3 default
+static EPDFVersion decodePdfVersion(const std::string& version) {
+    if (version == "1.4")
+        return ePDFVersion14;
+    else if (version == "1.5")
+        return ePDFVersion15;
+    else if (version == "1.6")
+        return ePDFVersion16;
+    else if (version == "1.7")
+        return ePDFVersion17;
+    else if (version == "2.0")
+        return ePDFVersion20;
+    return ePDFVersion13;
+}
+CompiledText PDFJson::compileText(const Value& textObj, std::vector<std::string>& fonts) const {
+    CompiledText text;
+    text.content = TemplateString(getString(textObj, "content"));
+    text.font = internFont(fonts, getString(textObj, "font_path"));
+    text.x = getDouble(textObj, "x");
+    text.y = getDouble(textObj, "y");
+    text.fontSize = getDouble(textObj, "font_size", 10);
+    text.vAlignment = decodeVAlignment(getString(textObj, "v_alignment","top"), VAlignment::TOP);
+    text.hAlignment = decodeHAlignment(getString(textObj, "h_alignment","left"), HAlignment::LEFT);
+    text.maxHeight = getDouble(textObj, "max_height");
+    text.maxWidth = getDouble(textObj, "max_width");
+    text.lineSpace = getDouble(textObj, "line_space",10);
+
+    if (hasMember(textObj, "color")) {
+        text.color = processColor(textObj["color"]);
+    }
+    return text;
+}
+void PDFJson::emitText(PDFFormXObject *xObject, const CompiledText& text, const std::vector<std::shared_ptr<PDFUsedFont>>& fonts,
+                       const TemplateValues& values, int pageNumber, const TemplateValues* record,
+                       double dx, double dy) const {
+    if (!text.content.usesDocumentValues()) {
+        drawText(xObject, text, fonts, values, pageNumber, record, dx, dy);
+        return;
+    }
+
+    // Placed now, drawn after the last page; everything the text needs is copied
+    auto deferredText = std::make_shared<CompiledText>(text);
+    TemplateValues fields = record ? *record : TemplateValues();
+    auto formId = pdf->addDeferredForm([this, deferredText, fonts, values, fields, pageNumber, dx, dy](PDFFormXObject *form) {
+        TemplateValues all = fields;
+        for (const auto& value : pdf->getDocumentValues()) {
+            all[value.first] = value.second;
+        }
+        drawText(form, *deferredText, fonts, values, pageNumber, &all, dx, dy);
+    });
+    pdf->placeForm(xObject, formId);
+}
+void PDFJson::drawText(PDFFormXObject *xObject, const CompiledText& text, const std::vector<std::shared_ptr<PDFUsedFont>>& fonts,
+                       const TemplateValues& values, int pageNumber, const TemplateValues* record,
+                       double dx, double dy) const {
+    auto content = text.content.render(values, pageNumber, record);
+    auto font = text.font >= 0 ? fonts[text.font] : pdf->getFont();
+    if(!content.empty())
+    {
+        pdf->addText(xObject,text.x + dx,text.y + dy,content,font,text.fontSize,text.color.r,text.color.g,text.color.b,
+                     text.hAlignment,text.vAlignment,text.maxWidth,text.maxHeight,text.lineSpace,false);
+    }
+}
 bool PDFJson::processTextObject(PDFFormXObject *xObject,const Value& textObj,int pageNumber) const {
     if (textObj.IsObject()) {
-        auto content = getString(textObj, "content");
-        auto font_path = getString(textObj, "font_path");
-        auto x = getDouble(textObj, "x");
-        auto y = getDouble(textObj, "y");
-        auto font_size = getDouble(textObj, "font_size", 10);
-        auto v_alignment = getString(textObj, "v_alignment","top");
-        auto h_alignment = getString(textObj, "h_alignment","left");
-        auto max_height = getDouble(textObj, "max_height");
-        auto max_width = getDouble(textObj, "max_width");
-        auto line_space = getDouble(textObj, "line_space",10);
-        Color color;
-
-        if (hasMember(textObj, "color")) {
-            color = processColor(textObj["color"]);
-        }
-        HAlignment hAlignment;
-        VAlignment vAlignment;
-        content = replaceStr(content ,"${PAGE_NUMBER}",std::to_string(pageNumber));
-
-        if (h_alignment == "left")
-            hAlignment = HAlignment::LEFT;
-        else if (h_alignment == "right")
-            hAlignment = HAlignment::RIGHT;
-        else if (h_alignment == "center")
-            hAlignment = HAlignment::CENTER;
-
-        if (v_alignment == "top")
-            vAlignment= VAlignment::TOP;
-        else if (v_alignment == "bottom")
-            vAlignment = VAlignment::BOTTOM;
-        else if (v_alignment == "center")
-            vAlignment = VAlignment::CENTER;
-
-        auto font = pdf->getFont();
-        if(font_path.length()>0)  font = pdf->getFontByPath(font_path);
-        if(!content.empty())
-        {
-            pdf->addText(xObject,x,y,content,font,font_size,color.r,color.g,color.b,hAlignment,vAlignment,max_width,max_height,line_space,false);
-        }
+        std::vector<std::string> fonts;
+        auto text = compileText(textObj, fonts);
+        emitText(xObject, text, resolveFonts(fonts), TemplateValues(), pageNumber);
     }
     return true;
 }
 
+void PDFJson::readCell(const Value& cellObj, TableCell& td, std::string& fontPath) const {
+    td.content = getString(cellObj, "content");
+    td.colspan = getInt(cellObj, "colspan", 1);
+    td.rowspan = getInt(cellObj, "rowspan", 1);
+    auto h_alignment = getString(cellObj, "h_alignment", "left");
+    auto v_alignment = getString(cellObj, "v_alignment", "center");
+    fontPath = getString(cellObj, "font_path");
+    td.width = getDouble(cellObj, "width");
+    td.fontSize = getDouble(cellObj, "font_size", 10);
+    td.isHeader = getBool(cellObj, "is_header");
+    td.borderWidth = getDouble(cellObj, "border_width", 0.5);
+    td.topBorderWidth = getDouble(cellObj, "top_border_width", -1);
+    td.leftBorderWidth = getDouble(cellObj, "left_border_width", -1);
+    td.rightBorderWidth = getDouble(cellObj, "right_border_width", -1);
+    td.bottomBorderWidth = getDouble(cellObj, "bottom_border_width", -1);
+    if (hasMember(cellObj, "background_color")) {
+          auto color = processColor(cellObj["background_color"]);
+          td.backgroundColor.r=color.r;
+          td.backgroundColor.g=color.g;
+          td.backgroundColor.b=color.b;
+          //std::cout<<"td.backgroundColor:"<< td.backgroundColor.r<<","<< td.backgroundColor.g<<","<< td.backgroundColor.b<<std::endl;
+    }
+    else
+    {
+         td.backgroundColor.r=1;
+          td.backgroundColor.g=1;
+          td.backgroundColor.b=1;
+    }
+    if (hasMember(cellObj, "text_color")) {
+          auto color = processColor(cellObj["text_color"]);
+          td.textColor.r=color.r;
+          td.textColor.g=color.g;
+          td.textColor.b=color.b;
+    }
+    else
+    {
+        td.textColor.r=0;
+        td.textColor.g=0;
+        td.textColor.b=0;
+    }
+
+
+    td.hAlignment = decodeHAlignment(h_alignment, td.hAlignment);
+    td.vAlignment = decodeVAlignment(v_alignment, td.vAlignment);
+}
 std::shared_ptr<TableCell> PDFJson::processCell(PDFFormXObject *xObject,const Value& cellObj) const {
     std::shared_ptr<TableCell> td = std::make_shared<TableCell>();
     if (cellObj.IsObject()) {
-        td->content = getString(cellObj, "content");
-        td->colspan = getInt(cellObj, "colspan", 1);
-        td->rowspan = getInt(cellObj, "rowspan", 1);
-        auto h_alignment = getString(cellObj, "h_alignment", "left");
-        auto v_alignment = getString(cellObj, "v_alignment", "center");
-        auto fontPath = getString(cellObj, "font_path");
-        td->width = getDouble(cellObj, "width");
-        td->fontSize = getDouble(cellObj, "font_size", 10);
-        td->isHeader = getBool(cellObj, "is_header");
-        td->borderWidth = getDouble(cellObj, "border_width", 0.5);
-        td->topBorderWidth = getDouble(cellObj, "top_border_width", -1);
-        td->leftBorderWidth = getDouble(cellObj, "left_border_width", -1);
-        td->rightBorderWidth = getDouble(cellObj, "right_border_width", -1);
-        td->bottomBorderWidth = getDouble(cellObj, "bottom_border_width", -1);
-        if (hasMember(cellObj, "background_color")) {
-              auto color = processColor(cellObj["background_color"]);
-              td->backgroundColor.r=color.r;
-              td->backgroundColor.g=color.g;
-              td->backgroundColor.b=color.b;
-              //std::cout<<"td->backgroundColor:"<< td->backgroundColor.r<<","<< td->backgroundColor.g<<","<< td->backgroundColor.b<<std::endl;
-        }
-        else
-        {
-             td->backgroundColor.r=1;
-              td->backgroundColor.g=1;
-              td->backgroundColor.b=1;
-        }
-        if (hasMember(cellObj, "text_color")) {
-              auto color = processColor(cellObj["text_color"]);
-              td->textColor.r=color.r;
-              td->textColor.g=color.g;
-              td->textColor.b=color.b;
-        }
-        else
-        {
-            td->textColor.r=0;
-            td->textColor.g=0;
-            td->textColor.b=0;
-        }
-
-
-        if (h_alignment == "left")
-            td->hAlignment = HAlignment::LEFT;
-        else if (h_alignment == "right")
-            td->hAlignment = HAlignment::RIGHT;
-        else if (h_alignment == "center")
-            td->hAlignment = HAlignment::CENTER;
-
-        if (v_alignment == "top")
-            td->vAlignment= VAlignment::TOP;
-        else if (v_alignment == "bottom")
-            td->vAlignment = VAlignment::BOTTOM;
-        else if (v_alignment == "center")
-            td->vAlignment = VAlignment::CENTER;
-
+        std::string fontPath;
+        readCell(cellObj, *td, fontPath);
         td->font = pdf->getFont();
         if(fontPath.length()>0)  td->font = pdf->getFontByPath(fontPath);
     }
@@ -167,88 +305,265 @@ std::shared_ptr<TableRow> PDFJson::processRow(PDFFormXObject *xObject,const Valu
     return tr;
 }
 
-bool PDFJson::processTable(PDFFormXObject *xObject,const Value& tableObj) const {
-    if (tableObj.IsObject()) {
-        auto tableDrawer = pdf->CreateTable();
-        TableStyle style;
-
-        style.borderWidth = getDouble(tableObj, "border_width", 0.5);
-        style.cellPadding = getDouble(tableObj, "cell_padding", 2.0);
-        style.fontSize = getDouble(tableObj, "font_size", config.font_size);
-        auto fontPath = getString(tableObj, "font_path");
-        auto tableWidth = getDouble(tableObj, "table_width", 500);
-        auto startX = getDouble(tableObj, "start_x", 50);
-        auto startY = getDouble(tableObj, "start_y", 650);
-
-        if (hasMember(tableObj, "header_background")) {
-              auto color = processColor(tableObj["header_background"]);
-              style.headerBackground.r=color.r;
-              style.headerBackground.g=color.g;
-              style.headerBackground.b=color.b;
-        }
-        else
-        {
-            style.headerBackground.r=0.9;
-            style.headerBackground.g=0.9;
-            style.headerBackground.b=0.9;
-        }
-        
-        if (hasMember(tableObj, "even_row_background")) {
-            auto color = processColor(tableObj["even_row_background"]);
-            style.evenRowBackground.r=color.r;
-            style.evenRowBackground.g=color.g;
-            style.evenRowBackground.b=color.b;
-        }
-        else
-        {
-            style.evenRowBackground.r=0.97;
-            style.evenRowBackground.g=0.97;
-            style.evenRowBackground.b=0.97;
-        }
+TableStyle PDFJson::readTableStyle(const Value& tableObj, double defaultFontSize, std::string& fontPath,
+                                   double& startX, double& startY, double& tableWidth) const {
+    TableStyle style;
 
-        if (hasMember(tableObj, "odd_row_background")) {
-            auto color = processColor(tableObj["odd_row_background"]);
-            style.oddRowBackground.r=color.r;
-            style.oddRowBackground.g=color.g;
-            style.oddRowBackground.b=color.b;
-        }
-        else
-        {
-            style.oddRowBackground.r=1.0;
-            style.oddRowBackground.g=1.0;
-            style.oddRowBackground.b=1.0;
-        }
+    style.borderWidth = getDouble(tableObj, "border_width", 0.5);
+    style.cellPadding = getDouble(tableObj, "cell_padding", 2.0);
+    style.fontSize = getDouble(tableObj, "font_size", defaultFontSize);
+    fontPath = getString(tableObj, "font_path");
+    tableWidth = getDouble(tableObj, "table_width", 500);
+    startX = getDouble(tableObj, "start_x", 50);
+    startY = getDouble(tableObj, "start_y", 650);
+
+    if (hasMember(tableObj, "header_background")) {
+          auto color = processColor(tableObj["header_background"]);
+          style.headerBackground.r=color.r;
+          style.headerBackground.g=color.g;
+          style.headerBackground.b=color.b;
+    }
+    else
+    {
+        style.headerBackground.r=0.9;
+        style.headerBackground.g=0.9;
+        style.headerBackground.b=0.9;
+    }
+    
+    if (hasMember(tableObj, "even_row_background")) {
+        auto color = processColor(tableObj["even_row_background"]);
+        style.evenRowBackground.r=color.r;
+        style.evenRowBackground.g=color.g;
+        style.evenRowBackground.b=color.b;
+    }
+    else
+    {
+        style.evenRowBackground.r=0.97;
+        style.evenRowBackground.g=0.97;
+        style.evenRowBackground.b=0.97;
+    }
+
+    if (hasMember(tableObj, "odd_row_background")) {
+        auto color = processColor(tableObj["odd_row_background"]);
+        style.oddRowBackground.r=color.r;
+        style.oddRowBackground.g=color.g;
+        style.oddRowBackground.b=color.b;
+    }
+    else
+    {
+        style.oddRowBackground.r=1.0;
+        style.oddRowBackground.g=1.0;
+        style.oddRowBackground.b=1.0;
+    }
+
+    if (hasMember(tableObj, "border_color")) {
+        auto color = processColor(tableObj["border_color"]);
+        style.borderColor.r=color.r;
+        style.borderColor.g=color.g;
+        style.borderColor.b=color.b;
+    }
+    else
+    {
+        style.borderColor.r=0.5;
+        style.borderColor.g=0.5;
+        style.borderColor.b=0.5;
+    }
+
+    if (hasMember(tableObj, "text_color")) {
+        auto color = processColor(tableObj["text_color"]);
+        style.textColor.r=color.r;
+        style.textColor.g=color.g;
+        style.textColor.b=color.b;
+    }
+    else
+    {
+        style.textColor.r=0;
+        style.textColor.g=0;
+        style.textColor.b=0;
+    }
+    
+    return style;
+}
+std::shared_ptr<PDFTable> PDFJson::processTableStyle(const Value& tableObj, double& startX, double& startY, double& tableWidth) const {
+    auto tableDrawer = pdf->CreateTable();
+    std::string fontPath;
+    TableStyle style = readTableStyle(tableObj, config.font_size, fontPath, startX, startY, tableWidth);
+
+    style.font = pdf->getFont();
+    if(fontPath.length()>0)  style.font = pdf->getFontByPath(fontPath);
+
+    tableDrawer->SetStyle(style);
+    return tableDrawer;
+}
+CompiledTable PDFJson::compileTable(const Value& tableObj, double defaultFontSize, std::vector<std::string>& fonts) const {
+    CompiledTable table;
+    std::string fontPath;
+    table.style = readTableStyle(tableObj, defaultFontSize, fontPath, table.startX, table.startY, table.tableWidth);
+    table.font = internFont(fonts, fontPath);
+
+    // Styles are interned per font; the font itself is only known once a document exists
+    std::map<int, std::unordered_map<CellStyle, uint32_t, CellStyleHash>> styleIndex;
+    if (hasMember(tableObj, "rows") && tableObj["rows"].IsArray()) {
+        const Value& rowsArray = tableObj["rows"];
+        table.rows.reserve(rowsArray.Size());
+        for (SizeType i = 0; i < rowsArray.Size(); i++) {
+            const Value& rowObj = rowsArray[i];
+            CompiledRow row;
+            if (rowObj.IsObject()) {
+                row.height = getDouble(rowObj, "height", 20);
+                row.isHeader = getBool(rowObj, "is_header");
+                row.pageBreakBefore = getBool(rowObj, "page_break_before");
+                row.repeat = compileRepeat(rowObj);
+                row.condition = compileCondition(rowObj);
+                if (row.repeat.isSet() || row.condition.isSet())
+                    table.hasDirectives = true;
+                if (hasMember(rowObj, "cells") && rowObj["cells"].IsArray()) {
+                    const Value& cellsArray = rowObj["cells"];
+                    for (SizeType j = 0; j < cellsArray.Size(); j++) {
+                        TableCell td;
+                        std::string cellFontPath;
+                        if (cellsArray[j].IsObject())
+                            readCell(cellsArray[j], td, cellFontPath);
+
+                        CellStyle style;
+                        style.hAlignment = td.hAlignment;
+                        style.vAlignment = td.vAlignment;
+                        style.backgroundColor = td.backgroundColor;
+                        style.textColor = td.textColor;
+                        style.fontSize = td.fontSize;
+                        style.borderWidth = td.borderWidth;
+                        style.topBorderWidth = td.topBorderWidth;
+                        style.leftBorderWidth = td.leftBorderWidth;
+                        style.rightBorderWidth = td.rightBorderWidth;
+                        style.bottomBorderWidth = td.bottomBorderWidth;
+                        style.isHeader = td.isHeader;
+
+                        int font = internFont(fonts, cellFontPath);
+                        auto& index = styleIndex[font];
+                        auto it = index.find(style);
+                        if (it == index.end()) {
+                            it = index.emplace(style, table.cellStyles.size()).first;
+                            table.cellStyles.push_back(style);
+                            table.cellFonts.push_back(font);
+                        }
 
-        if (hasMember(tableObj, "border_color")) {
-            auto color = processColor(tableObj["border_color"]);
-            style.borderColor.r=color.r;
-            style.borderColor.g=color.g;
-            style.borderColor.b=color.b;
+                        CompiledCell cell;
+                        cell.content = TemplateString(td.content);
+                        cell.style = it->second;
+                        cell.colspan = td.colspan;
+                        cell.rowspan = td.rowspan;
+                        cell.width = td.width;
+                        row.cells.push_back(std::move(cell));
+                    }
+                }
+            }
+            table.rows.push_back(std::move(row));
         }
-        else
-        {
-            style.borderColor.r=0.5;
-            style.borderColor.g=0.5;
-            style.borderColor.b=0.5;
+    }
+    return table;
+}
+void PDFJson::emitTable(PDFFormXObject *xObject, const CompiledTable& table, const std::vector<std::shared_ptr<PDFUsedFont>>& fonts,
+                        const TemplateValues& values, int pageNumber, const TemplateValues* record,
+                        double dx, double dy) const {
+    if (table.rows.empty())
+        return;
+
+    auto tableDrawer = pdf->CreateTable();
+    TableStyle style = table.style;
+    style.font = table.font >= 0 ? fonts[table.font] : pdf->getFont();
+    tableDrawer->SetStyle(style);
+
+    if (table.hasDirectives) {
+        streamTable(xObject, table, tableDrawer, fonts, values, pageNumber, record, table.startX + dx, table.startY + dy);
+        return;
+    }
+
+    TableModel model;
+    size_t cellCount = 0;
+    for (const auto& row : table.rows) {
+        cellCount += row.cells.size();
+    }
+    model.reserve(table.rows.size(), cellCount);
+
+    std::vector<uint32_t> styles(table.cellStyles.size());
+    for (size_t i = 0; i < styles.size(); i++) {
+        CellStyle cellStyle = table.cellStyles[i];
+        cellStyle.font = table.cellFonts[i] >= 0 ? fonts[table.cellFonts[i]] : pdf->getFont();
+        styles[i] = model.addStyle(cellStyle);
+    }
+
+    for (const auto& row : table.rows) {
+        model.beginRow(row.height, row.isHeader, row.pageBreakBefore);
+        for (const auto& cell : row.cells) {
+            model.addCell(cell.content.render(values, pageNumber, record), styles[cell.style], cell.colspan, cell.rowspan, cell.width);
         }
+    }
+    pdf->DrawTableModel(xObject, tableDrawer, model, table.startX + dx, table.startY + dy, table.tableWidth);
+}
+void PDFJson::streamTable(PDFFormXObject *xObject, const CompiledTable& table, std::shared_ptr<PDFTable> tableDrawer,
+                          const std::vector<std::shared_ptr<PDFUsedFont>>& fonts, const TemplateValues& values,
+                          int pageNumber, const TemplateValues* record, double startX, double startY) const {
+    auto stream = pdf->BeginTableStream(xObject, tableDrawer, startX, startY, table.tableWidth);
 
-        if (hasMember(tableObj, "text_color")) {
-            auto color = processColor(tableObj["text_color"]);
-            style.textColor.r=color.r;
-            style.textColor.g=color.g;
-            style.textColor.b=color.b;
+    // Each compiled row owns one TableRow whose cell contents are rewritten per record
+    TableRow tableRow;
+    TemplateValues rowRecord;
+    auto fill = [&](const CompiledRow& row, const TemplateValues* fields) {
+        tableRow.height = row.height;
+        tableRow.isHeader = row.isHeader;
+        tableRow.pageBreakBefore = row.pageBreakBefore;
+        tableRow.cells.resize(row.cells.size());
+        for (size_t i = 0; i < row.cells.size(); i++) {
+            const CompiledCell& cell = row.cells[i];
+            const CellStyle& style = table.cellStyles[cell.style];
+            if (!tableRow.cells[i])
+                tableRow.cells[i] = std::make_shared<TableCell>();
+            TableCell& td = *tableRow.cells[i];
+            td.content = cell.content.render(values, pageNumber, fields);
+            td.colspan = cell.colspan;
+            td.rowspan = cell.rowspan;
+            td.width = cell.width;
+            td.hAlignment = style.hAlignment;
+            td.vAlignment = style.vAlignment;
+            td.backgroundColor = style.backgroundColor;
+            td.textColor = style.textColor;
+            td.fontSize = style.fontSize;
+            td.borderWidth = style.borderWidth;
+            td.topBorderWidth = style.topBorderWidth;
+            td.leftBorderWidth = style.leftBorderWidth;
+            td.rightBorderWidth = style.rightBorderWidth;
+            td.bottomBorderWidth = style.bottomBorderWidth;
+            td.isHeader = style.isHeader;
+            td.font = table.cellFonts[cell.style] >= 0 ? fonts[table.cellFonts[cell.style]] : pdf->getFont();
         }
-        else
-        {
-            style.textColor.r=0;
-            style.textColor.g=0;
-            style.textColor.b=0;
+        return stream->addRow(tableRow);
+    };
+
+    // The condition of a repeated row is tested against each of its records
+    for (const auto& row : table.rows) {
+        if (!row.repeat.isSet()) {
+            if (!row.condition.isSet() || row.condition.test(values, record))
+                fill(row, record);
+            continue;
         }
-        
-        style.font = pdf->getFont();
-        if(fontPath.length()>0)  style.font = pdf->getFontByPath(fontPath);
 
-        tableDrawer->SetStyle(style);
+        auto source = openDataSource(row.repeat);
+        if (!source)
+            continue;
+        while (source->next(rowRecord)) {
+            if (row.condition.isSet() && !row.condition.test(values, &rowRecord))
+                continue;
+            if (!fill(row, &rowRecord))
+                break;
+            countRecord(row.repeat, rowRecord);
+        }
+    }
+    stream->finish();
+}
+bool PDFJson::processTable(PDFFormXObject *xObject,const Value& tableObj) const {
+    if (tableObj.IsObject()) {
+        double startX, startY, tableWidth;
+        auto tableDrawer = processTableStyle(tableObj, startX, startY, tableWidth);
 
         std::vector<TableRow> rows;
         if (hasMember(tableObj, "rows") && tableObj["rows"].IsArray()) {
@@ -264,124 +579,144 @@ bool PDFJson::processTable(PDFFormXObject *xObject,const Value& tableObj) const
     return true;
 }
 
+CompiledPhoto PDFJson::compilePhoto(const Value& photoObj) const {
+    CompiledPhoto photo;
+    photo.path = getString(photoObj, "path");
+    photo.x = getDouble(photoObj, "x");
+    photo.y = getDouble(photoObj, "y");
+    photo.width = getDouble(photoObj, "width");
+    photo.height = getDouble(photoObj, "height");
+    photo.scale = getDouble(photoObj, "scale");
+    photo.angle = getDouble(photoObj, "angle");
+    photo.index = getInt(photoObj, "index");
+    return photo;
+}
+void PDFJson::emitPhoto(PDFFormXObject *xObject, const CompiledPhoto& photo, double dx, double dy) const {
+    pdf->embedImage(xObject, photo.path, photo.x + dx, photo.y + dy, photo.width, photo.height, photo.scale, photo.angle, photo.index);
+}
 bool PDFJson::processPhoto(PDFFormXObject *xObject,const Value& photoObj) const {
-    //Photo photo;
     if (photoObj.IsObject()) {
-        auto path = getString(photoObj, "path");
-        auto x = getDouble(photoObj, "x");
-        auto y = getDouble(photoObj, "y");
-        auto width = getDouble(photoObj, "width");
-        auto height = getDouble(photoObj, "height");
-        auto scale = getDouble(photoObj, "scale");
-        auto angle = getDouble(photoObj, "angle");
-        auto index = getInt(photoObj, "index");
-        pdf->embedImage(xObject,path, x, y, width, height, scale, angle, index);
+        emitPhoto(xObject, compilePhoto(photoObj));
         return true;
     }
     
     return false;
 }
 
-bool PDFJson::processShape(PDFFormXObject *xObject,const Value& shapeObj) const {
-    if (shapeObj.IsObject()) {
-        auto type = getString(shapeObj, "type");
-        auto x = getDouble(shapeObj, "x");
-        auto y = getDouble(shapeObj, "y");
-        auto x2 = getDouble(shapeObj, "x2");
-        auto y2 = getDouble(shapeObj, "y2");
-        auto x3 = getDouble(shapeObj, "x3");
-        auto y3 = getDouble(shapeObj, "y3");
-        auto width = getDouble(shapeObj, "width");
-        auto height = getDouble(shapeObj, "height");
-        auto radius = getDouble(shapeObj, "radius");
-        auto line_width = getDouble(shapeObj, "line_width", 0.5);
-        Color stroke_color;
-        Color fill_color;
-        
-        if (hasMember(shapeObj, "stroke_color")) {
-            stroke_color = processColor(shapeObj["stroke_color"]);
-        }
-        else
-        {
-            stroke_color.r=0;
-            stroke_color.g=0;
-            stroke_color.b=0;
+bool PDFJson::compileShape(const Value& shapeObj, CompiledShape& shape) const {
+    auto type = getString(shapeObj, "type");
+    shape.x = getDouble(shapeObj, "x");
+    shape.y = getDouble(shapeObj, "y");
+    shape.x2 = getDouble(shapeObj, "x2");
+    shape.y2 = getDouble(shapeObj, "y2");
+    shape.x3 = getDouble(shapeObj, "x3");
+    shape.y3 = getDouble(shapeObj, "y3");
+    shape.width = getDouble(shapeObj, "width");
+    shape.height = getDouble(shapeObj, "height");
+    shape.radius = getDouble(shapeObj, "radius");
+    shape.lineWidth = getDouble(shapeObj, "line_width", 0.5);
+    
+    if (hasMember(shapeObj, "stroke_color")) {
+        shape.strokeColor = processColor(shapeObj["stroke_color"]);
+    }
+    else
+    {
+        shape.strokeColor.r=0;
+        shape.strokeColor.g=0;
+        shape.strokeColor.b=0;
 
-        }
-        if (hasMember(shapeObj, "fill_color")) {
-            fill_color = processColor(shapeObj["fill_color"]);
-        }
-        else
-        {
-            fill_color.r=-1;
-            fill_color.g=-1;
-            fill_color.b=-1;
-        }
+    }
+    if (hasMember(shapeObj, "fill_color")) {
+        shape.fillColor = processColor(shapeObj["fill_color"]);
+    }
+    else
+    {
+        shape.fillColor.r=-1;
+        shape.fillColor.g=-1;
+        shape.fillColor.b=-1;
+    }
 
-        if (type == "circle" && radius>0)
-        {
-            pdf->addCircle(xObject,x, y, radius,
-                            fill_color.r, fill_color.g, fill_color.b,
-                            stroke_color.r, stroke_color.g, stroke_color.b,
-                            line_width);
-        }
-        else if ((type == "rectangle" || type == "square") &&
-                width>0 && height>0)
-        {
-            pdf->addRectangle(xObject,x, y, width , height,
-                             fill_color.r,  fill_color.g,  fill_color.b,
-                             stroke_color.r,  stroke_color.g,  stroke_color.b,
-                             line_width);
-        }
-        else if ( type == "line" &&  x2>0 &&  y2>0)
-        {
-            pdf->addLine(xObject, x,  y,  x2,  y2,
-                         line_width,  stroke_color.r,  stroke_color.g,  stroke_color.b);
-        }
-        else if ( type == "triangle" &&  x2>0 &&  y2>0 &&
-                 x3>0 &&  y3>0)
-        {
-            pdf->addTriangle(xObject, x,  y,  x2,  y2,  x3,  y3,
-                             fill_color.r,  fill_color.g,  fill_color.b,
-                             stroke_color.r,  stroke_color.g,  stroke_color.b,
-                             line_width);
-        }
-        else
-        {
+    if (type == "circle" && shape.radius>0)
+        shape.kind = CompiledShape::Kind::CIRCLE;
+    else if ((type == "rectangle" || type == "square") && shape.width>0 && shape.height>0)
+        shape.kind = CompiledShape::Kind::RECTANGLE;
+    else if (type == "line" && shape.x2>0 && shape.y2>0)
+        shape.kind = CompiledShape::Kind::LINE;
+    else if (type == "triangle" && shape.x2>0 && shape.y2>0 && shape.x3>0 && shape.y3>0)
+        shape.kind = CompiledShape::Kind::TRIANGLE;
+    else
+        return false;
+    return true;
+}
+void PDFJson::emitShape(PDFFormXObject *xObject, const CompiledShape& shape, double dx, double dy) const {
+    const Color& fill_color = shape.fillColor;
+    const Color& stroke_color = shape.strokeColor;
+    switch (shape.kind)
+    {
+    case CompiledShape::Kind::CIRCLE:
+        pdf->addCircle(xObject,shape.x + dx, shape.y + dy, shape.radius,
+                        fill_color.r, fill_color.g, fill_color.b,
+                        stroke_color.r, stroke_color.g, stroke_color.b,
+                        shape.lineWidth);
+        break;
+    case CompiledShape::Kind::RECTANGLE:
+        pdf->addRectangle(xObject,shape.x + dx, shape.y + dy, shape.width , shape.height,
+                         fill_color.r,  fill_color.g,  fill_color.b,
+                         stroke_color.r,  stroke_color.g,  stroke_color.b,
+                         shape.lineWidth);
+        break;
+    case CompiledShape::Kind::LINE:
+        pdf->addLine(xObject, shape.x + dx,  shape.y + dy,  shape.x2 + dx,  shape.y2 + dy,
+                     shape.lineWidth,  stroke_color.r,  stroke_color.g,  stroke_color.b);
+        break;
+    case CompiledShape::Kind::TRIANGLE:
+        pdf->addTriangle(xObject, shape.x + dx,  shape.y + dy,  shape.x2 + dx,  shape.y2 + dy,  shape.x3 + dx,  shape.y3 + dy,
+                         fill_color.r,  fill_color.g,  fill_color.b,
+                         stroke_color.r,  stroke_color.g,  stroke_color.b,
+                         shape.lineWidth);
+        break;
+    }
+}
+bool PDFJson::processShape(PDFFormXObject *xObject,const Value& shapeObj) const {
+    if (shapeObj.IsObject()) {
+        CompiledShape shape;
+        if (!compileShape(shapeObj, shape))
             return false;
-        }
+        emitShape(xObject, shape);
     }
     return true;
 }
 
-bool PDFJson::processPageObject(PDFFormXObject *xObject,const Value& obj, int pageNumber) const {
+bool PDFJson::processPageObject(PDFFormXObject *xObject,const Value& obj, int pageNumber, int objectIndex) const {
 
     auto type = getString(obj, "type");
+    TraceSpan span(tracer.get(), type == "photo" ? "photo" : type == "text" ? "text" : type == "table" ? "table" : "shape",
+                   "object");
     if (type=="photo") {
         if(!processPhoto(xObject,obj))
         {
-            std::cout<<"Error: Failed to process photo at page number" + std::to_string(pageNumber)<<std::endl;
+            log(LogLevel::ERROR, "Failed to process photo", objectIndex, pageNumber);
             return false;
         }
     } else if (type=="text")
     {
         if(!processTextObject(xObject,obj,pageNumber))
         {
-            std::cout<<"Error: Failed to process Text at page number" + std::to_string(pageNumber)<<std::endl;
+            log(LogLevel::ERROR, "Failed to process text", objectIndex, pageNumber);
             return false;
         }
     } else if (type=="table")
     {
         if(!processTable(xObject,obj))
         {
-            std::cout<<"Error: Failed to process Table at page number" + std::to_string(pageNumber)<<std::endl;
+            log(LogLevel::ERROR, "Failed to process table", objectIndex, pageNumber);
             return false;
         }
     } else if (type=="line" || type=="circle" || type == "rectangle" || type == "square" || type == "triangle")
     {
         if(!processShape(xObject,obj))
         {
-            std::cout<<"Error: Failed to process Shape at page number" + std::to_string(pageNumber)<<std::endl;
+            log(LogLevel::ERROR, "Failed to process shape", objectIndex, pageNumber);
             return false;
         }
     }
@@ -419,36 +754,42 @@ bool PDFJson::processPageObject(PDFFormXObject *xObject,const Value& obj, int pa
     return true;
 }
 
+void PDFJson::beginPage(double margin, double headerHeight, double footerHeight) const {
+    if(footerHeight==0) footerHeight = config.footer_height;
+    if(headerHeight==0) headerHeight = config.header_height;
+    if(margin==0) margin = config.margin;
+    pdf->setPageStyle(margin, headerHeight, footerHeight);
+    pdf->createNewPage();
+}
 bool PDFJson::processPage(const Value& pageObj) const {
     if (pageObj.IsObject()) {
         auto footerHeight = getDouble(pageObj, "footer_height");
         auto headerHeight = getDouble(pageObj, "header_height");
         auto margin = getDouble(pageObj, "margin");
-        if(footerHeight==0) footerHeight = config.footer_height;
-        if(headerHeight==0) headerHeight = config.header_height;
-        if(margin==0) margin = config.margin;
-        pdf->setPageStyle(margin, headerHeight, footerHeight);
-        pdf->createNewPage();
+        beginPage(margin, headerHeight, footerHeight);
         
         if (hasMember(pageObj, "objects") && pageObj["objects"].IsArray()) {
             const Value& objectsArray = pageObj["objects"];
+            // A failing object is logged and skipped
             for (SizeType i = 0; i < objectsArray.Size(); i++) {
-                processPageObject(nullptr,objectsArray[i]);
+                processPageObject(nullptr,objectsArray[i],0,i);
             }
         }
     }
     return true;
 }
 
-bool PDFJson::processHeaderFooter(PDFFormXObject *xObject,const Value& hfObj, int pageNumber) const {
+bool PDFJson::processHeaderFooter(PDFFormXObject *xObject,const Value& hfObj, int pageNumber, HeaderFooterPart part) const {
 
     if (hfObj.IsObject() && hasMember(hfObj, "objects") && hfObj["objects"].IsArray()) {
         const Value& objectsArray = hfObj["objects"];
         for (SizeType i = 0; i < objectsArray.Size(); i++) {
-            if(!processPageObject(xObject,objectsArray[i],pageNumber))
+            if (part != HeaderFooterPart::ALL &&
+                hasPageTokens(objectsArray[i]) != (part == HeaderFooterPart::DYNAMIC))
+                continue;
+            if(!processPageObject(xObject,objectsArray[i],pageNumber,i))
             {
-                std::cout<<"Error: Failed to process Object " + std::to_string(i) +
-                      " on footer_header " + std::to_string(pageNumber)<<std::endl;
+                log(LogLevel::ERROR, "Failed to process header/footer object", i, pageNumber);
                 return false;
             }
         }
@@ -456,106 +797,256 @@ bool PDFJson::processHeaderFooter(PDFFormXObject *xObject,const Value& hfObj, in
     return true;
 }
 
+bool PDFJson::hasPageTokens(const Value& obj) const {
+    static const char* token = "${PAGE_NUMBER}";
+    auto type = getString(obj, "type");
+    if (type == "text")
+        return getString(obj, "content").find(token) != std::string::npos;
+    if (type != "table" || !hasMember(obj, "rows") || !obj["rows"].IsArray())
+        return false;
+
+    // A table is page-dependent when any of its cells is
+    const Value& rows = obj["rows"];
+    for (SizeType i = 0; i < rows.Size(); i++) {
+        if (!rows[i].IsObject() || !hasMember(rows[i], "cells") || !rows[i]["cells"].IsArray())
+            continue;
+        const Value& cells = rows[i]["cells"];
+        for (SizeType j = 0; j < cells.Size(); j++) {
+            if (cells[j].IsObject() && getString(cells[j], "content").find(token) != std::string::npos)
+                return true;
+        }
+    }
+    return false;
+}
+
+PDFJson::HeaderFooterForms PDFJson::scanHeaderFooter(const Value& hfObj) const {
+    HeaderFooterForms forms;
+    if (hfObj.IsObject() && hasMember(hfObj, "objects") && hfObj["objects"].IsArray()) {
+        const Value& objectsArray = hfObj["objects"];
+        for (SizeType i = 0; i < objectsArray.Size(); i++) {
+            if (hasPageTokens(objectsArray[i]))
+                forms.hasDynamic = true;
+            else
+                forms.hasStatic = true;
+        }
+    }
+    return forms;
+}
+
+void PDFJson::preloadImages(const Value& hfObj) const {
+    if (!hfObj.IsObject() || !hasMember(hfObj, "objects") || !hfObj["objects"].IsArray())
+        return;
+
+    const Value& objectsArray = hfObj["objects"];
+    for (SizeType i = 0; i < objectsArray.Size(); i++) {
+        const Value& obj = objectsArray[i];
+        if (getString(obj, "type") == "photo")
+            pdf->preloadImage(getString(obj, "path"), getInt(obj, "index"));
+    }
+}
+
+// Forms cannot be started inside the page's content stream, so the header and footer forms
+// are all written before the first of them is placed on the page
+void PDFJson::placeHeadersAndFooters(bool hasHeader, bool hasFooter, int pageNumber,
+                                     const std::function<void(bool)>& preload,
+                                     const std::function<bool(PDFFormXObject*, bool, HeaderFooterPart)>& render) {
+    ObjectIDType placed[2][2] = {}; // header, footer x static, dynamic
+    for (int i = 0; i < 2; i++) {
+        bool isHeader = i == 0;
+        if (!(isHeader ? hasHeader : hasFooter))
+            continue;
+        HeaderFooterForms& forms = isHeader ? headerForms : footerForms;
+        const char* name = isHeader ? "header" : "footer";
+        TraceSpan span(tracer.get(), name, "xobject");
+
+        // Images are embedded before a form is started; the form's stream cannot be interrupted
+        if ((forms.hasStatic && forms.staticId == 0) || forms.hasDynamic)
+            preload(isHeader);
+
+        // The static part is rendered on the first page and the same XObject is reused afterwards
+        for (HeaderFooterPart part : {HeaderFooterPart::STATIC, HeaderFooterPart::DYNAMIC}) {
+            bool isStatic = part == HeaderFooterPart::STATIC;
+            if (!(isStatic ? forms.hasStatic && forms.staticId == 0 : forms.hasDynamic))
+                continue;
+            auto xObject = isHeader ? pdf->createHeader() : pdf->createFooter();
+            if (!xObject)
+                continue;
+            if (!render(xObject, isHeader, part)) {
+                log(LogLevel::WARNING, std::string("Failed to process ") + name, -1, pageNumber);
+            }
+            ObjectIDType id = pdf->closeXObject(xObject);
+            if (isStatic)
+                forms.staticId = id;
+            else
+                placed[i][1] = id;
+        }
+        placed[i][0] = forms.staticId;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        for (ObjectIDType id : placed[i]) {
+            if (id == 0)
+                continue;
+            if (i == 0)
+                pdf->addHeader(id);
+            else
+                pdf->addFooter(id);
+        }
+    }
+}
+
 bool PDFJson::processFromFile(const std::string& filename) {
     clear();
-    std::ifstream file(filename);
-    if (!file.is_open()) {
+    JsonInputBuffer input;
+    if (!input.open(filename)) {
         throw std::runtime_error("Cannot open file: " + filename);
     }
 
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    
-    
-    return processFromString(buffer.str());
-}
+    // Strings in the DOM point into the buffer instead of being copied
+    auto start = std::chrono::steady_clock::now();
+    Document document;
+    document.ParseInsitu(input.data());
+    parseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
+    return processDocument(document);
+}
 bool PDFJson::processFromString(const std::string& jsonString) {
     clear();
     
+    auto start = std::chrono::steady_clock::now();
     Document document;
     document.Parse(jsonString.c_str());
-    
+    parseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return processDocument(document);
+}
+bool PDFJson::processFromString(const std::string& jsonString, std::vector<uint8_t>& pdfBytes) {
+    pdfBytes.clear();
+    MemoryOutput memory(pdfBytes);
+    OutputTarget* previous = output;
+    output = &memory;
+    // A failed document still has its page open; close it while memory is alive
+    auto detach = [&]() {
+        output = previous;
+        if (pdf) {
+            pdf->closeDocument();
+            pdf->releaseOutput();
+        }
+    };
+    bool ok;
+    try {
+        ok = processFromString(jsonString);
+    } catch (...) {
+        detach();
+        throw;
+    }
+    detach();
+    return ok;
+}
+bool PDFJson::processDocument(Document& document) {
     if (document.HasParseError()) {
-        std::cerr << "Error: JSON process error" << std::endl;
+        log(LogLevel::ERROR, "JSON process error");
         return false;
     }
-    
-    if (!document.IsObject()) {
-        std::cerr << "Error: Root is not an object" << std::endl;
+
+    if (!beginDocument(document))
         return false;
+
+    // Parse pages array
+    if (hasMember(document, "pages") && document["pages"].IsArray()) {
+        const Value& pagesArray = document["pages"];
+        for (SizeType i = 0; i < pagesArray.Size(); i++) {
+            if(!processPage(pagesArray[i]))
+            {
+                log(LogLevel::ERROR, "Failed to process page " + std::to_string(i));
+                return false;
+            }
+        }
     }
-    
-    // Parse main document configuration (same as processFromFile)
+
+    return endDocument();
+}
+RenderStats PDFJson::getStats() const {
+    RenderStats stats;
+    if (pdf)
+        stats = pdf->getStats();
+    if (statsEnabled)
+        stats.seconds[RenderStats::PARSE] = parseSeconds;
+    return stats;
+}
+DocumentConfig PDFJson::readConfig(const Value& document) const {
+    DocumentConfig config;
     config.file_name = getString(document, "file_name");
     config.height = getDouble(document, "height", 842);
     config.width = getDouble(document, "width", 595);
     config.font_size = getDouble(document, "font_size", 10);
     config.font_path = getString(document, "font_path");
+    // "subset" (default) or "none"
+    if (getString(document, "font_embedding") == "none")
+        config.output.fonts = FontEmbedding::NONE;
+    config.output.version = decodePdfVersion(getString(document, "pdf_version"));
+    config.output.compressStreams = getBool(document, "compress", true);
+    config.output.xrefStream = getBool(document, "xref_stream", false);
+    config.output.coalesceText = getBool(document, "coalesce_text", true);
     config.margin = getDouble(document, "margin", 5);
     config.header_height = getDouble(document, "header_height", 120);
     config.footer_height = getDouble(document, "footer_height", 40);
-
+    return config;
+}
+bool PDFJson::createPdf() {
     pdf = std::make_shared<PDFCreator>(config.width , config.height, config.margin, config.header_height, config.footer_height);
+    if (resources)
+        pdf->setResourcePool(resources);
+    pdf->setOutputOptions(config.output);
+    pdf->setStatsEnabled(statsEnabled);
+    if (workerThreads > 0)
+        pdf->setWorkerThreads(workerThreads);
+    pdf->setTracer(tracer);
+    pdf->setLogger(logger);
 
-    if (!pdf->createDocument(config.file_name))
+    bool created = output ? pdf->createDocument(output, config.file_name) : pdf->createDocument(config.file_name);
+    if (!created)
     {
-        std::cerr << "Error: Failed to create pdf file" << std::endl;
+        log(LogLevel::ERROR, "Failed to create pdf file");
         return false;
     }
+    return true;
+}
+bool PDFJson::beginDocument(const Value& document) {
+    if (!document.IsObject()) {
+        log(LogLevel::ERROR, "Root is not an object");
+        return false;
+    }
+    
+    // Parse main document configuration
+    config = readConfig(document);
+    if (!createPdf())
+        return false;
     if (hasMember(document, "header")|| hasMember(document, "footer"))
       {
+        if (hasMember(document, "header"))
+            headerForms = scanHeaderFooter(document["header"]);
+        if (hasMember(document, "footer"))
+            footerForms = scanHeaderFooter(document["footer"]);
+
         pdf->initPageFunc = [&document, this](int p)
         {
-          ObjectIDType headerId;
-          ObjectIDType footerId;
-          if (hasMember(document, "header"))
-          {
-            auto header = pdf->createHeader();
-            if (!processHeaderFooter(header,document["header"],p))
-            {
-                std::cerr << "Warning: Failed to process header" << std::endl;
-            }
-            headerId = pdf->closeXObject(header);
-          }
-          if (hasMember(document, "footer"))
-          {
-            auto footer = pdf->createFooter();
-            if (!processHeaderFooter(footer,document["footer"],p))
-            {
-                std::cerr << "Warning: Failed to process footer" << std::endl;
-            }
-            footerId = pdf->closeXObject(footer);
-          }
-
-          if (hasMember(document, "header"))
-          {
-            pdf->addHeader(headerId);
-          }
-          if (hasMember(document, "footer"))
-          {
-            pdf->addFooter(footerId);
-          }
+          const Value* parts[2] = {hasMember(document, "header") ? &document["header"] : nullptr,
+                                   hasMember(document, "footer") ? &document["footer"] : nullptr};
+          placeHeadersAndFooters(parts[0] != nullptr, parts[1] != nullptr, p,
+                                 [this, &parts](bool isHeader) { preloadImages(*parts[isHeader ? 0 : 1]); },
+                                 [this, &parts, p](PDFFormXObject* xObject, bool isHeader, HeaderFooterPart part) {
+                                     return processHeaderFooter(xObject, *parts[isHeader ? 0 : 1], p, part);
+                                 });
         };
       }
-
-        
-    // Parse pages array
-    if (hasMember(document, "pages") && document["pages"].IsArray()) {
-        const Value& pagesArray = document["pages"];
-        for (SizeType i = 0; i < pagesArray.Size(); i++) {
-            if(!processPage(pagesArray[i]))
-            {
-                std::cout<<"Error: Failed to process page " + std::to_string(i)<<std::endl;
-                return false;
-            }
-        }
-    }
-
+    return true;
+}
+bool PDFJson::endDocument() {
     if (pdf->saveDocument()) {
-        std::cout<<"PDF report generated successfully!"<<std::endl;
+        log(LogLevel::INFO, "PDF report generated successfully");
     } else {
-        std::cout<<"ERROR:Failed to generate PDF report!!"<<std::endl;
+        log(LogLevel::ERROR, "Failed to generate PDF report");
         return false;
     }
     
@@ -575,3 +1066,362 @@ std::string PDFJson::replaceStr(const std::string &source, const std::string &fr
     }
     return str;
 }
+
+// Copies the document without its top-level "pages" member, so config, header and
+// footer can be kept as a small DOM while the pages are streamed.
+class JsonConfigScanner : public BaseReaderHandler<UTF8<>, JsonConfigScanner> {
+public:
+    StringBuffer buffer;
+
+    JsonConfigScanner() : writer(buffer) {}
+
+    bool Null() { return skipped() || writer.Null(); }
+    bool Bool(bool b) { return skipped() || writer.Bool(b); }
+    bool Int(int i) { return skipped() || writer.Int(i); }
+    bool Uint(unsigned u) { return skipped() || writer.Uint(u); }
+    bool Int64(int64_t i) { return skipped() || writer.Int64(i); }
+    bool Uint64(uint64_t u) { return skipped() || writer.Uint64(u); }
+    bool Double(double d) { return skipped() || writer.Double(d); }
+    bool String(const Ch* str, SizeType length, bool copy) { return skipped() || writer.String(str, length, copy); }
+    bool StartObject() { return opened() || (++depth, writer.StartObject()); }
+    bool EndObject(SizeType count) { return closed() || (--depth, writer.EndObject(count)); }
+    bool StartArray() { return opened() || (++depth, writer.StartArray()); }
+    bool EndArray(SizeType count) { return closed() || (--depth, writer.EndArray(count)); }
+    bool Key(const Ch* str, SizeType length, bool copy)
+    {
+        if (skipping)
+            return true;
+        if (depth == 1 && length == 5 && std::strncmp(str, "pages", 5) == 0)
+        {
+            skipping = true;
+            return true;
+        }
+        return writer.Key(str, length, copy);
+    }
+
+private:
+    Writer<StringBuffer> writer;
+    int depth = 0;
+    bool skipping = false;
+    int skipDepth = 0;
+
+    // Each returns true when the event belongs to the skipped "pages" value
+    bool skipped()
+    {
+        if (!skipping)
+            return false;
+        if (skipDepth == 0)
+            skipping = false;
+        return true;
+    }
+    bool opened()
+    {
+        if (!skipping)
+            return false;
+        ++skipDepth;
+        return true;
+    }
+    bool closed()
+    {
+        if (!skipping)
+            return false;
+        if (--skipDepth == 0)
+            skipping = false;
+        return true;
+    }
+};
+
+// Walks root["pages"] and renders each page object once it has been read. An object is
+// re-serialized into a small buffer and parsed on its own; for tables the settings read
+// so far are closed off at "rows" and each row is then parsed and streamed separately.
+class JsonPageStreamer : public BaseReaderHandler<UTF8<>, JsonPageStreamer> {
+public:
+    explicit JsonPageStreamer(PDFJson& json_) : json(json_), writer(buffer) {}
+
+    bool Null() { return scalar([&] { return writer.Null(); }, 0, false); }
+    bool Bool(bool b) { return scalar([&] { return writer.Bool(b); }, 0, false); }
+    bool Int(int i) { return scalar([&] { return writer.Int(i); }, i, true); }
+    bool Uint(unsigned u) { return scalar([&] { return writer.Uint(u); }, u, true); }
+    bool Int64(int64_t i) { return scalar([&] { return writer.Int64(i); }, (double)i, true); }
+    bool Uint64(uint64_t u) { return scalar([&] { return writer.Uint64(u); }, (double)u, true); }
+    bool Double(double d) { return scalar([&] { return writer.Double(d); }, d, true); }
+    bool String(const Ch* str, SizeType length, bool copy)
+    {
+        if (capture != Capture::NONE && captureDepth == 1 && expectType)
+            objectType.assign(str, length);
+        expectType = false;
+        return scalar([&] { return writer.String(str, length, copy); }, 0, false);
+    }
+
+    bool Key(const Ch* str, SizeType length, bool copy)
+    {
+        if (skipDepth > 0)
+            return true;
+        if (capture != Capture::NONE)
+        {
+            if (capture == Capture::OBJECT && captureDepth == 1)
+            {
+                if (length == 4 && std::strncmp(str, "rows", 4) == 0 && objectType == "table")
+                    return beginTable();
+                expectType = length == 4 && std::strncmp(str, "type", 4) == 0;
+            }
+            return writer.Key(str, length, copy);
+        }
+        frames.back().key.assign(str, length);
+        // The table's style was built when its rows started
+        if (frames.back().kind == Frame::TABLE)
+            json.log(LogLevel::WARNING, "Table setting \"" + frames.back().key + "\" after \"rows\" is ignored", objectIndex);
+        return true;
+    }
+
+    bool StartObject()
+    {
+        if (skipDepth > 0 || capture != Capture::NONE)
+            return open([&] { return writer.StartObject(); });
+
+        Frame parent = frames.empty() ? Frame::NONE : frames.back().kind;
+        if (parent == Frame::NONE)
+            return push(Frame::ROOT);
+        if (parent == Frame::PAGES)
+        {
+            pageStarted = false;
+            objectIndex = -1;
+            margin = headerHeight = footerHeight = 0;
+            return push(Frame::PAGE);
+        }
+        if (parent == Frame::OBJECTS || parent == Frame::ROWS)
+        {
+            if (parent == Frame::OBJECTS)
+                ++objectIndex;
+            startCapture(parent == Frame::OBJECTS ? Capture::OBJECT : Capture::ROW);
+            return writer.StartObject();
+        }
+        skipDepth = 1;
+        return true;
+    }
+
+    bool StartArray()
+    {
+        if (skipDepth > 0 || capture != Capture::NONE)
+            return open([&] { return writer.StartArray(); });
+
+        Frame parent = frames.empty() ? Frame::NONE : frames.back().kind;
+        const std::string& key = frames.empty() ? std::string() : frames.back().key;
+        if (parent == Frame::ROOT && key == "pages")
+            return push(Frame::PAGES);
+        if (parent == Frame::PAGE && key == "objects")
+        {
+            startPage();
+            return push(Frame::OBJECTS);
+        }
+        if (parent == Frame::TABLE && key == "rows")
+            return push(Frame::ROWS);
+        skipDepth = 1;
+        return true;
+    }
+
+    bool EndObject(SizeType count) { return close([&] { return writer.EndObject(count); }); }
+    bool EndArray(SizeType count) { return close([&] { return writer.EndArray(count); }); }
+
+private:
+    enum class Frame { NONE, ROOT, PAGES, PAGE, OBJECTS, TABLE, ROWS };
+    enum class Capture { NONE, OBJECT, ROW };
+    struct Level {
+        Frame kind;
+        std::string key;
+    };
+
+    PDFJson& json;
+    StringBuffer buffer;
+    Writer<StringBuffer> writer;
+    std::vector<Level> frames;
+    int skipDepth = 0;
+    Capture capture = Capture::NONE;
+    int captureDepth = 0;
+    std::string objectType;
+    bool expectType = false;
+    bool pageStarted = false;
+    int objectIndex = -1; // within the current page
+    double margin = 0, headerHeight = 0, footerHeight = 0;
+    std::unique_ptr<TableStream> table;
+
+    bool push(Frame kind)
+    {
+        frames.push_back(Level{kind, std::string()});
+        return true;
+    }
+
+    template <typename Write>
+    bool scalar(Write write, double number, bool isNumber)
+    {
+        if (skipDepth > 0)
+            return true;
+        if (capture != Capture::NONE)
+            return write() && (captureDepth > 0 || finishCapture());
+
+        // Page settings are numbers directly on the page object
+        if (!frames.empty() && frames.back().kind == Frame::PAGE && isNumber)
+        {
+            const std::string& key = frames.back().key;
+            bool isSetting = key == "margin" || key == "header_height" || key == "footer_height";
+            if (isSetting && pageStarted)
+                json.log(LogLevel::WARNING, "Page setting \"" + key + "\" after \"objects\" is ignored");
+            else if (key == "margin")
+                margin = number;
+            else if (key == "header_height")
+                headerHeight = number;
+            else if (key == "footer_height")
+                footerHeight = number;
+        }
+        return true;
+    }
+
+    template <typename Write>
+    bool open(Write write)
+    {
+        if (skipDepth > 0)
+        {
+            ++skipDepth;
+            return true;
+        }
+        ++captureDepth;
+        return write();
+    }
+
+    template <typename Write>
+    bool close(Write write)
+    {
+        if (skipDepth > 0)
+        {
+            --skipDepth;
+            return true;
+        }
+        if (capture != Capture::NONE)
+            return write() && (--captureDepth > 0 || finishCapture());
+
+        Frame kind = frames.back().kind;
+        frames.pop_back();
+        if (kind == Frame::PAGE)
+            startPage();
+        else if (kind == Frame::TABLE && table)
+        {
+            table->finish();
+            table.reset();
+        }
+        return true;
+    }
+
+    void startPage()
+    {
+        if (pageStarted)
+            return;
+        json.beginPage(margin, headerHeight, footerHeight);
+        pageStarted = true;
+    }
+
+    void startCapture(Capture kind)
+    {
+        buffer.Clear();
+        writer.Reset(buffer);
+        capture = kind;
+        captureDepth = 1;
+        objectType.clear();
+        expectType = false;
+    }
+
+    // Closes the table settings read so far and opens a stream for the rows that follow
+    bool beginTable()
+    {
+        writer.EndObject();
+        Document settings;
+        settings.Parse(buffer.GetString(), buffer.GetSize());
+        capture = Capture::NONE;
+        captureDepth = 0;
+
+        double startX, startY, tableWidth;
+        auto tableDrawer = json.processTableStyle(settings, startX, startY, tableWidth);
+        table = json.pdf->BeginTableStream(nullptr, tableDrawer, startX, startY, tableWidth);
+
+        // The rest of the table object is walked as a frame; the key is set by the caller's "rows"
+        frames.push_back(Level{Frame::TABLE, "rows"});
+        return true;
+    }
+
+    bool finishCapture()
+    {
+        Capture kind = capture;
+        capture = Capture::NONE;
+
+        Document document;
+        document.Parse(buffer.GetString(), buffer.GetSize());
+        if (document.HasParseError())
+        {
+            json.log(LogLevel::ERROR, "JSON process error");
+            return false;
+        }
+
+        if (kind == Capture::OBJECT)
+        {
+            // Logged and skipped as in processPage
+            json.processPageObject(nullptr, document, 0, objectIndex);
+        }
+        else if (table)
+        {
+            auto row = json.processRow(nullptr, document);
+            table->addRow(*row);
+        }
+        return true;
+    }
+};
+
+template <typename MakeStream>
+bool PDFJson::processStreams(MakeStream makeInput) {
+    JsonConfigScanner scanner;
+    Reader configReader;
+    auto configInput = makeInput();
+    if (!configReader.Parse(configInput, scanner)) {
+        log(LogLevel::ERROR, "JSON process error");
+        return false;
+    }
+
+    Document document;
+    document.Parse(scanner.buffer.GetString(), scanner.buffer.GetSize());
+    if (document.HasParseError()) {
+        log(LogLevel::ERROR, "JSON process error");
+        return false;
+    }
+    if (!beginDocument(document))
+        return false;
+
+    JsonPageStreamer streamer(*this);
+    Reader pagesReader;
+    auto pagesInput = makeInput();
+    if (!pagesReader.Parse(pagesInput, streamer)) {
+        log(LogLevel::ERROR, "Failed to process pages");
+        return false;
+    }
+
+    return endDocument();
+}
+
+bool PDFJson::processFromFileStreaming(const std::string& filename) {
+    clear();
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if (!file) {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+
+    // Both passes read through the same buffer; the file is rewound for each
+    std::vector<char> readBuffer(1 << 16);
+    bool ok = processStreams([&]() {
+        std::rewind(file);
+        return FileReadStream(file, readBuffer.data(), readBuffer.size());
+    });
+    std::fclose(file);
+    return ok;
+}
+
+bool PDFJson::processFromStringStreaming(const std::string& jsonString) {
+    clear();
+    return processStreams([&]() { return StringStream(jsonString.c_str()); });
+}
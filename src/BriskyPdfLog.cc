@@ -0,0 +1,204 @@
+#include "BriskyPdfLog.h"
+#include <cstdint>
+
+namespace {
+
+std::mutex defaultMutex;
+std::shared_ptr<Logger> defaultLogger;
+
+size_t roundUpToPowerOfTwo(size_t value)
+{
+    size_t result = 2;
+    while (result < value)
+        result <<= 1;
+    return result;
+}
+
+}
+
+const char *LogRecord::levelName(LogLevel level)
+{
+    switch (level)
+    {
+    case LogLevel::DEBUG:
+        return "DEBUG";
+    case LogLevel::INFO:
+        return "INFO";
+    case LogLevel::WARNING:
+        return "WARNING";
+    case LogLevel::ERROR:
+        return "ERROR";
+    case LogLevel::OFF:
+        break;
+    }
+    return "";
+}
+
+void StreamLogSink::write(const LogRecord &record)
+{
+    mStream << LogRecord::levelName(record.level) << ' ' << record.message;
+    if (!record.document.empty())
+        mStream << " document=" << record.document;
+    if (record.page > 0)
+        mStream << " page=" << record.page;
+    if (record.object >= 0)
+        mStream << " object=" << record.object;
+    mStream << '\n';
+}
+
+Logger::Logger(std::shared_ptr<LogSink> sink, LogLevel level, size_t capacity)
+    : mSink(sink), mLevel(level), mMask(roundUpToPowerOfTwo(capacity) - 1)
+{
+    mCells.reset(new Cell[mMask + 1]);
+    for (size_t i = 0; i <= mMask; ++i)
+    {
+        mCells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+Logger::~Logger()
+{
+    if (mDrainThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mWakeMutex);
+            mStopping.store(true, std::memory_order_release);
+        }
+        mWake.notify_one();
+        mDrainThread.join();
+    }
+}
+
+void Logger::log(LogLevel level, std::string message, const std::string &document, int page, int object)
+{
+    if (!enabled(level))
+        return;
+    LogRecord record;
+    record.level = level;
+    record.message = std::move(message);
+    record.document = document;
+    record.page = page;
+    record.object = object;
+    log(std::move(record));
+}
+
+void Logger::log(LogRecord record)
+{
+    if (!enabled(record.level) || !mSink)
+        return;
+    record.time = std::chrono::system_clock::now();
+
+    std::call_once(mStarted, [this]()
+                   { mDrainThread = std::thread(&Logger::drainLoop, this); });
+
+    if (!tryPush(record))
+    {
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    mQueued.fetch_add(1);
+    // The mutex is only taken when the drain thread sleeps; taking it orders this record against
+    // the predicate check in drainLoop, so the wake-up cannot be lost
+    if (mSleeping.load())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mWakeMutex);
+        }
+        mWake.notify_one();
+    }
+}
+
+// Bounded multi-producer ring: each cell's sequence says whose turn it is, so producers only
+// contend on the enqueue position and never on a lock
+bool Logger::tryPush(LogRecord &record)
+{
+    size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Cell &cell = mCells[pos & mMask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0)
+        {
+            if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell.record = std::move(record);
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = mEnqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool Logger::tryPop(LogRecord &record)
+{
+    Cell &cell = mCells[mDequeuePos & mMask];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(mDequeuePos + 1) < 0)
+        return false;
+    record = std::move(cell.record);
+    cell.sequence.store(mDequeuePos + mMask + 1, std::memory_order_release);
+    mDequeuePos++;
+    return true;
+}
+
+void Logger::drainLoop()
+{
+    LogRecord record;
+    for (;;)
+    {
+        bool stopping = mStopping.load(std::memory_order_acquire);
+        uint64_t written = 0;
+        while (tryPop(record))
+        {
+            mSink->write(record);
+            written++;
+        }
+        if (written > 0)
+        {
+            mSink->flush();
+            mWritten.fetch_add(written, std::memory_order_release);
+        }
+        if (stopping)
+            return;
+
+        std::unique_lock<std::mutex> lock(mWakeMutex);
+        mSleeping.store(true);
+        mWake.wait(lock, [this]()
+                   { return mQueued.load() > mWritten.load(std::memory_order_relaxed) ||
+                            mStopping.load(std::memory_order_acquire); });
+        mSleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+void Logger::flush()
+{
+    uint64_t target = mQueued.load(std::memory_order_acquire);
+    while (mWritten.load(std::memory_order_acquire) < target)
+    {
+        mWake.notify_one();
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
+
+std::shared_ptr<Logger> Logger::getDefault()
+{
+    std::lock_guard<std::mutex> lock(defaultMutex);
+    if (!defaultLogger)
+        defaultLogger = std::make_shared<Logger>(std::make_shared<StreamLogSink>());
+    return defaultLogger;
+}
+
+void Logger::setDefault(std::shared_ptr<Logger> logger)
+{
+    std::lock_guard<std::mutex> lock(defaultMutex);
+    defaultLogger = logger;
+}
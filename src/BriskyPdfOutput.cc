@@ -0,0 +1,68 @@
+#include "BriskyPdfOutput.h"
+#include <cerrno>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+IOBasicTypes::LongBufferSizeType OutputTarget::Write(const IOBasicTypes::Byte *inBuffer, IOBasicTypes::LongBufferSizeType inSize)
+{
+    if (mFailed)
+        return 0;
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(inBuffer);
+    size_t size = static_cast<size_t>(inSize);
+    mPosition += size;
+
+    if (mStaging.size() + size > mStagingBytes && !flush())
+        return 0;
+    // Pieces that would not fit the staging buffer go out directly
+    if (size >= mStagingBytes)
+    {
+        if (!deliver(data, size))
+        {
+            mFailed = true;
+            return 0;
+        }
+        return inSize;
+    }
+    if (mStaging.capacity() < mStagingBytes)
+        mStaging.reserve(mStagingBytes);
+    mStaging.insert(mStaging.end(), data, data + size);
+    return inSize;
+}
+
+bool OutputTarget::flush()
+{
+    if (!mFailed && !mStaging.empty() && !deliver(mStaging.data(), mStaging.size()))
+        mFailed = true;
+    mStaging.clear();
+    return !mFailed;
+}
+
+bool MemoryOutput::deliver(const uint8_t *data, size_t size)
+{
+    mBuffer.insert(mBuffer.end(), data, data + size);
+    return true;
+}
+
+bool FileDescriptorOutput::deliver(const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+#ifdef _WIN32
+        int written = _write(mFd, data, static_cast<unsigned int>(size));
+#else
+        ssize_t written = ::write(mFd, data, size);
+#endif
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
@@ -0,0 +1,558 @@
+#include "BriskyPdfJson.h"
+#include <cstdlib>
+
+TemplateString::TemplateString(const std::string &source)
+{
+    size_t pos = 0;
+    std::string literal;
+    while (pos < source.size())
+    {
+        size_t start = source.find("${", pos);
+        size_t end = start == std::string::npos ? std::string::npos : source.find('}', start + 2);
+        if (end == std::string::npos)
+        {
+            literal.append(source, pos, std::string::npos);
+            break;
+        }
+        literal.append(source, pos, start - pos);
+        literals.push_back(std::move(literal));
+        literal.clear();
+        fields.push_back(source.substr(start + 2, end - start - 2));
+        pos = end + 1;
+    }
+    literals.push_back(std::move(literal));
+}
+
+bool TemplateString::uses(const std::string &field) const
+{
+    return std::find(fields.begin(), fields.end(), field) != fields.end();
+}
+
+bool TemplateString::usesDocumentValues() const
+{
+    for (const auto &field : fields)
+    {
+        if (field == "PAGE_COUNT" || field.compare(0, 4, "doc.") == 0)
+            return true;
+    }
+    return false;
+}
+
+// Value of field in record, then values; null when neither has it
+static const std::string *findField(const std::string &field, const TemplateValues &values, const TemplateValues *record)
+{
+    if (record)
+    {
+        auto it = record->find(field);
+        if (it != record->end())
+            return &it->second;
+    }
+    auto it = values.find(field);
+    return it != values.end() ? &it->second : nullptr;
+}
+
+std::string TemplateString::render(const TemplateValues &values, int pageNumber, const TemplateValues *record) const
+{
+    if (fields.empty())
+        return literals[0];
+
+    std::string out = literals[0];
+    for (size_t i = 0; i < fields.size(); ++i)
+    {
+        const std::string *value = findField(fields[i], values, record);
+        if (value)
+            out += *value;
+        else if (fields[i] == "PAGE_NUMBER")
+            out += std::to_string(pageNumber);
+        else
+            out += "${" + fields[i] + "}";
+        out += literals[i + 1];
+    }
+    return out;
+}
+
+bool TemplateCondition::test(const TemplateValues &values, const TemplateValues *record) const
+{
+    const std::string *value = findField(field, values, record);
+    bool set = value && !value->empty() && *value != "0" && *value != "false";
+    return set != negate;
+}
+
+bool RecordListSource::next(TemplateValues &record)
+{
+    if (!records || position >= records->size())
+        return false;
+    record = (*records)[position++];
+    return true;
+}
+
+NdjsonDataSource::NdjsonDataSource(const std::string &filename) : file(filename)
+{
+    if (!file.is_open())
+        Logger::getDefault()->log(LogLevel::ERROR, "Cannot open data source " + filename);
+}
+
+bool NdjsonDataSource::next(TemplateValues &record)
+{
+    while (std::getline(file, line))
+    {
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        Document document;
+        document.Parse<kParseNumbersAsStringsFlag>(line.c_str(), line.size());
+        if (document.HasParseError() || !document.IsObject())
+        {
+            Logger::getDefault()->log(LogLevel::WARNING, "Skipping invalid NDJSON record");
+            continue;
+        }
+
+        record.clear();
+        for (auto it = document.MemberBegin(); it != document.MemberEnd(); ++it)
+        {
+            const Value &value = it->value;
+            std::string name(it->name.GetString(), it->name.GetStringLength());
+            if (value.IsString())
+                record[name].assign(value.GetString(), value.GetStringLength());
+            else if (value.IsBool())
+                record[name] = value.GetBool() ? "true" : "false";
+            else if (value.IsNull())
+                record[name].clear();
+        }
+        return true;
+    }
+    return false;
+}
+
+CsvDataSource::CsvDataSource(const std::string &filename, char separator_) : file(filename), separator(separator_)
+{
+    if (!file.is_open())
+        Logger::getDefault()->log(LogLevel::ERROR, "Cannot open data source " + filename);
+    else
+        readRow(header);
+}
+
+bool CsvDataSource::readRow(std::vector<std::string> &fields)
+{
+    fields.clear();
+    if (file.peek() == std::char_traits<char>::eof())
+        return false;
+
+    std::string field;
+    bool quoted = false;
+    int c;
+    while ((c = file.get()) != std::char_traits<char>::eof())
+    {
+        if (quoted)
+        {
+            if (c == '"')
+            {
+                if (file.peek() == '"')
+                    field += static_cast<char>(file.get());
+                else
+                    quoted = false;
+            }
+            else
+            {
+                field += static_cast<char>(c);
+            }
+        }
+        else if (c == '"')
+        {
+            quoted = true;
+        }
+        else if (c == separator)
+        {
+            fields.push_back(std::move(field));
+            field.clear();
+        }
+        else if (c == '\n')
+        {
+            break;
+        }
+        else if (c != '\r')
+        {
+            field += static_cast<char>(c);
+        }
+    }
+    fields.push_back(std::move(field));
+    return true;
+}
+
+bool CsvDataSource::next(TemplateValues &record)
+{
+    while (readRow(row))
+    {
+        if (row.size() == 1 && row[0].empty())
+            continue;
+
+        record.clear();
+        for (size_t i = 0; i < header.size() && i < row.size(); ++i)
+        {
+            record[header[i]] = row[i];
+        }
+        return true;
+    }
+    return false;
+}
+
+void PDFJson::setDataSource(const std::string &name, std::shared_ptr<const std::vector<TemplateValues>> records)
+{
+    dataSources[name] = [records]()
+    { return std::unique_ptr<TemplateDataSource>(new RecordListSource(records)); };
+}
+
+std::unique_ptr<TemplateDataSource> PDFJson::openDataSource(const TemplateRepeat &repeat) const
+{
+    switch (repeat.format)
+    {
+    case TemplateRepeat::Format::NDJSON:
+    {
+        std::unique_ptr<NdjsonDataSource> source(new NdjsonDataSource(repeat.source));
+        if (source->isOpen())
+            return source;
+        return nullptr;
+    }
+    case TemplateRepeat::Format::CSV:
+    {
+        std::unique_ptr<CsvDataSource> source(new CsvDataSource(repeat.source));
+        if (source->isOpen())
+            return source;
+        return nullptr;
+    }
+    case TemplateRepeat::Format::NAMED:
+        break;
+    }
+
+    auto it = dataSources.find(repeat.source);
+    if (it == dataSources.end())
+    {
+        log(LogLevel::ERROR, "Unknown data source " + repeat.source);
+        return nullptr;
+    }
+    return it->second();
+}
+
+TemplateRepeat PDFJson::compileRepeat(const Value &obj) const
+{
+    TemplateRepeat repeat;
+    if (!hasMember(obj, "repeat"))
+        return repeat;
+
+    const Value &repeatObj = obj["repeat"];
+    if (repeatObj.IsString())
+    {
+        repeat.source = repeatObj.GetString();
+    }
+    else if (repeatObj.IsObject())
+    {
+        if (hasMember(repeatObj, "ndjson"))
+        {
+            repeat.format = TemplateRepeat::Format::NDJSON;
+            repeat.source = getString(repeatObj, "ndjson");
+        }
+        else if (hasMember(repeatObj, "csv"))
+        {
+            repeat.format = TemplateRepeat::Format::CSV;
+            repeat.source = getString(repeatObj, "csv");
+        }
+        else
+        {
+            repeat.source = getString(repeatObj, "source");
+        }
+        repeat.dx = getDouble(repeatObj, "dx");
+        repeat.dy = getDouble(repeatObj, "dy");
+        if (hasMember(repeatObj, "totals") && repeatObj["totals"].IsArray())
+        {
+            const Value &totals = repeatObj["totals"];
+            for (SizeType i = 0; i < totals.Size(); i++)
+            {
+                if (totals[i].IsString())
+                    repeat.totals.push_back(totals[i].GetString());
+            }
+        }
+    }
+    return repeat;
+}
+
+void PDFJson::countRecord(const TemplateRepeat &repeat, const TemplateValues &record) const
+{
+    if (!countRecords)
+        return;
+    std::string prefix = "doc." + repeat.source;
+    pdf->addToDocumentValue(prefix + ".count", 1);
+    for (const auto &field : repeat.totals)
+    {
+        auto it = record.find(field);
+        if (it != record.end())
+            pdf->addToDocumentValue(prefix + ".total." + field, std::strtod(it->second.c_str(), nullptr));
+    }
+}
+
+TemplateCondition PDFJson::compileCondition(const Value &obj) const
+{
+    TemplateCondition condition;
+    auto field = getString(obj, "if");
+    if (!field.empty() && field[0] == '!')
+    {
+        condition.negate = true;
+        field.erase(0, 1);
+    }
+    condition.field = field;
+    return condition;
+}
+
+std::shared_ptr<const CompiledTemplate> TemplateCache::get(const std::string &json)
+{
+    uint64_t hash = hashBytes(json.data(), json.size());
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mTemplates.find(hash);
+        if (it != mTemplates.end() && it->second->source == json)
+            return it->second;
+    }
+
+    // Compiled outside the lock; if two threads race, both results are equivalent
+    std::shared_ptr<PDFCreator> pdf;
+    PDFJson compiler(pdf);
+    std::shared_ptr<const CompiledTemplate> tpl = compiler.compileTemplate(json);
+    if (!tpl)
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTemplates[hash] = tpl;
+    return tpl;
+}
+
+size_t TemplateCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mTemplates.size();
+}
+
+void TemplateCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTemplates.clear();
+}
+
+void PDFJson::compileObjects(const Value &container, CompiledTemplate &tpl, CompiledPage &page) const
+{
+    if (!container.IsObject() || !hasMember(container, "objects") || !container["objects"].IsArray())
+        return;
+
+    const Value &objectsArray = container["objects"];
+    for (SizeType i = 0; i < objectsArray.Size(); i++)
+    {
+        const Value &obj = objectsArray[i];
+        if (!obj.IsObject())
+            continue;
+
+        CompiledOp op;
+        auto type = getString(obj, "type");
+        if (type == "text")
+        {
+            op.kind = CompiledOp::Kind::TEXT;
+            op.index = tpl.texts.size();
+            tpl.texts.push_back(compileText(obj, tpl.fonts));
+            op.pageDependent = tpl.texts.back().content.uses("PAGE_NUMBER");
+        }
+        else if (type == "table")
+        {
+            op.kind = CompiledOp::Kind::TABLE;
+            op.index = tpl.tables.size();
+            tpl.tables.push_back(compileTable(obj, tpl.config.font_size, tpl.fonts));
+            for (const auto &row : tpl.tables.back().rows)
+            {
+                for (const auto &cell : row.cells)
+                    op.pageDependent = op.pageDependent || cell.content.uses("PAGE_NUMBER");
+            }
+        }
+        else if (type == "photo")
+        {
+            op.kind = CompiledOp::Kind::PHOTO;
+            op.index = tpl.photos.size();
+            tpl.photos.push_back(compilePhoto(obj));
+        }
+        else if (type == "line" || type == "circle" || type == "rectangle" || type == "square" || type == "triangle")
+        {
+            CompiledShape shape;
+            if (!compileShape(obj, shape))
+            {
+                log(LogLevel::ERROR, "Failed to process shape", static_cast<int>(i));
+                continue;
+            }
+            op.kind = CompiledOp::Kind::SHAPE;
+            op.index = tpl.shapes.size();
+            tpl.shapes.push_back(shape);
+        }
+        else
+        {
+            continue;
+        }
+        op.repeat = compileRepeat(obj);
+        op.condition = compileCondition(obj);
+        page.ops.push_back(op);
+    }
+}
+
+std::shared_ptr<CompiledTemplate> PDFJson::compileTemplate(const std::string &json) const
+{
+    Document document;
+    document.Parse(json.c_str(), json.size());
+    if (document.HasParseError())
+    {
+        log(LogLevel::ERROR, "JSON process error");
+        return nullptr;
+    }
+    if (!document.IsObject())
+    {
+        log(LogLevel::ERROR, "Root is not an object");
+        return nullptr;
+    }
+
+    auto tpl = std::make_shared<CompiledTemplate>();
+    tpl->hash = hashBytes(json.data(), json.size());
+    tpl->source = json;
+    tpl->config = readConfig(document);
+    tpl->fileName = TemplateString(tpl->config.file_name);
+
+    if (hasMember(document, "header"))
+    {
+        tpl->hasHeader = true;
+        compileObjects(document["header"], *tpl, tpl->header);
+    }
+    if (hasMember(document, "footer"))
+    {
+        tpl->hasFooter = true;
+        compileObjects(document["footer"], *tpl, tpl->footer);
+    }
+
+    if (hasMember(document, "pages") && document["pages"].IsArray())
+    {
+        const Value &pagesArray = document["pages"];
+        tpl->pages.reserve(pagesArray.Size());
+        for (SizeType i = 0; i < pagesArray.Size(); i++)
+        {
+            const Value &pageObj = pagesArray[i];
+            CompiledPage page;
+            if (pageObj.IsObject())
+            {
+                page.margin = getDouble(pageObj, "margin");
+                page.headerHeight = getDouble(pageObj, "header_height");
+                page.footerHeight = getDouble(pageObj, "footer_height");
+                compileObjects(pageObj, *tpl, page);
+            }
+            tpl->pages.push_back(std::move(page));
+        }
+    }
+    return tpl;
+}
+
+void PDFJson::emitOps(PDFFormXObject *xObject, const CompiledTemplate &tpl, const CompiledPage &page,
+                      const std::vector<std::shared_ptr<PDFUsedFont>> &fonts, const TemplateValues &values,
+                      int pageNumber, HeaderFooterPart part) const
+{
+    countRecords = part != HeaderFooterPart::DYNAMIC || countedParts.insert(&page).second;
+    for (const auto &op : page.ops)
+    {
+        if (part != HeaderFooterPart::ALL && op.pageDependent != (part == HeaderFooterPart::DYNAMIC))
+            continue;
+
+        if (!op.repeat.isSet())
+        {
+            if (!op.condition.isSet() || op.condition.test(values, nullptr))
+                emitOp(xObject, tpl, op, fonts, values, pageNumber, nullptr, 0, 0);
+            continue;
+        }
+
+        // Records are drawn as they are read; the condition is tested against each one
+        auto source = openDataSource(op.repeat);
+        if (!source)
+            continue;
+        TemplateValues record;
+        double dx = 0, dy = 0;
+        while (source->next(record))
+        {
+            if (op.condition.isSet() && !op.condition.test(values, &record))
+                continue;
+            emitOp(xObject, tpl, op, fonts, values, pageNumber, &record, dx, dy);
+            countRecord(op.repeat, record);
+            dx += op.repeat.dx;
+            dy += op.repeat.dy;
+        }
+    }
+    countRecords = true;
+}
+
+void PDFJson::emitOp(PDFFormXObject *xObject, const CompiledTemplate &tpl, const CompiledOp &op,
+                     const std::vector<std::shared_ptr<PDFUsedFont>> &fonts, const TemplateValues &values,
+                     int pageNumber, const TemplateValues *record, double dx, double dy) const
+{
+    static const char *const spanNames[] = {"text", "table", "photo", "shape"};
+    TraceSpan span(tracer.get(), spanNames[static_cast<int>(op.kind)], "object");
+    switch (op.kind)
+    {
+    case CompiledOp::Kind::TEXT:
+        emitText(xObject, tpl.texts[op.index], fonts, values, pageNumber, record, dx, dy);
+        break;
+    case CompiledOp::Kind::TABLE:
+        emitTable(xObject, tpl.tables[op.index], fonts, values, pageNumber, record, dx, dy);
+        break;
+    case CompiledOp::Kind::PHOTO:
+        emitPhoto(xObject, tpl.photos[op.index], dx, dy);
+        break;
+    case CompiledOp::Kind::SHAPE:
+        emitShape(xObject, tpl.shapes[op.index], dx, dy);
+        break;
+    }
+}
+
+bool PDFJson::processTemplate(const CompiledTemplate &tpl, const TemplateValues &values)
+{
+    clear();
+    config = tpl.config;
+    config.file_name = tpl.fileName.render(values, 0);
+    if (!createPdf())
+        return false;
+
+    auto fonts = resolveFonts(tpl.fonts);
+    for (const auto &part : {std::make_pair(&tpl.header, &headerForms), std::make_pair(&tpl.footer, &footerForms)})
+    {
+        for (const auto &op : part.first->ops)
+        {
+            if (op.pageDependent)
+                part.second->hasDynamic = true;
+            else
+                part.second->hasStatic = true;
+        }
+    }
+    if (tpl.hasHeader || tpl.hasFooter)
+    {
+        pdf->initPageFunc = [&tpl, &fonts, &values, this](int p)
+        {
+            placeHeadersAndFooters(tpl.hasHeader, tpl.hasFooter, p,
+                                   [this, &tpl](bool isHeader)
+                                   {
+                                       for (const auto &op : (isHeader ? tpl.header : tpl.footer).ops)
+                                       {
+                                           if (op.kind == CompiledOp::Kind::PHOTO)
+                                               pdf->preloadImage(tpl.photos[op.index].path, tpl.photos[op.index].index);
+                                       }
+                                   },
+                                   [this, &tpl, &fonts, &values, p](PDFFormXObject *xObject, bool isHeader, HeaderFooterPart part)
+                                   {
+                                       emitOps(xObject, tpl, isHeader ? tpl.header : tpl.footer, fonts, values, p, part);
+                                       return true;
+                                   });
+        };
+    }
+
+    for (const auto &page : tpl.pages)
+    {
+        beginPage(page.margin, page.headerHeight, page.footerHeight);
+        emitOps(nullptr, tpl, page, fonts, values, pdf->pageNumber);
+    }
+
+    return endDocument();
+}
@@ -0,0 +1,135 @@
+#include "BriskyPdfThreadPool.h"
+#include <atomic>
+
+namespace {
+thread_local const ThreadPool *tlsPool = nullptr;
+thread_local size_t tlsIndex = 0;
+}
+
+ThreadPool::ThreadPool(size_t threads)
+{
+    for (size_t i = 0; i < threads; ++i)
+    {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::workerLoop(size_t index)
+{
+    tlsPool = this;
+    tlsIndex = index;
+    for (;;)
+    {
+        std::packaged_task<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]
+                      { return stopping || !tasks.empty(); });
+            if (stopping && tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task)
+{
+    std::packaged_task<void()> packaged(std::move(task));
+    auto future = packaged.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(packaged));
+    }
+    wake.notify_one();
+    return future;
+}
+
+size_t ThreadPool::participantIndex() const
+{
+    return tlsPool == this ? tlsIndex : workers.size();
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain,
+                             const std::function<void(size_t, size_t, size_t)> &fn)
+{
+    if (count == 0)
+        return;
+    if (grain == 0)
+        grain = 1;
+
+    size_t chunks = (count + grain - 1) / grain;
+    if (workers.empty() || chunks == 1)
+    {
+        fn(0, count, participantIndex());
+        return;
+    }
+
+    // Shared with the helper tasks, which may start after this call returned;
+    // they only touch fn while a chunk is still unclaimed.
+    struct State
+    {
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::exception_ptr error;
+    };
+    auto state = std::make_shared<State>();
+    auto *body = &fn;
+
+    auto run = [state, body, count, grain, chunks](size_t participant)
+    {
+        for (;;)
+        {
+            size_t chunk = state->next.fetch_add(1);
+            if (chunk >= chunks)
+                return;
+            size_t begin = chunk * grain;
+            size_t end = std::min(count, begin + grain);
+            try
+            {
+                (*body)(begin, end, participant);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (!state->error)
+                    state->error = std::current_exception();
+            }
+            if (state->done.fetch_add(1) + 1 == chunks)
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->finished.notify_all();
+            }
+        }
+    };
+
+    size_t helpers = std::min(workers.size(), chunks - 1);
+    for (size_t i = 0; i < helpers; ++i)
+    {
+        submit([this, run]
+               { run(participantIndex()); });
+    }
+    run(participantIndex());
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&state, chunks]
+                         { return state->done.load() == chunks; });
+    if (state->error)
+        std::rethrow_exception(state->error);
+}
@@ -0,0 +1,107 @@
+#include "BriskyPdfTrace.h"
+#include <cstdio>
+#include <fstream>
+
+namespace {
+
+void appendEscaped(std::string &out, const char *text)
+{
+    for (const char *p = text; *p; ++p)
+    {
+        unsigned char c = static_cast<unsigned char>(*p);
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += static_cast<char>(c);
+        }
+        else if (c < 0x20)
+        {
+            char buffer[8];
+            std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            out += buffer;
+        }
+        else
+        {
+            out += static_cast<char>(c);
+        }
+    }
+}
+
+}
+
+uint32_t Tracer::threadId()
+{
+    static std::atomic<uint32_t> next{1};
+    thread_local uint32_t id = next.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+void Tracer::record(const char *name, const char *category, Clock::time_point start, Clock::time_point end,
+                    std::string detail)
+{
+    Event event;
+    event.name = name;
+    event.category = category;
+    event.detail = std::move(detail);
+    event.tid = threadId();
+    event.startNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(start - mEpoch).count();
+    event.durationNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEvents.push_back(std::move(event));
+}
+
+std::vector<Tracer::Event> Tracer::events() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mEvents;
+}
+
+void Tracer::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEvents.clear();
+}
+
+// Complete ("X") events in microseconds; the viewer nests them by time on each thread
+std::string Tracer::toJson() const
+{
+    std::vector<Event> snapshot = events();
+
+    std::string out;
+    out.reserve(64 + snapshot.size() * 128);
+    out += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    char buffer[96];
+    for (size_t i = 0; i < snapshot.size(); ++i)
+    {
+        const Event &event = snapshot[i];
+        if (i > 0)
+            out += ',';
+        out += "\n{\"name\":\"";
+        appendEscaped(out, event.name);
+        out += "\",\"cat\":\"";
+        appendEscaped(out, event.category);
+        std::snprintf(buffer, sizeof(buffer), "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                      event.tid, event.startNanos / 1000.0, event.durationNanos / 1000.0);
+        out += buffer;
+        if (!event.detail.empty())
+        {
+            out += ",\"args\":{\"detail\":\"";
+            appendEscaped(out, event.detail.c_str());
+            out += "\"}";
+        }
+        out += '}';
+    }
+    out += "\n]}\n";
+    return out;
+}
+
+bool Tracer::writeFile(const std::string &path) const
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+    std::string json = toJson();
+    file.write(json.data(), json.size());
+    return static_cast<bool>(file);
+}